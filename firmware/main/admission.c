@@ -0,0 +1,150 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : admission.c
+ * PURPOSE     : Packet admission module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Everything here reads the header only, so junk, old and replayed
+ * packets are dropped before MD5 and the RSA verify. Signed packets, RSA
+ * and Merkle alike, also spend a token of their source address bucket,
+ * session packets only cost an HMAC and are not limited. */
+
+#include "admission.h"
+
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "encryption.h"
+#include "session.h"
+
+/* Sources tracked at once, the least recently seen one is replaced */
+#define ADMISSION_SOURCES 8
+
+/* Signed packets per second and burst per source */
+#define ADMISSION_RATE  4
+#define ADMISSION_BURST 8
+
+/* Credit of one token, bucket gains ADMISSION_RATE credit a microsecond */
+#define TOKEN_US 1000000LL
+
+static const char TAG[] = "admission";
+
+struct source {
+    IP ip;
+    int64_t updated;
+    int64_t credit;
+};
+
+static struct source sources[ADMISSION_SOURCES];
+
+static struct admission_stats stats;
+static struct admission_stats logged;
+
+static struct source *admission_source(IP ip, int64_t now) {
+    struct source *slot = &sources[0];
+    for (int i = 0; i < ADMISSION_SOURCES; i++) {
+        if (sources[i].updated != 0 && sources[i].ip == ip) {
+            return &sources[i];
+        }
+        if (sources[i].updated < slot->updated) {
+            slot = &sources[i];
+        }
+    }
+
+    // New source starts with a full bucket
+    slot->ip = ip;
+    slot->updated = now;
+    slot->credit = ADMISSION_BURST * TOKEN_US;
+    return slot;
+}
+
+/* Token bucket, refills ADMISSION_RATE tokens a second */
+static bool admission_take(IP ip) {
+    int64_t now = esp_timer_get_time();
+    struct source *source = admission_source(ip, now);
+
+    source->credit += (now - source->updated) * ADMISSION_RATE;
+    if (source->credit > ADMISSION_BURST * TOKEN_US) {
+        source->credit = ADMISSION_BURST * TOKEN_US;
+    }
+    source->updated = now;
+
+    if (source->credit < TOKEN_US) {
+        return false;
+    }
+    source->credit -= TOKEN_US;
+    return true;
+}
+
+static enum admission admission_header(IP source, const byte *data, size_t size) {
+    if (size < sizeof(struct payload)) {
+        return ADMISSION_MALFORMED;
+    }
+
+    const struct payload *header = (const struct payload *) data;
+    size_t trailer_size = encryption_trailer_size(header);
+    if (header->version != PAYLOAD_VERSION || trailer_size == 0 ||
+        size != sizeof(struct payload) + header->size + trailer_size) {
+        return ADMISSION_MALFORMED;
+    }
+
+    if (!encryption_fresh(header->timestamp)) {
+        return ADMISSION_STALE;
+    }
+
+    if (header->auth == AUTH_SESSION) {
+        const struct session_tag *tag = (const struct session_tag *) (data + sizeof(struct payload) + header->size);
+        return session_admit(tag) ? ADMISSION_ACCEPTED : ADMISSION_REPLAY;
+    }
+
+    if (!encryption_sequential(header->timestamp, AUTH_IS_MERKLE(header->auth))) {
+        return ADMISSION_REPLAY;
+    }
+    return admission_take(source) ? ADMISSION_ACCEPTED : ADMISSION_LIMITED;
+}
+
+enum admission admission_check(IP source, const byte *data, size_t size) {
+    enum admission result = admission_header(source, data, size);
+
+    stats.count[result]++;
+    if (result != ADMISSION_ACCEPTED) {
+        ESP_LOGW(TAG, "Rejected packet from " IP_FORMAT ", reason %i", IP_FORMAT_DATA(source), result);
+        if (result != ADMISSION_MALFORMED && ((const struct payload *) data)->auth != AUTH_SESSION) {
+            stats.avoided++;
+        }
+    }
+    return result;
+}
+
+void admission_verified(int64_t us) {
+    stats.verified++;
+    stats.verify_us += us;
+}
+
+void admission_get_stats(struct admission_stats *result) {
+    memcpy(result, &stats, sizeof(stats));
+}
+
+void admission_log(void) {
+    if (memcmp(&stats, &logged, sizeof(stats)) == 0) {
+        return;
+    }
+    logged = stats;
+
+    uint32_t average_us = stats.verified == 0 ? 0 : (uint32_t) (stats.verify_us / stats.verified);
+    ESP_LOGI(TAG, "Accepted %u, malformed %u, stale %u, replay %u, limited %u",
+             stats.count[ADMISSION_ACCEPTED], stats.count[ADMISSION_MALFORMED], stats.count[ADMISSION_STALE],
+             stats.count[ADMISSION_REPLAY], stats.count[ADMISSION_LIMITED]);
+    ESP_LOGI(TAG, "Verified %u (%uus avg), avoided %u (~%ums)",
+             stats.verified, average_us, stats.avoided, (unsigned) ((uint64_t) stats.avoided * average_us / 1000));
+}
@@ -0,0 +1,54 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : admission.h
+ * PURPOSE     : Packet admission module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __ADMISSION_H_
+#define __ADMISSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <wolfssl/wolfcrypt/types.h>
+
+#include "sockets.h"
+
+enum admission {
+    ADMISSION_ACCEPTED,
+    ADMISSION_MALFORMED, /* Size, version or authentication */
+    ADMISSION_STALE,     /* Timestamp out of the window */
+    ADMISSION_REPLAY,    /* Timestamp or session counter already used */
+    ADMISSION_LIMITED,   /* Source spent its signature budget */
+
+    ADMISSION_TOTAL
+};
+
+struct admission_stats {
+    uint32_t count[ADMISSION_TOTAL];
+    uint32_t avoided;   /* Rejected signed packets, verify never ran */
+    uint32_t verified;  /* RSA and Merkle verifications done */
+    uint64_t verify_us; /* Time spent in them */
+};
+
+/* Header only checks done before any crypto */
+enum admission admission_check(IP source, const byte *data, size_t size);
+
+/* Accounts one signed packet verification */
+void admission_verified(int64_t us);
+
+void admission_get_stats(struct admission_stats *stats);
+
+/* Logs counters if they changed since the last call */
+void admission_log(void);
+
+#endif /* __ADMISSION_H_ */
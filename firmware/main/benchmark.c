@@ -0,0 +1,128 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : benchmark.c
+ * PURPOSE     : On-device primitive timing
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Runs are timed with the CPU cycle counter, which wraps after about
+ * 50 seconds at 80 MHz, far above one RSA verify. The server task yields
+ * a tick between runs, so long benchmarks do not starve the idle task. */
+
+#include "benchmark.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+
+#include "board.h"
+#include "encryption.h"
+#include "pump_driver.h"
+#include "storage.h"
+
+#define BENCHMARK_NVS_KEY "bench"
+
+/* Size of the blob storage_read fetches, about a calibration curve */
+#define BENCHMARK_BLOB_SIZE 64
+
+static const char TAG[] = "benchmark";
+
+struct benchmark_context {
+    const uint8_t *data;
+    size_t data_size;
+    pump_mask_t mask;
+};
+
+static int benchmark_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static bool benchmark_once(enum benchmark_primitive primitive, const struct benchmark_context *context) {
+    switch (primitive) {
+        case BENCHMARK_MD5: {
+            byte md5[ENCRYPTION_MD5_SIZE];
+            return encryption_md5(context->data, context->data_size, md5);
+        }
+        case BENCHMARK_VERIFY: {
+            byte md5[ENCRYPTION_MD5_SIZE];
+            memcpy(md5, context->data, sizeof(md5));
+            return encryption_verify(md5, context->data + sizeof(struct benchmark_request),
+                                     context->data_size - sizeof(struct benchmark_request));
+        }
+        case BENCHMARK_STORAGE_READ: {
+            byte blob[BENCHMARK_BLOB_SIZE];
+            size_t blob_size = sizeof(blob);
+            return storage_read(BENCHMARK_NVS_KEY, blob, &blob_size);
+        }
+        case BENCHMARK_OUTPUT_WRITE:
+            return pump_driver_refresh(context->mask);
+        case BENCHMARK_TOTAL:
+            break;
+    }
+    return false;
+}
+
+size_t benchmark_run(const uint8_t *data, size_t data_size, uint32_t iterations, uint32_t pin,
+                     uint8_t *reply, size_t size) {
+    struct benchmark_context context = {data, data_size, 0};
+    struct benchmark_report *report = (struct benchmark_report *) reply;
+    size_t reply_size = sizeof(*report) + BENCHMARK_TOTAL * sizeof(struct benchmark_result);
+    uint32_t cycles[BENCHMARK_MAX_ITERATIONS];
+
+    if (iterations == 0 || iterations > BENCHMARK_MAX_ITERATIONS || pin >= pump_driver_channels()) {
+        ESP_LOGE(TAG, "Invalid benchmark of %u runs on pin %u", iterations, pin);
+        return 0;
+    }
+    if (data_size != sizeof(struct benchmark_request) + encryption_signature_size() || size < reply_size) {
+        ESP_LOGE(TAG, "Invalid benchmark data size %u", data_size);
+        return 0;
+    }
+    context.mask = PUMP_MASK(pin);
+
+    // storage_read needs the key to exist, written once per device
+    byte blob[BENCHMARK_BLOB_SIZE];
+    size_t blob_size = sizeof(blob);
+    if (!storage_read(BENCHMARK_NVS_KEY, blob, &blob_size)) {
+        memset(blob, 0x5A, sizeof(blob));
+        if (!storage_write(BENCHMARK_NVS_KEY, blob, sizeof(blob))) {
+            return 0;
+        }
+    }
+
+    report->cpu_mhz = ets_get_cpu_frequency();
+    report->iterations = iterations;
+    report->count = BENCHMARK_TOTAL;
+    for (int primitive = 0; primitive < BENCHMARK_TOTAL; primitive++) {
+        for (uint32_t i = 0; i < iterations; i++) {
+            vTaskDelay(1);
+            uint32_t start = board_ccount();
+            bool ok = benchmark_once(primitive, &context);
+            cycles[i] = board_ccount() - start;
+            if (!ok) {
+                ESP_LOGE(TAG, "Primitive %d failed", primitive);
+                return 0;
+            }
+        }
+        qsort(cycles, iterations, sizeof(cycles[0]), benchmark_compare);
+
+        struct benchmark_result *result = (struct benchmark_result *) (reply + sizeof(*report)) + primitive;
+        result->primitive = primitive;
+        result->min = cycles[0];
+        result->median = cycles[iterations / 2];
+        result->max = cycles[iterations - 1];
+        ESP_LOGI(TAG, "Primitive %d: %u/%u/%u cycles", primitive, result->min, result->median, result->max);
+    }
+    return reply_size;
+}
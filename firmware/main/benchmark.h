@@ -0,0 +1,30 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : benchmark.h
+ * PURPOSE     : On-device primitive timing
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __BENCHMARK_H_
+#define __BENCHMARK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+/* Runs every benchmark_primitive `iterations` times. `data` is struct
+ * benchmark_request with its signature, `pin` the output to write.
+ * Fills `reply` with struct benchmark_report and results.
+ * Returns reply size, 0 on failure */
+size_t benchmark_run(const uint8_t *data, size_t data_size, uint32_t iterations, uint32_t pin,
+                     uint8_t *reply, size_t size);
+
+#endif /* __BENCHMARK_H_ */
@@ -0,0 +1,72 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : board.h
+ * PURPOSE     : Pump board profiles.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __BOARD_H_
+#define __BOARD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "driver/gpio.h"
+
+#include "pump_driver.h"
+
+#define BOARD_GPIO8    1 /* Eight ESP8266 GPIOs, the original wiring */
+#define BOARD_HC595    2 /* Chained 74HC595 shift registers */
+#define BOARD_MCP23017 3 /* MCP23017 16 channel I2C expanders */
+#define BOARD_SIM      4 /* Recorded outputs of the host simulator, sim/ */
+
+/* Selected with -DBOARD_PROFILE=... */
+#ifndef BOARD_PROFILE
+#define BOARD_PROFILE BOARD_GPIO8
+#endif
+
+/* 74HC595 chain, channel 0 is Q0 of the chip nearest to the ESP.
+ * OE has a pull-up on the board, outputs stay off until the first flush */
+#define BOARD_HC595_CHIPS 4
+#define BOARD_HC595_DATA  GPIO_NUM_13
+#define BOARD_HC595_CLOCK GPIO_NUM_14
+#define BOARD_HC595_LATCH GPIO_NUM_12
+#define BOARD_HC595_OE    GPIO_NUM_5
+
+/* MCP23017 chips at consecutive addresses, channel 0 is GPA0 of the first */
+#define BOARD_MCP23017_CHIPS   2
+#define BOARD_MCP23017_ADDRESS 0x20
+#define BOARD_I2C_SDA          GPIO_NUM_4
+#define BOARD_I2C_SCL          GPIO_NUM_5
+
+struct pump_board {
+    const char *name;
+    size_t channels;
+    bool (*init)(void);
+
+    /* Drives `changed` channels to their `state` bits in one bus transfer,
+     * `skew_cycles` receives CPU cycles between the first and the last
+     * switched output */
+    bool (*flush)(pump_mask_t state, pump_mask_t changed, uint32_t *skew_cycles);
+};
+
+extern const struct pump_board pump_board_gpio8;
+extern const struct pump_board pump_board_hc595;
+extern const struct pump_board pump_board_mcp23017;
+extern const struct pump_board pump_board_sim;
+
+static inline uint32_t board_ccount(void) {
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
+#endif /* __BOARD_H_ */
@@ -0,0 +1,117 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : board_gpio.c
+ * PURPOSE     : Pumps on ESP8266 GPIOs board profile.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#include "board.h"
+
+#include "esp8266/gpio_struct.h"
+#include "esp_log.h"
+
+static const char TAG[] = "board_gpio";
+
+static const int pin_to_gpio[] = {
+        GPIO_NUM_16,
+        GPIO_NUM_5,
+        GPIO_NUM_4,
+        GPIO_NUM_0,
+        GPIO_NUM_2,
+        GPIO_NUM_14,
+        GPIO_NUM_12,
+        GPIO_NUM_13,
+};
+static const size_t pins_count = sizeof(pin_to_gpio) / sizeof(pin_to_gpio[0]);
+
+/* GPIO16 lives in the RTC block and can't be written together with
+ * GPIO0-15, it gets its own write after the main register */
+#define RTC_GPIO GPIO_NUM_16
+
+static bool board_gpio_init(void) {
+    esp_err_t err;
+
+    for (int i = 0; i < pins_count; i++) {
+        gpio_num_t gpio_pin = pin_to_gpio[i];
+
+        err = gpio_set_pull_mode(gpio_pin, GPIO_FLOATING);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "gpio pullmode failed for GPIO%d: %s",
+                     gpio_pin, esp_err_to_name(err));
+            return false;
+        }
+
+        err = gpio_set_direction(gpio_pin, GPIO_MODE_OUTPUT);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "gpio direction failed for GPIO%d: %s",
+                     gpio_pin, esp_err_to_name(err));
+            return false;
+        }
+
+        err = gpio_set_level(gpio_pin, 0);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "gpio_set_level(0) failed for GPIO%d: %s",
+                     gpio_pin, esp_err_to_name(err));
+            return false;
+        }
+    }
+
+    ESP_LOGI(TAG, "Configured %u GPIOs and set to LOW", pins_count);
+    return true;
+}
+
+static bool board_gpio_flush(pump_mask_t state, pump_mask_t changed, uint32_t *skew_cycles) {
+    uint32_t set_mask = 0, clear_mask = 0;
+    bool rtc = false, rtc_on = false;
+
+    for (size_t i = 0; i < pins_count; i++) {
+        if (!(changed & PUMP_MASK(i))) {
+            continue;
+        }
+        if (pin_to_gpio[i] == RTC_GPIO) {
+            rtc = true;
+            rtc_on = (state & PUMP_MASK(i)) != 0;
+        } else if (state & PUMP_MASK(i)) {
+            set_mask |= 1 << pin_to_gpio[i];
+        } else {
+            clear_mask |= 1 << pin_to_gpio[i];
+        }
+    }
+
+    uint32_t start = board_ccount();
+    if (set_mask != 0) {
+        GPIO.out_w1ts = set_mask;
+    }
+    if (clear_mask != 0) {
+        GPIO.out_w1tc = clear_mask;
+    }
+
+    esp_err_t err = ESP_OK;
+    if (rtc) {
+        err = gpio_set_level(RTC_GPIO, rtc_on ? 1 : 0);
+    }
+    uint32_t end = board_ccount();
+
+    *skew_cycles = rtc && (set_mask | clear_mask) != 0 ? end - start : 0;
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "gpio_set_level failed for GPIO%d: %s",
+                 RTC_GPIO, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+const struct pump_board pump_board_gpio8 = {
+        .name = "gpio8",
+        .channels = sizeof(pin_to_gpio) / sizeof(pin_to_gpio[0]),
+        .init = board_gpio_init,
+        .flush = board_gpio_flush,
+};
@@ -0,0 +1,88 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : board_hc595.c
+ * PURPOSE     : Pumps on chained 74HC595 board profile.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* The whole chain is shifted in by direct GPIO register writes and
+ * every output switches on the single latch edge, so channels have no
+ * skew and a flush of 32 channels takes a few microseconds. None of
+ * the used GPIOs are boot strapping pins. */
+
+#include "board.h"
+
+#include "esp8266/gpio_struct.h"
+#include "esp_log.h"
+
+#define HC595_CHANNELS (BOARD_HC595_CHIPS * 8)
+
+#define BIT(GPIO) (1 << (GPIO))
+
+static const char TAG[] = "board_hc595";
+
+static bool enabled = false;
+
+static bool board_hc595_flush(pump_mask_t state, pump_mask_t changed, uint32_t *skew_cycles) {
+    // First shifted bit ends up in the last chip
+    for (int channel = HC595_CHANNELS - 1; channel >= 0; channel--) {
+        if (state & PUMP_MASK(channel)) {
+            GPIO.out_w1ts = BIT(BOARD_HC595_DATA);
+        } else {
+            GPIO.out_w1tc = BIT(BOARD_HC595_DATA);
+        }
+        GPIO.out_w1ts = BIT(BOARD_HC595_CLOCK);
+        GPIO.out_w1tc = BIT(BOARD_HC595_CLOCK);
+    }
+
+    GPIO.out_w1ts = BIT(BOARD_HC595_LATCH);
+    GPIO.out_w1tc = BIT(BOARD_HC595_LATCH);
+
+    if (!enabled) {
+        GPIO.out_w1tc = BIT(BOARD_HC595_OE);
+        enabled = true;
+    }
+
+    *skew_cycles = 0;
+    return true;
+}
+
+static bool board_hc595_init(void) {
+    gpio_config_t config = {
+            .pin_bit_mask = BIT(BOARD_HC595_DATA) | BIT(BOARD_HC595_CLOCK) |
+                            BIT(BOARD_HC595_LATCH) | BIT(BOARD_HC595_OE),
+            .mode = GPIO_MODE_OUTPUT,
+            .pull_up_en = GPIO_PULLUP_DISABLE,
+            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+            .intr_type = GPIO_INTR_DISABLE,
+    };
+
+    // Outputs stay disabled while the registers hold power-on garbage
+    GPIO.out_w1ts = BIT(BOARD_HC595_OE);
+    GPIO.out_w1tc = BIT(BOARD_HC595_DATA) | BIT(BOARD_HC595_CLOCK) | BIT(BOARD_HC595_LATCH);
+
+    esp_err_t err = gpio_config(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "gpio_config failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    uint32_t unused;
+    board_hc595_flush(0, ~(pump_mask_t) 0, &unused);
+    ESP_LOGI(TAG, "Configured %u chained 74HC595", BOARD_HC595_CHIPS);
+    return true;
+}
+
+const struct pump_board pump_board_hc595 = {
+        .name = "hc595",
+        .channels = HC595_CHANNELS,
+        .init = board_hc595_init,
+        .flush = board_hc595_flush,
+};
@@ -0,0 +1,125 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : board_mcp23017.c
+ * PURPOSE     : Pumps on MCP23017 I2C expanders board profile.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Every chip with changed channels gets both output latches in one
+ * write, writes of all chips are queued into one I2C command and run
+ * with a single i2c_master_cmd_begin(). Channels of one chip switch
+ * together, chips follow each other by one write time. */
+
+#include "board.h"
+
+#include "driver/i2c.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+#define MCP23017_CHANNELS (BOARD_MCP23017_CHIPS * 16)
+
+/* Registers in the default IOCON.BANK = 0 layout, address auto increments */
+#define MCP23017_IODIRA 0x00
+#define MCP23017_OLATA  0x14
+
+#define I2C_PORT I2C_NUM_0
+
+#define I2C_TIMEOUT_MS 100
+
+static const char TAG[] = "board_mcp23017";
+
+/* Writes `values` from register `reg` of every chip in `chips` mask */
+static bool board_mcp23017_write(uint32_t chips, uint8_t reg, const uint16_t *values) {
+    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+    if (cmd == NULL) {
+        return false;
+    }
+
+    for (int chip = 0; chip < BOARD_MCP23017_CHIPS; chip++) {
+        if (!(chips & (1 << chip))) {
+            continue;
+        }
+        uint8_t data[] = {reg, values[chip] & 0xFF, values[chip] >> 8};
+        i2c_master_start(cmd);
+        i2c_master_write_byte(cmd, ((BOARD_MCP23017_ADDRESS + chip) << 1) | I2C_MASTER_WRITE, true);
+        i2c_master_write(cmd, data, sizeof(data), true);
+    }
+    i2c_master_stop(cmd);
+
+    esp_err_t err = i2c_master_cmd_begin(I2C_PORT, cmd, I2C_TIMEOUT_MS / portTICK_PERIOD_MS);
+    i2c_cmd_link_delete(cmd);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "I2C write of 0x%02X failed: %s", reg, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+static bool board_mcp23017_flush(pump_mask_t state, pump_mask_t changed, uint32_t *skew_cycles) {
+    uint16_t values[BOARD_MCP23017_CHIPS];
+    uint32_t chips = 0;
+
+    for (int chip = 0; chip < BOARD_MCP23017_CHIPS; chip++) {
+        values[chip] = (state >> (chip * 16)) & 0xFFFF;
+        if ((changed >> (chip * 16)) & 0xFFFF) {
+            chips |= 1 << chip;
+        }
+    }
+    if (chips == 0) {
+        *skew_cycles = 0;
+        return true;
+    }
+
+    uint32_t start = board_ccount();
+    bool ok = board_mcp23017_write(chips, MCP23017_OLATA, values);
+    uint32_t end = board_ccount();
+
+    // One chip switches at once, more are apart by the whole transfer
+    *skew_cycles = (chips & (chips - 1)) != 0 ? end - start : 0;
+    return ok;
+}
+
+static bool board_mcp23017_init(void) {
+    i2c_config_t config = {
+            .mode = I2C_MODE_MASTER,
+            .sda_io_num = BOARD_I2C_SDA,
+            .sda_pullup_en = GPIO_PULLUP_ENABLE,
+            .scl_io_num = BOARD_I2C_SCL,
+            .scl_pullup_en = GPIO_PULLUP_ENABLE,
+            .clk_stretch_tick = 300,
+    };
+    const uint16_t off[BOARD_MCP23017_CHIPS] = {0};
+    const uint32_t all = (1 << BOARD_MCP23017_CHIPS) - 1;
+
+    esp_err_t err = i2c_driver_install(I2C_PORT, config.mode);
+    if (err == ESP_OK) {
+        err = i2c_param_config(I2C_PORT, &config);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "I2C setup failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    // Latches are cleared before pins become outputs
+    if (!board_mcp23017_write(all, MCP23017_OLATA, off) ||
+        !board_mcp23017_write(all, MCP23017_IODIRA, off)) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Configured %u MCP23017 from 0x%02X", BOARD_MCP23017_CHIPS, BOARD_MCP23017_ADDRESS);
+    return true;
+}
+
+const struct pump_board pump_board_mcp23017 = {
+        .name = "mcp23017",
+        .channels = MCP23017_CHANNELS,
+        .init = board_mcp23017_init,
+        .flush = board_mcp23017_flush,
+};
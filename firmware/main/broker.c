@@ -0,0 +1,273 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : broker.c
+ * PURPOSE     : MQTT command channel
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* One persistent connection to the site broker instead of a TCP
+ * connection per client. Command packets are the same bytes as over TCP
+ * and go through the same admission and encryption_extract() as server
+ * packets, the broker is not trusted. The client reconnects and
+ * resubscribes by itself, packets published while it is away are lost
+ * and the sender gets no ack.
+ *
+ * Dose events come from pump tasks, which heap tracking watches, and a
+ * QoS 1 publish allocates an outbox entry. They go through a queue to the
+ * broker event task, which is not tracked, and are published there. */
+
+#include "broker.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+
+#include "admission.h"
+#include "pump_state.h"
+#include "secret.h"
+#include "server.h"
+#include "wifi.h"
+
+static const char TAG[] = "broker";
+
+#ifndef BROKER_GROUP
+#define BROKER_GROUP "all"
+#endif /* BROKER_GROUP */
+
+#define BROKER_TOPIC_MAX 64
+
+/* Packets are verified in the client task, RSA needs the stack */
+#define BROKER_TASK_STACK 6144
+
+/* Fits a whole packet, fragmented messages are dropped */
+#define BROKER_BUFFER_SIZE 2048
+
+#define BROKER_KEEPALIVE_S 30
+
+/* Ack header and the largest response frame */
+#define BROKER_ACK_SIZE (sizeof(struct mqtt_ack) + sizeof(struct response) + 1024)
+
+#define BROKER_REPORT_PERIOD_US (30 * 1000000LL)
+
+/* Events waiting for the broker event task, more are dropped */
+#define BROKER_EVENTS_MAX 16
+
+#define BROKER_EVENT_TASK_STACK 2048
+
+static esp_mqtt_client_handle_t client = NULL;
+static broker_handler_t handler = NULL;
+static bool connected = false;
+static QueueHandle_t events = NULL;
+
+static char device[13];
+static char topic_command[BROKER_TOPIC_MAX];
+static char topic_group[BROKER_TOPIC_MAX];
+static char topic_ack[BROKER_TOPIC_MAX];
+static char topic_event[BROKER_TOPIC_MAX];
+static char topic_status[BROKER_TOPIC_MAX];
+static char topic_metrics[BROKER_TOPIC_MAX];
+static char topic_online[BROKER_TOPIC_MAX];
+
+static uint32_t connects = 0;
+static uint32_t packets = 0;
+static uint32_t denied = 0;
+
+void broker_set_handler(broker_handler_t value) {
+    handler = value;
+}
+
+#ifdef BROKER_URI
+
+/* Client task, the only one using `ack` */
+static void broker_packet(const esp_mqtt_event_handle_t event) {
+    static uint8_t ack[BROKER_ACK_SIZE];
+    struct mqtt_ack *header = (struct mqtt_ack *) ack;
+
+    packets++;
+    if (event->current_data_offset != 0 || event->data_len != event->total_data_len) {
+        ESP_LOGE(TAG, "Packet of %i bytes does not fit the buffer", event->total_data_len);
+        denied++;
+        return;
+    }
+    if (handler == NULL || event->data_len < (int) sizeof(struct payload)) {
+        denied++;
+        return;
+    }
+
+    // Echoed before verification, an ack only tells which packet it answers
+    const struct payload *packet = (const struct payload *) event->data;
+    header->timestamp = packet->timestamp;
+    header->id = packet->id;
+    header->command = packet->command;
+
+    size_t size = handler((const uint8_t *) event->data, event->data_len, ack + sizeof(*header), sizeof(ack) - sizeof(*header));
+    if (size == 0) {
+        denied++;
+        return;
+    }
+    if (((const struct response *) (ack + sizeof(*header)))->status == STATUS_DENIED) {
+        denied++;
+    }
+    esp_mqtt_client_publish(client, topic_ack, (const char *) ack, sizeof(*header) + size, 1, 0);
+}
+
+static esp_err_t broker_event(esp_mqtt_event_handle_t event) {
+    switch (event->event_id) {
+        case MQTT_EVENT_CONNECTED:
+            connects++;
+            connected = true;
+            ESP_LOGI(TAG, "Connected as %s, group %s", device, BROKER_GROUP);
+            esp_mqtt_client_subscribe(client, topic_command, 1);
+            esp_mqtt_client_subscribe(client, topic_group, 1);
+            esp_mqtt_client_publish(client, topic_online, "1", 1, 1, 1);
+            break;
+
+        case MQTT_EVENT_DISCONNECTED:
+            connected = false;
+            ESP_LOGW(TAG, "Disconnected");
+            break;
+
+        case MQTT_EVENT_DATA:
+            broker_packet(event);
+            break;
+
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+/* Publishes queued dose events, the only task that does */
+static void broker_event_task(void *pvParameters) {
+    struct pump_event event;
+
+    while (1) {
+        xQueueReceive(events, &event, portMAX_DELAY);
+        if (!connected) {
+            ESP_LOGW(TAG, "Event %u for pin %u not published", event.id, (unsigned) event.pin);
+            continue;
+        }
+        esp_mqtt_client_publish(client, topic_event, (const char *) &event, sizeof(event), 1, 0);
+    }
+}
+
+bool broker_start(void) {
+    uint8_t mac[6];
+
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
+    snprintf(device, sizeof(device), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(topic_command, sizeof(topic_command), MQTT_TOPIC_PREFIX "%s/command", device);
+    snprintf(topic_group, sizeof(topic_group), MQTT_TOPIC_PREFIX "group/%s/command", BROKER_GROUP);
+    snprintf(topic_ack, sizeof(topic_ack), MQTT_TOPIC_PREFIX "%s/ack", device);
+    snprintf(topic_event, sizeof(topic_event), MQTT_TOPIC_PREFIX "%s/event", device);
+    snprintf(topic_status, sizeof(topic_status), MQTT_TOPIC_PREFIX "%s/status", device);
+    snprintf(topic_metrics, sizeof(topic_metrics), MQTT_TOPIC_PREFIX "%s/metrics", device);
+    snprintf(topic_online, sizeof(topic_online), MQTT_TOPIC_PREFIX "%s/online", device);
+
+    const esp_mqtt_client_config_t config = {
+            .uri = BROKER_URI,
+            .event_handle = broker_event,
+            .client_id = device,
+#if defined(BROKER_USER) && defined(BROKER_PASS)
+            .username = BROKER_USER,
+            .password = BROKER_PASS,
+#endif /* BROKER_USER && BROKER_PASS */
+            .lwt_topic = topic_online,
+            .lwt_msg = "0",
+            .lwt_msg_len = 1,
+            .lwt_qos = 1,
+            .lwt_retain = 1,
+            .keepalive = BROKER_KEEPALIVE_S,
+            .task_stack = BROKER_TASK_STACK,
+            .buffer_size = BROKER_BUFFER_SIZE,
+    };
+
+    client = esp_mqtt_client_init(&config);
+    if (client == NULL || esp_mqtt_client_start(client) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't start MQTT client");
+        return false;
+    }
+
+    events = xQueueCreate(BROKER_EVENTS_MAX, sizeof(struct pump_event));
+    if (events == NULL ||
+        xTaskCreate(broker_event_task, "Broker events", BROKER_EVENT_TASK_STACK, NULL, tskIDLE_PRIORITY + 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Can't start broker event task");
+        return false;
+    }
+    return true;
+}
+
+#else /* BROKER_URI */
+
+bool broker_start(void) {
+    ESP_LOGI(TAG, "No BROKER_URI, MQTT is off");
+    return true;
+}
+
+#endif /* BROKER_URI */
+
+void broker_publish_event(const struct pump_event *event) {
+    // Copied into the queue storage, nothing is allocated here
+    if (events == NULL || xQueueSend(events, event, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Event %u for pin %u not published", event->id, (unsigned) event->pin);
+    }
+}
+
+static void broker_metrics(struct device_metrics *metrics) {
+    struct wifi_stats stats;
+    struct admission_stats admission;
+    wifi_ap_record_t ap;
+
+    wifi_get_stats(&stats);
+    admission_get_stats(&admission);
+    metrics->uptime = esp_timer_get_time() / 1000000;
+    metrics->free_heap = esp_get_free_heap_size();
+    metrics->rssi = esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0;
+    metrics->disconnects = stats.disconnects;
+    metrics->last_recover_ms = stats.last_recover_ms;
+    metrics->max_recover_ms = stats.max_recover_ms;
+    metrics->outage = stats.outage_ms / 1000;
+    metrics->broker_connects = connects;
+    metrics->packets = packets;
+    metrics->denied = denied;
+    metrics->verified = admission.verified;
+    metrics->verify_us = admission.verified == 0 ? 0 : (uint32_t) (admission.verify_us / admission.verified);
+    metrics->avoided = admission.avoided;
+    metrics->first_command = server_first_command_time() / 1000;
+}
+
+void broker_report(void) {
+    // Only the calling task uses it
+    static uint8_t status[1024];
+    static int64_t reported = 0;
+    struct device_metrics metrics;
+
+    int64_t now = esp_timer_get_time();
+    if (!connected || now - reported < BROKER_REPORT_PERIOD_US) {
+        return;
+    }
+    reported = now;
+
+    // QoS 0 goes out from the client buffer, the heap is not touched
+    size_t size = pump_state_report(status, sizeof(status));
+    if (size != 0) {
+        esp_mqtt_client_publish(client, topic_status, (const char *) status, size, 0, 0);
+    }
+    broker_metrics(&metrics);
+    esp_mqtt_client_publish(client, topic_metrics, (const char *) &metrics, sizeof(metrics), 0, 0);
+}
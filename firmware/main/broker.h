@@ -0,0 +1,41 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : broker.h
+ * PURPOSE     : MQTT command channel
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __BROKER_H_
+#define __BROKER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+/* Runs a packet that came over MQTT, writes the response frame, header
+ * and data, to `frame` and returns its size. 0 sends no ack */
+typedef size_t (*broker_handler_t)(const uint8_t *packet, size_t size, uint8_t *frame, size_t frame_size);
+
+/* Connects to BROKER_URI of secret.h and keeps the connection,
+ * does nothing without it. Call once Wi-Fi is started */
+bool broker_start(void);
+
+void broker_set_handler(broker_handler_t handler);
+
+/* Queues an event of a dose started over MQTT, the broker event task
+ * publishes it. Safe from heap tracked tasks */
+void broker_publish_event(const struct pump_event *event);
+
+/* Publishes status and metrics once in BROKER_REPORT_PERIOD_US */
+void broker_report(void);
+
+#endif /* __BROKER_H_ */
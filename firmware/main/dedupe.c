@@ -0,0 +1,93 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : dedupe.c
+ * PURPOSE     : Repeated command detection
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* A client that lost a reply sends the command again, freshly signed,
+ * with the same ID. The device answers it with the first result instead
+ * of running it twice. Only the server task uses the cache. */
+
+#include "dedupe.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+/* Commands remembered, enough for retries of a few seconds */
+#define DEDUPE_ENTRIES 16
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+static const char TAG[] = "dedupe";
+
+static struct dedupe_entry entries[DEDUPE_ENTRIES];
+static size_t next = 0;
+
+/* Reads change nothing, session open must give a new session, a repeated
+ * stop must report the channels as they are now */
+static bool dedupe_applies(const struct payload *packet) {
+    return packet->id != 0 && packet->command != CMD_SCHEDULE_GET && packet->command != CMD_HISTORY &&
+           packet->command != CMD_STATUS && packet->command != CMD_SESSION_OPEN &&
+           packet->command != CMD_PUMP_STOP;
+}
+
+/* FNV-1a over command, pin, volume, time, size and the data */
+static uint32_t dedupe_fingerprint(const struct payload *packet, const byte *body) {
+    const byte *fields = (const byte *) packet + offsetof(struct payload, command);
+    uint32_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < sizeof(*packet) - offsetof(struct payload, command); i++) {
+        hash = (hash ^ fields[i]) * FNV_PRIME;
+    }
+    for (size_t i = 0; i < packet->size; i++) {
+        hash = (hash ^ body[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+const struct dedupe_entry *dedupe_find(const struct payload *packet, const byte *body) {
+    if (!dedupe_applies(packet)) {
+        return NULL;
+    }
+
+    uint32_t fingerprint = dedupe_fingerprint(packet, body);
+    for (size_t i = 0; i < DEDUPE_ENTRIES; i++) {
+        if (entries[i].id == packet->id && entries[i].fingerprint == fingerprint) {
+            ESP_LOGI(TAG, "Command %u repeated, result replayed", packet->id);
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+void dedupe_store(const struct payload *packet, const byte *body, uint32_t origin,
+                  byte status, const byte *reply, size_t size) {
+    if (!dedupe_applies(packet)) {
+        return;
+    }
+    if (size > DEDUPE_REPLY_MAX) {
+        ESP_LOGW(TAG, "Reply of command %u is too big to replay", packet->id);
+        return;
+    }
+
+    struct dedupe_entry *entry = &entries[next];
+    next = (next + 1) % DEDUPE_ENTRIES;
+
+    entry->id = packet->id;
+    entry->fingerprint = dedupe_fingerprint(packet, body);
+    entry->origin = origin;
+    entry->status = status;
+    entry->size = size;
+    memcpy(entry->reply, reply, size);
+}
@@ -0,0 +1,44 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : dedupe.h
+ * PURPOSE     : Repeated command detection
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __DEDUPE_H_
+#define __DEDUPE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <wolfssl/wolfcrypt/types.h>
+
+#include "../../payload.h"
+
+/* Largest cached reply, a status per batch item */
+#define DEDUPE_REPLY_MAX BATCH_MAX_ITEMS
+
+struct dedupe_entry {
+    uint32_t id;
+    uint32_t fingerprint; /* Of the command fields and data */
+    uint32_t origin;      /* Connection of the first run */
+    uint8_t status;
+    uint8_t size;
+    byte reply[DEDUPE_REPLY_MAX];
+};
+
+/* Result of an earlier run of the same command, NULL if there was none */
+const struct dedupe_entry *dedupe_find(const struct payload *packet, const byte *body);
+
+/* Remembers the result of a command with an ID, the oldest one is replaced */
+void dedupe_store(const struct payload *packet, const byte *body, uint32_t origin,
+                  byte status, const byte *reply, size_t size);
+
+#endif /* __DEDUPE_H_ */
@@ -0,0 +1,255 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : deferred.c
+ * PURPOSE     : Commands held until their execute_at time
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Held commands are keyed by Unix time, not converted to a local timer
+ * once, so an SNTP correction after delivery still moves them. The task
+ * sleeps in ticks until DEFERRED_SPIN_US before the due time and spins the
+ * rest on the clock, a tick is far coarser than the start alignment we
+ * want between devices. The spin is bounded on esp_timer, a clock set back
+ * meanwhile sends the task back to sleep instead of starving the ones
+ * below it. */
+
+#include "deferred.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "heap.h"
+#include "pump.h"
+#include "sntp.h"
+
+/* Farthest execute_at accepted */
+#define DEFERRED_AHEAD_MAX_US (60 * 60 * 1000000LL)
+
+/* Spun on the clock before the due time, two ticks */
+#define DEFERRED_SPIN_US (2 * portTICK_PERIOD_MS * 1000LL)
+
+/* Longest sleep, time jumps are noticed this late at most */
+#define DEFERRED_RECHECK_MS 1000
+
+static const char TAG[] = "deferred";
+
+struct deferred {
+    bool used;
+    uint32_t origin;
+    struct payload packet;
+    byte body[DEFERRED_DATA_MAX];
+};
+
+static struct deferred queue[DEFERRED_MAX];
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t task = NULL;
+static deferred_handler_t handler = NULL;
+static pump_listener_t listener = NULL;
+
+/* Earliest held command, NULL if none. Call under lock */
+static struct deferred *deferred_first(void) {
+    struct deferred *first = NULL;
+    for (size_t i = 0; i < DEFERRED_MAX; i++) {
+        if (queue[i].used && (first == NULL || queue[i].packet.execute_at < first->packet.execute_at)) {
+            first = &queue[i];
+        }
+    }
+    return first;
+}
+
+static void deferred_task(void *pvParameters) {
+    // Only this task runs held commands, one copy is enough
+    static struct deferred due;
+
+    while (1) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        struct deferred *first = deferred_first();
+        uint64_t execute_at = first == NULL ? 0 : first->packet.execute_at;
+        xSemaphoreGive(lock);
+
+        int64_t ahead = first == NULL ? 0 : (int64_t) (execute_at - sntp_now());
+        if (first == NULL || ahead > DEFERRED_SPIN_US) {
+            uint32_t wait_ms = first == NULL ? DEFERRED_RECHECK_MS : (ahead - DEFERRED_SPIN_US) / 1000;
+            wait_ms = wait_ms > DEFERRED_RECHECK_MS ? DEFERRED_RECHECK_MS : wait_ms;
+            ulTaskNotifyTake(pdTRUE, wait_ms / portTICK_PERIOD_MS);
+            continue;
+        }
+        int64_t spin_end = esp_timer_get_time() + DEFERRED_SPIN_US;
+        while (sntp_now() < execute_at && esp_timer_get_time() < spin_end) {
+        }
+        if (sntp_now() < execute_at) {
+            // One tick for the lower priority tasks, the target is checked again
+            vTaskDelay(1);
+            continue;
+        }
+
+        // May have been cancelled or passed by a new one meanwhile
+        xSemaphoreTake(lock, portMAX_DELAY);
+        first = deferred_first();
+        bool run = first != NULL && first->packet.execute_at <= sntp_now();
+        if (run) {
+            due = *first;
+            first->used = false;
+        }
+        xSemaphoreGive(lock);
+
+        if (run && handler != NULL) {
+            int64_t late = (int64_t) (sntp_now() - due.packet.execute_at);
+            ESP_LOGI(TAG, "Command 0x%X runs %dus late", (unsigned) due.packet.command, (int) late);
+            handler(&due.packet, due.body, due.origin);
+        }
+    }
+}
+
+bool deferred_init(void) {
+    lock = xSemaphoreCreateMutex();
+    if (lock == NULL) {
+        ESP_LOGE(TAG, "Can't create lock");
+        return false;
+    }
+
+    BaseType_t rc = xTaskCreate(
+            deferred_task,
+            "Deferred task",
+            3072,
+            NULL,
+            tskIDLE_PRIORITY + 3,
+            &task);
+
+    if (rc != pdPASS) {
+        ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
+        return false;
+    }
+    heap_track_task(task);
+    return true;
+}
+
+void deferred_set_handler(deferred_handler_t value) {
+    handler = value;
+}
+
+void deferred_set_listener(pump_listener_t value) {
+    listener = value;
+}
+
+bool deferred_add(const struct payload *packet, const byte *body, uint32_t origin) {
+    if (!sntp_time_valid()) {
+        ESP_LOGE(TAG, "Time is unknown");
+        return false;
+    }
+    if (packet->size > DEFERRED_DATA_MAX) {
+        ESP_LOGE(TAG, "Command data of %u bytes is too big to hold", (unsigned) packet->size);
+        return false;
+    }
+    if ((int64_t) (packet->execute_at - sntp_now()) > DEFERRED_AHEAD_MAX_US) {
+        ESP_LOGE(TAG, "Command is too far ahead");
+        return false;
+    }
+
+    bool added = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (size_t i = 0; i < DEFERRED_MAX && !added; i++) {
+        if (!queue[i].used) {
+            queue[i].used = true;
+            queue[i].origin = origin;
+            queue[i].packet = *packet;
+            memcpy(queue[i].body, body, packet->size);
+            added = true;
+        }
+    }
+    xSemaphoreGive(lock);
+
+    if (!added) {
+        ESP_LOGE(TAG, "Queue is full");
+        return false;
+    }
+    xTaskNotifyGive(task);
+    return true;
+}
+
+/* Held dose runs on `pin` */
+static bool deferred_uses(const struct deferred *entry, uint32_t pin) {
+    const struct payload *packet = &entry->packet;
+
+    switch (packet->command) {
+        case CMD_PUMP_WORK_VOLUME:
+        case CMD_PUMP_WORK_TIME:
+            return pin == PUMP_STOP_ALL || packet->pin == pin;
+        case CMD_PUMP_WORK_GROUP:
+            for (size_t i = 0; i + sizeof(struct group_step) <= packet->size; i += sizeof(struct group_step)) {
+                const struct group_step *step = (const struct group_step *) (entry->body + i);
+                if (pin == PUMP_STOP_ALL || step->pin == pin) {
+                    return true;
+                }
+            }
+            return false;
+    }
+    return false;
+}
+
+/* Aborted events for every channel of a cancelled dose, as if it had
+ * started and been stopped at once */
+static void deferred_report(const struct deferred *entry) {
+    const struct payload *packet = &entry->packet;
+    struct pump_origin origin = {entry->origin, packet->id};
+    struct pump_event event = {.id = packet->id, .kind = EVENT_ABORTED};
+
+    if (listener == NULL || packet->id == 0) {
+        return;
+    }
+    switch (packet->command) {
+        case CMD_PUMP_WORK_VOLUME:
+        case CMD_PUMP_WORK_TIME:
+            event.pin = packet->pin;
+            listener(&origin, &event);
+            break;
+        case CMD_PUMP_WORK_GROUP:
+            for (size_t i = 0; i + sizeof(struct group_step) <= packet->size; i += sizeof(struct group_step)) {
+                event.pin = ((const struct group_step *) (entry->body + i))->pin;
+                listener(&origin, &event);
+            }
+            break;
+    }
+}
+
+size_t deferred_cancel(uint32_t pin) {
+    struct deferred entry;
+    size_t cancelled = 0;
+    bool found = true;
+
+    // One at a time, events go out without the lock
+    while (found) {
+        found = false;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        for (size_t i = 0; i < DEFERRED_MAX && !found; i++) {
+            if (queue[i].used && deferred_uses(&queue[i], pin)) {
+                entry = queue[i];
+                queue[i].used = false;
+                found = true;
+            }
+        }
+        xSemaphoreGive(lock);
+
+        if (found) {
+            deferred_report(&entry);
+            cancelled++;
+        }
+    }
+
+    if (cancelled != 0) {
+        ESP_LOGI(TAG, "%u held doses cancelled", (unsigned) cancelled);
+    }
+    return cancelled;
+}
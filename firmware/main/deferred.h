@@ -0,0 +1,52 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : deferred.h
+ * PURPOSE     : Commands held until their execute_at time
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __DEFERRED_H_
+#define __DEFERRED_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <wolfssl/wolfcrypt/types.h>
+
+#include "../../payload.h"
+#include "pump.h"
+
+/* Commands held at once */
+#define DEFERRED_MAX 16
+
+/* Largest command data held */
+#define DEFERRED_DATA_MAX 256
+
+/* Called from the deferred task when a command is due. `origin` is the
+ * connection that sent it */
+typedef void (*deferred_handler_t)(const struct payload *packet, const byte *body, uint32_t origin);
+
+/* Starts the deferred task */
+bool deferred_init(void);
+
+void deferred_set_handler(deferred_handler_t handler);
+
+/* Gets EVENT_ABORTED for every channel of a cancelled dose with an ID */
+void deferred_set_listener(pump_listener_t listener);
+
+/* Holds a verified command until its execute_at, false if the time is
+ * unknown, too far ahead or the queue is full */
+bool deferred_add(const struct payload *packet, const byte *body, uint32_t origin);
+
+/* Drops held pump doses of `pin` or PUMP_STOP_ALL channels and reports
+ * them aborted, returns their count */
+size_t deferred_cancel(uint32_t pin);
+
+#endif /* __DEFERRED_H_ */
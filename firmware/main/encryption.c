@@ -6,7 +6,7 @@
 /* FILE NAME   : encryption.c
  * PURPOSE     : Encryption module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -15,18 +15,42 @@
 
 // see generate_key_h.sh
 #include "key.h"
+#include "session.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <esp_attr.h>
 #include <esp_log.h>
-#include <wolfssl/openssl/rsa.h>
+#include <tcpip_adapter.h>
+#include <wolfssl/wolfcrypt/asn.h>
 #include <wolfssl/wolfcrypt/asn_public.h>
+#include <wolfssl/wolfcrypt/random.h>
+#include <wolfssl/wolfcrypt/rsa.h>
+#include <wolfssl/wolfcrypt/sha256.h>
 
 static const char TAG[] = "encryption";
 
+/* Largest signature, a 4096 bit key */
+#define ENCRYPTION_SIGNATURE_MAX 512
+
+/* DigestInfo of an MD5, with room to spare */
+#define ENCRYPTION_DIGEST_INFO_MAX 64
+
+/* Merkle roots with a verified signature, a batch costs one RSA verify */
+#define MERKLE_ROOTS_CACHED 4
+
+/* Last accepted timestamp, kept over resets like RTC time in sntp.c */
+static RTC_DATA_ATTR uint64_t last_ts;
+static RTC_DATA_ATTR uint64_t last_ts_check;
+
+/* Only the server task verifies packets */
+static byte merkle_roots[MERKLE_ROOTS_CACHED][MERKLE_HASH_SIZE];
+static size_t merkle_roots_count = 0;
+static size_t merkle_roots_next = 0;
+
 bool encryption_md5(const byte *data, size_t size, byte *md5) {
     wc_Md5 md5_ctx;
     int ret;
@@ -52,102 +76,292 @@ bool encryption_md5(const byte *data, size_t size, byte *md5) {
     return true;
 }
 
+/* Logged in lines of this many bytes from a stack buffer */
+#define HEXDUMP_LINE 32
+
 static void hexdump(const char *name, const uint8_t *data, size_t length) {
-    size_t buf_len = length * 2 + 1;
-    char *line = (char *) malloc(buf_len);
-    if (!line) {
-        return;
+    char line[HEXDUMP_LINE * 2 + 1];
+
+    for (size_t offset = 0; offset < length; offset += HEXDUMP_LINE) {
+        size_t count = length - offset < HEXDUMP_LINE ? length - offset : HEXDUMP_LINE;
+        for (size_t i = 0; i < count; i++) {
+            snprintf(line + i * 2, 3, "%02X", data[offset + i]);
+        }
+        line[count * 2] = '\0';
+        ESP_LOGI(TAG, "%s+%u: %s", name, (unsigned) offset, line);
     }
+}
+
+/* Public key decoded at boot, packets verify without the heap */
+static RsaKey key;
+static bool key_loaded = false;
+static WC_RNG rng;
 
-    for (size_t i = 0; i < length; i++) {
-        snprintf(line + (i * 2), 3, "%02X", data[i]);
+bool encryption_init(void) {
+    word32 idx = 0;
+
+    int ret = wc_InitRsaKey(&key, NULL);
+    if (ret == 0) {
+        ret = wc_RsaPublicKeyDecode(public_key, &idx, &key, public_key_len);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to load key %i", ret);
+        return false;
     }
-    line[buf_len - 1] = '\0';
 
-    ESP_LOGI(TAG, "%s: %s", name, line);
-    free(line);
+    ret = wc_InitRng(&rng);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "wc_InitRng failed, error %d", ret);
+        return false;
+    }
+    key_loaded = true;
+    return encryption_signature_size() != 0;
 }
 
 bool encryption_verify(byte *md5, const byte *signature, size_t size) {
-    RSA *rsaKey = wolfSSL_RSA_new();
+    // Only the server task verifies packets
+    static byte decoded[ENCRYPTION_SIGNATURE_MAX];
+    byte expected[ENCRYPTION_DIGEST_INFO_MAX];
+    byte *digest_info = NULL;
+
+    if (!key_loaded || size > sizeof(decoded)) {
+        ESP_LOGE(TAG, "Can't verify %u byte signature", (unsigned) size);
+        return false;
+    }
+
+    memcpy(decoded, signature, size);
+    int ret = wc_RsaSSL_VerifyInline(decoded, size, &digest_info, &key);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Verify returned %i", ret);
+        return false;
+    }
+
+    // Signed as PKCS#1 DigestInfo of the MD5
+    word32 expected_size = wc_EncodeSignature(expected, md5, ENCRYPTION_MD5_SIZE, MD5h);
+    if ((word32) ret != expected_size || memcmp(digest_info, expected, expected_size) != 0) {
+        ESP_LOGE(TAG, "Signature does not match");
+        return false;
+    }
+    return true;
+}
+
+bool encryption_encrypt(const byte *data, size_t size, byte *out) {
+    if (!key_loaded) {
+        return false;
+    }
 
-    if (rsaKey == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate key");
+    int ret = wc_RsaPublicEncrypt(data, size, out, encryption_signature_size(), &key, &rng);
+    if (ret != (int) encryption_signature_size()) {
+        ESP_LOGE(TAG, "Encrypt returned %i", ret);
         return false;
     }
+    return true;
+}
+
+size_t encryption_signature_size(void) {
+    static size_t signature_size = 0;
+    if (signature_size != 0) {
+        return signature_size;
+    }
 
     const byte *n_ptr, *e_ptr;
     uint32_t idx = 0, nSz, eSz;
     int ret = wc_RsaPublicKeyDecode_ex(public_key, &idx,
                                        public_key_len,
                                        &n_ptr, &nSz, &e_ptr, &eSz);
-
     if (ret != 0) {
         ESP_LOGE(TAG, "Failed to load key %i", ret);
-        wolfSSL_RSA_free(rsaKey);
-        return false;
+        return 0;
     }
 
-    ret = wolfSSL_RSA_verify(WC_MD5,
-                             md5,
-                             ENCRYPTION_MD5_SIZE,
-                             signature, size,
-                             rsaKey);
+    // Modulus may be stored with sign padding
+    while (nSz > 0 && *n_ptr == 0) {
+        n_ptr++;
+        nSz--;
+    }
+    signature_size = nSz;
+    return signature_size;
+}
 
-    wolfSSL_RSA_free(rsaKey);
-    if (ret != 0) {
-        ESP_LOGE(TAG, "Verify returned %i", ret);
-        return false;
+size_t encryption_trailer_size(const struct payload *header) {
+    if (AUTH_IS_MERKLE(header->auth)) {
+        return sizeof(struct merkle_tag) + AUTH_MERKLE_DEPTH(header->auth) * MERKLE_HASH_SIZE +
+               encryption_signature_size();
     }
-    return true;
+    switch (header->auth) {
+        case AUTH_RSA:
+            return encryption_signature_size();
+        case AUTH_SESSION:
+            return sizeof(struct session_tag);
+    }
+    return 0;
 }
 
 #define LOG_UINT64_FORMAT "0x%08X%08X"
 #define LOG_UINT64_DATA(X) (uint32_t)((X) >> 32), (uint32_t) ((X) &0xFFFFFFFF)
 
-bool encryption_extract(const byte *data, size_t size, struct payload *result) {
-    static uint64_t last_ts = 0;
+bool encryption_sequential(uint64_t timestamp, bool strict) {
+    if (last_ts_check != ~last_ts) {
+        last_ts = 0;
+    }
+    return strict ? timestamp > last_ts : timestamp >= last_ts;
+}
+
+bool encryption_fresh(uint64_t timestamp) {
     const static uint64_t allowed_delta = 1000000 * 60;// 1 min
-    if (size < sizeof(struct payload)) {
-        ESP_LOGE(TAG, "Packet size (%u) is too short", size);
+    struct timeval now_tv;
+    gettimeofday(&now_tv, NULL);
+    uint64_t now = (uint64_t) now_tv.tv_sec * 1000000ULL + (uint64_t) now_tv.tv_usec;
+
+    if (timestamp < now - allowed_delta) {
+        ESP_LOGE(TAG, "Payload is too old " LOG_UINT64_FORMAT " < " LOG_UINT64_FORMAT " - " LOG_UINT64_FORMAT,
+                 LOG_UINT64_DATA(timestamp), LOG_UINT64_DATA(now), LOG_UINT64_DATA(allowed_delta));
         return false;
     }
+    return true;
+}
+
+/* Timestamps of signed packets never go back, a stale packet does not
+ * move them forward */
+static bool encryption_accept(uint64_t timestamp, bool strict) {
+    if (!encryption_fresh(timestamp)) {
+        return false;
+    }
+    if (!encryption_sequential(timestamp, strict)) {
+        ESP_LOGE(TAG, "Payload is not seqential");
+        return false;
+    }
+
+    last_ts = timestamp;
+    last_ts_check = ~last_ts;
+    return true;
+}
 
+/* RSA signature of MD5 over header and data */
+static bool encryption_check_rsa(const byte *data, size_t signed_size, size_t size, uint64_t timestamp) {
     hexdump("pakcet", data, size);
 
-    hexdump("payload", data, sizeof(struct payload));
+    hexdump("payload", data, signed_size);
 
     byte md5[ENCRYPTION_MD5_SIZE];
-    if (!encryption_md5(data, sizeof(struct payload), md5)) {
+    if (!encryption_md5(data, signed_size, md5)) {
         ESP_LOGE(TAG, "Failed to calculate MD5");
         return false;
     }
     hexdump("md5", md5, sizeof(md5));
 
-    struct timeval now_tv;
-    gettimeofday(&now_tv, NULL);
-    uint64_t now = (uint64_t) now_tv.tv_sec * 1000000ULL + (uint64_t) now_tv.tv_usec;
-
-    hexdump("signature", data + sizeof(struct payload), size - sizeof(struct payload));
-    if (!encryption_verify(md5, data + sizeof(struct payload), size - sizeof(struct payload))) {
+    hexdump("signature", data + signed_size, size - signed_size);
+    if (!encryption_verify(md5, data + signed_size, size - signed_size)) {
         ESP_LOGE(TAG, "Failed to verify signature");
         return false;
     }
-    memcpy(result, data, sizeof(struct payload));
+    return encryption_accept(timestamp, false);
+}
 
-    ESP_LOGI(TAG, "Payload command: 0x%X pin:%u time:%u timestamp:" LOG_UINT64_FORMAT, (unsigned) result->command, result->pin, result->time, LOG_UINT64_DATA(result->timestamp));
-    if (result->timestamp < now - allowed_delta) {
-        ESP_LOGE(TAG, "Payload is too old " LOG_UINT64_FORMAT " < " LOG_UINT64_FORMAT " - " LOG_UINT64_FORMAT,
-                 LOG_UINT64_DATA(result->timestamp), LOG_UINT64_DATA(now), LOG_UINT64_DATA(allowed_delta));
+/* SHA-256 of `prefix` and two parts, `b` may be NULL */
+static bool encryption_merkle_hash(byte prefix, const byte *a, size_t a_size, const byte *b, size_t b_size, byte *hash) {
+    wc_Sha256 sha;
+
+    if (wc_InitSha256(&sha) != 0) {
+        ESP_LOGE(TAG, "wc_InitSha256 failed");
         return false;
     }
+    bool ok = wc_Sha256Update(&sha, &prefix, 1) == 0 && wc_Sha256Update(&sha, a, a_size) == 0 &&
+              (b == NULL || wc_Sha256Update(&sha, b, b_size) == 0) && wc_Sha256Final(&sha, hash) == 0;
+    wc_Sha256Free(&sha);
+    return ok;
+}
 
-    if (result->timestamp < last_ts) {
-        ESP_LOGE(TAG, "Payload is not seqential");
+/* Inclusion proof up to the root, the root signature only if it is new.
+ * The leaf has the address of this device, a batch leaf of another one
+ * does not verify here. One leaf per device a batch, so a timestamp is
+ * used once */
+static bool encryption_check_merkle(const byte *data, size_t signed_size, size_t size, uint64_t timestamp) {
+    const struct payload *header = (const struct payload *) data;
+    const struct merkle_tag *tag = (const struct merkle_tag *) (data + signed_size);
+    const byte *proof = data + signed_size + sizeof(*tag);
+    size_t depth = AUTH_MERKLE_DEPTH(header->auth);
+    byte node[MERKLE_HASH_SIZE];
+    tcpip_adapter_ip_info_t ip;
+
+    if (tcpip_adapter_get_ip_info(TCPIP_ADAPTER_IF_STA, &ip) != ESP_OK || ip.ip.addr == 0) {
+        ESP_LOGE(TAG, "No address for the Merkle leaf");
+        return false;
+    }
+    if (!encryption_merkle_hash(0x00, (const byte *) &ip.ip.addr, sizeof(ip.ip.addr), data, signed_size, node)) {
         return false;
     }
+    for (size_t i = 0; i < depth; i++) {
+        const byte *sibling = proof + i * MERKLE_HASH_SIZE;
+        bool left = (tag->path >> i) & 1;
+        byte parent[MERKLE_HASH_SIZE];
+        if (!encryption_merkle_hash(0x01, left ? sibling : node, MERKLE_HASH_SIZE,
+                                    left ? node : sibling, MERKLE_HASH_SIZE, parent)) {
+            return false;
+        }
+        memcpy(node, parent, sizeof(node));
+    }
 
-    last_ts = result->timestamp;
+    for (size_t i = 0; i < merkle_roots_count; i++) {
+        if (memcmp(merkle_roots[i], node, sizeof(node)) == 0) {
+            return encryption_accept(timestamp, true);
+        }
+    }
 
-    return true;
-}
\ No newline at end of file
+    byte md5[ENCRYPTION_MD5_SIZE];
+    const byte *signature = proof + depth * MERKLE_HASH_SIZE;
+    if (!encryption_md5(node, sizeof(node), md5) ||
+        !encryption_verify(md5, signature, size - (signature - data))) {
+        ESP_LOGE(TAG, "Failed to verify Merkle root");
+        return false;
+    }
+
+    memcpy(merkle_roots[merkle_roots_next], node, sizeof(node));
+    merkle_roots_next = (merkle_roots_next + 1) % MERKLE_ROOTS_CACHED;
+    if (merkle_roots_count < MERKLE_ROOTS_CACHED) {
+        merkle_roots_count++;
+    }
+    return encryption_accept(timestamp, true);
+}
+
+bool encryption_extract(const byte *data, size_t size, struct payload *result) {
+    if (size < sizeof(struct payload)) {
+        ESP_LOGE(TAG, "Packet size (%u) is too short", size);
+        return false;
+    }
+
+    const struct payload *header = (const struct payload *) data;
+    if (header->version != PAYLOAD_VERSION) {
+        ESP_LOGE(TAG, "Unsupported payload version %u", (unsigned) header->version);
+        return false;
+    }
+
+    size_t trailer_size = encryption_trailer_size(header);
+    if (trailer_size == 0) {
+        ESP_LOGE(TAG, "Unsupported authentication %u", (unsigned) header->auth);
+        return false;
+    }
+
+    size_t signed_size = sizeof(struct payload) + header->size;
+    if (size < signed_size + trailer_size) {
+        ESP_LOGE(TAG, "Packet size (%u) is too short for %u data bytes", size, (unsigned) header->size);
+        return false;
+    }
+
+    if (header->auth == AUTH_SESSION) {
+        if (!session_verify(data, signed_size, (const struct session_tag *) (data + signed_size))) {
+            return false;
+        }
+    } else if (AUTH_IS_MERKLE(header->auth)) {
+        if (!encryption_check_merkle(data, signed_size, size, header->timestamp)) {
+            return false;
+        }
+    } else if (!encryption_check_rsa(data, signed_size, size, header->timestamp)) {
+        return false;
+    }
+    memcpy(result, data, sizeof(struct payload));
+
+    ESP_LOGI(TAG, "Payload command: 0x%X pin:%u time:%u timestamp:" LOG_UINT64_FORMAT, (unsigned) result->command, result->pin, result->time, LOG_UINT64_DATA(result->timestamp));
+    // Signed packets were checked by encryption_accept()
+    return header->auth != AUTH_SESSION || encryption_fresh(result->timestamp);
+}
@@ -6,7 +6,7 @@
 /* FILE NAME   : encryption.h
  * PURPOSE     : Encryption module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -21,10 +21,31 @@
 
 #define ENCRYPTION_MD5_SIZE MD5_DIGEST_SIZE
 
+/* Decodes the public key, once at boot */
+bool encryption_init(void);
+
 bool encryption_md5(const byte *data, size_t size, byte *md5);
 
 bool encryption_verify(byte *md5, const byte *signature, size_t size);
 
+size_t encryption_signature_size(void);
+
+/* PKCS#1 encrypts `size` bytes with the public key,
+ * `out` receives encryption_signature_size() bytes */
+bool encryption_encrypt(const byte *data, size_t size, byte *out);
+
+/* Bytes following command data for the header authentication, 0 if unknown */
+size_t encryption_trailer_size(const struct payload *header);
+
+/* Timestamp is inside the allowed window */
+bool encryption_fresh(uint64_t timestamp);
+
+/* Timestamp is not below the last accepted signed packet, `strict` also
+ * refuses an equal one */
+bool encryption_sequential(uint64_t timestamp, bool strict);
+
+/* Checks packet signature or session tag, `result` receives the header,
+ * command data follows it in `data` */
 bool encryption_extract(const byte *data, size_t size, struct payload *result);
 
 #endif /* __ENCRYPTION_H_ */
\ No newline at end of file
@@ -0,0 +1,218 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : flow.c
+ * PURPOSE     : Flow sensor pulse counters
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Counters take no locks. Only the pulse source, the GPIO interrupt or the
+ * simulation timer, writes `count`. The pump task arms a channel before
+ * the pump starts and disarms it after, `target` 0 is written first on
+ * disarm so the source never sees a half armed channel. */
+
+#include "flow.h"
+
+#include <string.h>
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "pump_driver.h"
+#include "storage.h"
+
+#define NVS_KEY(CHANNEL)       \
+    char nvs_key[] = "flow_A"; \
+    nvs_key[sizeof(nvs_key) - 2] += (CHANNEL)
+
+static const char TAG[] = "flow";
+
+struct flow_channel {
+    struct flow_config config;
+    volatile uint32_t count;
+    volatile uint32_t start;  /* `count` at arm */
+    volatile uint32_t target; /* Pulses after arm, 0 is disarmed */
+    volatile TaskHandle_t task;
+    esp_timer_handle_t timer; /* FLOW_GPIO_SIMULATED source */
+};
+
+static struct flow_channel channels[PUMP_DRIVER_CHANNELS_MAX];
+
+/* True once the armed pulses came */
+static inline bool flow_pulse(struct flow_channel *channel) {
+    channel->count++;
+    return channel->target != 0 && channel->count - channel->start == channel->target && channel->task != NULL;
+}
+
+static void IRAM_ATTR flow_isr(void *arg) {
+    struct flow_channel *channel = (struct flow_channel *) arg;
+    if (flow_pulse(channel)) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(channel->task, &woken);
+        if (woken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+static void flow_simulate(void *arg) {
+    struct flow_channel *channel = (struct flow_channel *) arg;
+    if (flow_pulse(channel)) {
+        xTaskNotifyGive(channel->task);
+    }
+}
+
+static bool flow_config_valid(const struct flow_config *config) {
+    if (config->gpio == FLOW_GPIO_NONE) {
+        return true;
+    }
+    if (config->pulses == 0) {
+        ESP_LOGE(TAG, "Sensor needs pulses per unit");
+        return false;
+    }
+    if (config->gpio == FLOW_GPIO_SIMULATED) {
+        return config->simulated_hz != 0 && config->simulated_hz <= 1000000;
+    }
+    // GPIO16 has no interrupt
+    return config->gpio < GPIO_NUM_16;
+}
+
+/* Connects the channel to the pulse source of `config` */
+static bool flow_attach(int index, const struct flow_config *config) {
+    struct flow_channel *channel = &channels[index];
+
+    if (channel->config.gpio < GPIO_NUM_MAX) {
+        gpio_isr_handler_remove(channel->config.gpio);
+    }
+    channel->config = *config;
+
+    if (config->gpio == FLOW_GPIO_SIMULATED && channel->timer == NULL) {
+        esp_timer_create_args_t args = {
+                .callback = flow_simulate,
+                .arg = channel,
+                .name = "flow",
+        };
+        if (esp_timer_create(&args, &channel->timer) != ESP_OK) {
+            ESP_LOGE(TAG, "Can't create simulation timer");
+            return false;
+        }
+    }
+
+    if (config->gpio < GPIO_NUM_MAX) {
+        gpio_config_t io = {
+                .pin_bit_mask = 1UL << config->gpio,
+                .mode = GPIO_MODE_INPUT,
+                .pull_up_en = GPIO_PULLUP_ENABLE,
+                .intr_type = GPIO_INTR_POSEDGE,
+        };
+        if (gpio_config(&io) != ESP_OK ||
+            gpio_isr_handler_add(config->gpio, flow_isr, channel) != ESP_OK) {
+            ESP_LOGE(TAG, "Can't attach GPIO%u to channel %d", (unsigned) config->gpio, index);
+            channel->config.gpio = FLOW_GPIO_NONE;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool flow_init(void) {
+    if (gpio_install_isr_service(0) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't install GPIO ISR service");
+        return false;
+    }
+
+    for (size_t i = 0; i < pump_driver_channels(); i++) {
+        NVS_KEY(i);
+        struct flow_config config;
+        size_t size = sizeof(config);
+
+        channels[i].config.gpio = FLOW_GPIO_NONE;
+        if (!storage_read(nvs_key, &config, &size) || size != sizeof(config) || !flow_config_valid(&config)) {
+            continue;
+        }
+        if (flow_attach(i, &config) && config.gpio != FLOW_GPIO_NONE) {
+            ESP_LOGI(TAG, "Channel %u sensor on %u, %u pulses per unit", i, (unsigned) config.gpio, config.pulses);
+        }
+    }
+    return true;
+}
+
+bool flow_set(int channel, const struct flow_config *config, size_t size) {
+    if (channel < 0 || (size_t) channel >= pump_driver_channels()) {
+        ESP_LOGE(TAG, "Invalid channel %d", channel);
+        return false;
+    }
+    if (size != sizeof(*config) || !flow_config_valid(config)) {
+        ESP_LOGE(TAG, "Invalid flow config");
+        return false;
+    }
+    if (channels[channel].target != 0) {
+        ESP_LOGE(TAG, "Channel %d is dosing", channel);
+        return false;
+    }
+
+    NVS_KEY(channel);
+    if (!storage_write(nvs_key, config, sizeof(*config))) {
+        ESP_LOGE(TAG, "Can't write to NVS");
+        return false;
+    }
+    return flow_attach(channel, config);
+}
+
+uint32_t flow_pulses(int channel, uint32_t volume) {
+    const struct flow_config *config = &channels[channel].config;
+    if (config->gpio == FLOW_GPIO_NONE) {
+        return 0;
+    }
+
+    uint64_t pulses = ((uint64_t) volume * config->pulses + VOLUME_SCALE / 2) / VOLUME_SCALE;
+    return pulses == 0 ? 1 : pulses > UINT32_MAX ? UINT32_MAX : (uint32_t) pulses;
+}
+
+void flow_arm(int channel, uint32_t pulses) {
+    struct flow_channel *flow = &channels[channel];
+
+    flow->task = NULL;
+    flow->start = flow->count;
+    flow->target = pulses;
+
+    if (flow->config.gpio == FLOW_GPIO_SIMULATED) {
+        esp_timer_start_periodic(flow->timer, 1000000 / flow->config.simulated_hz);
+    }
+}
+
+void flow_watch(int channel, TaskHandle_t task) {
+    channels[channel].task = task;
+}
+
+uint32_t flow_count(int channel) {
+    return channels[channel].count - channels[channel].start;
+}
+
+uint32_t flow_volume(int channel) {
+    const struct flow_config *config = &channels[channel].config;
+    if (config->gpio == FLOW_GPIO_NONE) {
+        return 0;
+    }
+
+    uint64_t volume = ((uint64_t) flow_count(channel) * VOLUME_SCALE + config->pulses / 2) / config->pulses;
+    return volume > UINT32_MAX ? UINT32_MAX : (uint32_t) volume;
+}
+
+void flow_disarm(int channel) {
+    struct flow_channel *flow = &channels[channel];
+
+    flow->target = 0;
+    flow->task = NULL;
+    if (flow->config.gpio == FLOW_GPIO_SIMULATED) {
+        esp_timer_stop(flow->timer);
+    }
+}
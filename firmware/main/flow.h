@@ -0,0 +1,48 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : flow.h
+ * PURPOSE     : Flow sensor pulse counters
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __FLOW_H_
+#define __FLOW_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "../../payload.h"
+
+/* Loads sensor configs from NVS, call after storage_init */
+bool flow_init(void);
+
+bool flow_set(int channel, const struct flow_config *config, size_t size);
+
+/* Pulses of `volume`, 0 if the channel has no sensor */
+uint32_t flow_pulses(int channel, uint32_t volume);
+
+/* Counts pulses from now on, call before the pump starts */
+void flow_arm(int channel, uint32_t pulses);
+
+/* `task` gets a notification once the armed pulses came */
+void flow_watch(int channel, TaskHandle_t task);
+
+/* Pulses since flow_arm */
+uint32_t flow_count(int channel);
+
+/* Volume of the pulses since flow_arm, 0 if the channel has no sensor */
+uint32_t flow_volume(int channel);
+
+void flow_disarm(int channel);
+
+#endif /* __FLOW_H_ */
@@ -0,0 +1,146 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : heap.c
+ * PURPOSE     : Heap use tracking after boot
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* malloc, FreeRTOS and wolfSSL all end up in the SDK's _heap_caps_*
+ * functions with the file and line of the caller, the component links
+ * them wrapped (see CMakeLists.txt). Only tasks of the request and pump
+ * paths are tracked, Wi-Fi and lwIP use the heap by design.
+ *
+ * The hook runs inside the allocator, it only counts. Logging is left to
+ * heap_track_log from the server loop, except for the assert mode which
+ * prints with the ROM printf and aborts right at the caller. */
+
+#include "heap.h"
+
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "rom/ets_sys.h"
+
+static const char TAG[] = "heap";
+
+struct heap_site {
+    const char *file;
+    uint32_t line;
+    uint32_t count;
+    uint32_t logged;
+};
+
+static TaskHandle_t tasks[HEAP_TASKS_MAX];
+static size_t tasks_count = 0;
+static volatile bool tracking = false;
+
+static struct heap_site sites[HEAP_SITES_MAX];
+static volatile uint32_t count = 0;
+static volatile uint32_t bytes = 0;
+static uint32_t logged = 0;
+
+void *__real__heap_caps_malloc(size_t size, uint32_t caps, const char *file, size_t line);
+void *__real__heap_caps_calloc(size_t n, size_t size, uint32_t caps, const char *file, size_t line);
+void *__real__heap_caps_realloc(void *ptr, size_t size, uint32_t caps, const char *file, size_t line);
+void *__real__heap_caps_zalloc(size_t size, uint32_t caps, const char *file, size_t line);
+
+static bool heap_tracked(void) {
+    if (!tracking) {
+        return false;
+    }
+
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (size_t i = 0; i < tasks_count; i++) {
+        if (tasks[i] == self) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void heap_note(size_t size, const char *file, size_t line) {
+    if (HEAP_TRACK == HEAP_TRACK_OFF || !heap_tracked()) {
+        return;
+    }
+    if (HEAP_TRACK == HEAP_TRACK_ASSERT) {
+        ets_printf("Heap use of %u bytes at %s:%u after boot\n", (unsigned) size, file, (unsigned) line);
+        abort();
+    }
+
+    portENTER_CRITICAL();
+    count++;
+    bytes += size;
+    for (size_t i = 0; i < HEAP_SITES_MAX; i++) {
+        if (sites[i].file == NULL) {
+            sites[i].file = file;
+            sites[i].line = line;
+        }
+        if (sites[i].file == file && sites[i].line == line) {
+            sites[i].count++;
+            break;
+        }
+    }
+    portEXIT_CRITICAL();
+}
+
+void *__wrap__heap_caps_malloc(size_t size, uint32_t caps, const char *file, size_t line) {
+    heap_note(size, file, line);
+    return __real__heap_caps_malloc(size, caps, file, line);
+}
+
+void *__wrap__heap_caps_calloc(size_t n, size_t size, uint32_t caps, const char *file, size_t line) {
+    heap_note(n * size, file, line);
+    return __real__heap_caps_calloc(n, size, caps, file, line);
+}
+
+void *__wrap__heap_caps_realloc(void *ptr, size_t size, uint32_t caps, const char *file, size_t line) {
+    heap_note(size, file, line);
+    return __real__heap_caps_realloc(ptr, size, caps, file, line);
+}
+
+void *__wrap__heap_caps_zalloc(size_t size, uint32_t caps, const char *file, size_t line) {
+    heap_note(size, file, line);
+    return __real__heap_caps_zalloc(size, caps, file, line);
+}
+
+void heap_track_task(TaskHandle_t task) {
+    if (tasks_count == HEAP_TASKS_MAX) {
+        ESP_LOGE(TAG, "Too many tracked tasks");
+        return;
+    }
+    tasks[tasks_count++] = task != NULL ? task : xTaskGetCurrentTaskHandle();
+}
+
+void heap_track_start(void) {
+    tracking = true;
+    ESP_LOGI(TAG, "Tracking heap use of %u tasks%s", (unsigned) tasks_count,
+             HEAP_TRACK == HEAP_TRACK_ASSERT ? ", any use aborts" : "");
+}
+
+uint32_t heap_track_count(void) {
+    return count;
+}
+
+void heap_track_log(void) {
+    if (count == logged) {
+        return;
+    }
+    logged = count;
+
+    for (size_t i = 0; i < HEAP_SITES_MAX && sites[i].file != NULL; i++) {
+        uint32_t site_count = sites[i].count;
+        if (site_count != sites[i].logged) {
+            ESP_LOGW(TAG, "%u allocations at %s:%u after boot", (unsigned) site_count, sites[i].file,
+                     (unsigned) sites[i].line);
+            sites[i].logged = site_count;
+        }
+    }
+    ESP_LOGW(TAG, "%u allocations, %u bytes after boot", (unsigned) logged, (unsigned) bytes);
+}
@@ -0,0 +1,58 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : heap.h
+ * PURPOSE     : Heap use tracking after boot
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __HEAP_H_
+#define __HEAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Selected with -DHEAP_STATIC=1: request and pump paths take everything
+ * from pools sized at compile time, nothing from the heap after boot */
+#ifndef HEAP_STATIC
+#define HEAP_STATIC 0
+#endif
+
+#define HEAP_TRACK_OFF    0
+#define HEAP_TRACK_COUNT  1 /* Heap use of tracked tasks is counted by call site */
+#define HEAP_TRACK_ASSERT 2 /* ... and aborts with a backtrace */
+
+/* Selected with -DHEAP_TRACK=... */
+#ifndef HEAP_TRACK
+#define HEAP_TRACK (HEAP_STATIC ? HEAP_TRACK_ASSERT : HEAP_TRACK_COUNT)
+#endif
+
+/* Tasks of the request and pump paths */
+#define HEAP_TASKS_MAX 16
+
+/* Distinct call sites remembered */
+#define HEAP_SITES_MAX 8
+
+/* Tracks heap use of `task`, NULL is the calling one. Call during boot */
+void heap_track_task(TaskHandle_t task);
+
+/* Boot is over, heap use of tracked tasks is counted from now */
+void heap_track_start(void);
+
+/* Allocations of tracked tasks since heap_track_start */
+uint32_t heap_track_count(void);
+
+/* Logs call sites with allocations since the last call */
+void heap_track_log(void);
+
+#endif /* __HEAP_H_ */
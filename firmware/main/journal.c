@@ -0,0 +1,313 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : journal.c
+ * PURPOSE     : Dose journal module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* The `journal` partition is a ring of flash sectors filled with
+ * struct dose_record. Records are only appended, a sector is erased
+ * when the head enters it again, so every sector wears equally.
+ * Head is found at boot by the highest seq. RAM keeps seq and time
+ * bounds per sector, queries skip sectors without reading them. */
+
+#include "journal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define JOURNAL_LABEL "journal"
+
+#define JOURNAL_SECTOR_SIZE 4096
+
+#define JOURNAL_SECTORS_MAX 16
+
+#define RECORDS_PER_SECTOR (JOURNAL_SECTOR_SIZE / sizeof(struct dose_record))
+
+/* Records read from flash at once */
+#define JOURNAL_READ_RECORDS 16
+
+#define JOURNAL_QUEUE_LENGTH 32
+
+static const char TAG[] = "journal";
+
+struct journal_sector {
+    uint32_t first_seq; /* 0 when empty */
+    uint32_t last_seq;
+    uint32_t min_time;
+    uint32_t max_time;
+    uint16_t used;      /* Written slots, torn ones included */
+};
+
+static const esp_partition_t *partition = NULL;
+static size_t sectors_count;
+static struct journal_sector sectors[JOURNAL_SECTORS_MAX];
+
+/* Next write position */
+static size_t head_sector;
+static size_t head_slot;
+static uint32_t next_seq = 1;
+
+static SemaphoreHandle_t lock = NULL;
+static QueueHandle_t queue = NULL;
+static volatile bool ready = false;
+
+static uint16_t journal_check(const struct dose_record *record) {
+    const uint8_t *data = (const uint8_t *) record;
+    uint16_t a = 0, b = 0;
+
+    for (size_t i = 0; i < offsetof(struct dose_record, check); i++) {
+        a = (a + data[i]) % 255;
+        b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+}
+
+static bool journal_valid(const struct dose_record *record) {
+    return record->seq != 0 && record->seq != UINT32_MAX && record->check == journal_check(record);
+}
+
+static bool journal_erased(const struct dose_record *record) {
+    const uint8_t *data = (const uint8_t *) record;
+    for (size_t i = 0; i < sizeof(*record); i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t journal_offset(size_t sector, size_t slot) {
+    return sector * JOURNAL_SECTOR_SIZE + slot * sizeof(struct dose_record);
+}
+
+static void journal_index(struct journal_sector *sector, const struct dose_record *record) {
+    if (sector->first_seq == 0) {
+        sector->first_seq = record->seq;
+        sector->min_time = record->time;
+        sector->max_time = record->time;
+    }
+    sector->last_seq = record->seq;
+    sector->min_time = record->time < sector->min_time ? record->time : sector->min_time;
+    sector->max_time = record->time > sector->max_time ? record->time : sector->max_time;
+}
+
+static bool journal_erase(size_t sector) {
+    memset(&sectors[sector], 0, sizeof(sectors[sector]));
+    esp_err_t err = esp_partition_erase_range(partition, sector * JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Erase of sector %u failed (%d)", sector, err);
+        return false;
+    }
+    return true;
+}
+
+/* Builds the index and finds the head */
+static void journal_scan(void) {
+    static struct dose_record records[JOURNAL_READ_RECORDS];
+    bool empty = true;
+
+    for (size_t s = 0; s < sectors_count; s++) {
+        struct journal_sector *sector = &sectors[s];
+        bool end = false;
+
+        memset(sector, 0, sizeof(*sector));
+        for (size_t slot = 0; slot < RECORDS_PER_SECTOR && !end; slot += JOURNAL_READ_RECORDS) {
+            size_t count = RECORDS_PER_SECTOR - slot < JOURNAL_READ_RECORDS ? RECORDS_PER_SECTOR - slot : JOURNAL_READ_RECORDS;
+            if (esp_partition_read(partition, journal_offset(s, slot), records, count * sizeof(records[0])) != ESP_OK) {
+                ESP_LOGE(TAG, "Read of sector %u failed", s);
+                break;
+            }
+            for (size_t i = 0; i < count && !end; i++) {
+                if (journal_erased(&records[i])) {
+                    end = true;
+                    break;
+                }
+                sector->used++;
+                if (journal_valid(&records[i])) {
+                    journal_index(sector, &records[i]);
+                }
+            }
+        }
+
+        if (sector->first_seq != 0 && (empty || sector->last_seq >= next_seq)) {
+            empty = false;
+            next_seq = sector->last_seq + 1;
+            head_sector = s;
+            head_slot = sector->used;
+        }
+    }
+
+    if (empty) {
+        // Fresh or foreign partition content
+        for (size_t s = 0; s < sectors_count; s++) {
+            if (sectors[s].used != 0) {
+                journal_erase(s);
+            }
+        }
+        head_sector = 0;
+        head_slot = 0;
+        next_seq = 1;
+    }
+    ESP_LOGI(TAG, "Journal head at sector %u slot %u, next seq %u", head_sector, head_slot, next_seq);
+}
+
+static void journal_write(struct dose_record *record) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (head_slot == RECORDS_PER_SECTOR) {
+        head_sector = (head_sector + 1) % sectors_count;
+        head_slot = 0;
+        journal_erase(head_sector);
+    }
+
+    record->seq = next_seq;
+    record->check = journal_check(record);
+    esp_err_t err = esp_partition_write(partition, journal_offset(head_sector, head_slot), record, sizeof(*record));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Write of record %u failed (%d)", record->seq, err);
+    } else {
+        journal_index(&sectors[head_sector], record);
+        next_seq++;
+    }
+
+    // Failed slot may hold partial data, it is never written again
+    sectors[head_sector].used++;
+    head_slot++;
+    xSemaphoreGive(lock);
+}
+
+static void journal_task(void *pvParameters) {
+    struct dose_record record;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    journal_scan();
+    ready = true;
+    xSemaphoreGive(lock);
+
+    while (1) {
+        if (xQueueReceive(queue, &record, portMAX_DELAY) == pdTRUE) {
+            journal_write(&record);
+        }
+    }
+}
+
+bool journal_init(void) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, JOURNAL_LABEL);
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "No %s partition", JOURNAL_LABEL);
+        return false;
+    }
+
+    sectors_count = partition->size / JOURNAL_SECTOR_SIZE;
+    if (sectors_count > JOURNAL_SECTORS_MAX) {
+        sectors_count = JOURNAL_SECTORS_MAX;
+    }
+    if (sectors_count < 2) {
+        ESP_LOGE(TAG, "Partition is too small");
+        return false;
+    }
+
+    lock = xSemaphoreCreateMutex();
+    queue = xQueueCreate(JOURNAL_QUEUE_LENGTH, sizeof(struct dose_record));
+    if (lock == NULL || queue == NULL) {
+        ESP_LOGE(TAG, "Can't create journal queue");
+        return false;
+    }
+
+    BaseType_t rc = xTaskCreate(
+            journal_task,
+            "Journal task",
+            2048,
+            NULL,
+            tskIDLE_PRIORITY + 1,
+            NULL);
+
+    if (rc != pdPASS) {
+        ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
+        return false;
+    }
+    return true;
+}
+
+void journal_add(uint8_t pin, uint32_t time, uint32_t requested, uint32_t actual, enum dose_result result) {
+    struct dose_record record = {
+            .time = time,
+            .requested = requested,
+            .actual = actual,
+            .pin = pin,
+            .result = result,
+    };
+
+    if (queue == NULL || xQueueSend(queue, &record, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Dropped record for pin %u", (unsigned) pin);
+    }
+}
+
+static bool journal_match(const struct history_request *request, const struct dose_record *record) {
+    return record->seq >= request->seq && record->time >= request->from &&
+           (request->to == 0 || record->time < request->to);
+}
+
+size_t journal_query(const struct history_request *request, uint8_t *reply, size_t size) {
+    static struct dose_record records[JOURNAL_READ_RECORDS];
+    struct history_page *page = (struct history_page *) reply;
+    struct dose_record *out = (struct dose_record *) (reply + sizeof(*page));
+    size_t capacity = (size - sizeof(*page)) / sizeof(*out);
+    size_t count = 0;
+
+    if (!ready || size < sizeof(*page)) {
+        ESP_LOGE(TAG, "Journal is not ready");
+        return 0;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    page->more = 0;
+    page->next_seq = next_seq;
+
+    // Oldest sector is the one after the head
+    for (size_t i = 1; i <= sectors_count && !page->more; i++) {
+        size_t s = (head_sector + i) % sectors_count;
+        const struct journal_sector *sector = &sectors[s];
+
+        if (sector->first_seq == 0 || sector->last_seq < request->seq ||
+            sector->max_time < request->from || (request->to != 0 && sector->min_time >= request->to)) {
+            continue;
+        }
+
+        for (size_t slot = 0; slot < sector->used && !page->more; slot += JOURNAL_READ_RECORDS) {
+            size_t chunk = sector->used - slot < JOURNAL_READ_RECORDS ? sector->used - slot : JOURNAL_READ_RECORDS;
+            if (esp_partition_read(partition, journal_offset(s, slot), records, chunk * sizeof(records[0])) != ESP_OK) {
+                ESP_LOGE(TAG, "Read of sector %u failed", s);
+                break;
+            }
+            for (size_t j = 0; j < chunk; j++) {
+                if (!journal_valid(&records[j]) || !journal_match(request, &records[j])) {
+                    continue;
+                }
+                if (count == capacity) {
+                    page->more = 1;
+                    page->next_seq = records[j].seq;
+                    break;
+                }
+                memcpy(&out[count++], &records[j], sizeof(*out));
+            }
+        }
+    }
+    xSemaphoreGive(lock);
+
+    return sizeof(*page) + count * sizeof(*out);
+}
@@ -0,0 +1,34 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : journal.h
+ * PURPOSE     : Dose journal module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __JOURNAL_H_
+#define __JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+/* Starts the journal task, the index is built in background */
+bool journal_init(void);
+
+/* Queues a record, never blocks on flash */
+void journal_add(uint8_t pin, uint32_t time, uint32_t requested, uint32_t actual, enum dose_result result);
+
+/* Fills `reply` with struct history_page and records.
+ * Returns reply size, 0 on failure */
+size_t journal_query(const struct history_request *request, uint8_t *reply, size_t size);
+
+#endif /* __JOURNAL_H_ */
@@ -6,7 +6,7 @@
 /* FILE NAME   : main.c
  * PURPOSE     : Entry point module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 29.05.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -19,8 +19,16 @@
 #include "freertos/task.h"
 #include "sdkconfig.h"
 
+#include "broker.h"
+#include "deferred.h"
 #include "encryption.h"
+#include "flow.h"
+#include "heap.h"
+#include "journal.h"
+#include "ota.h"
+#include "power.h"
 #include "pump.h"
+#include "schedule.h"
 #include "server.h"
 #include "sntp.h"
 #include "storage.h"
@@ -30,21 +38,35 @@ static const char TAG[] = "main";
 
 int app_main(void) {
     ESP_LOGI(TAG, "Hello world!");
-    pump_init();
-    wifi_connect();
-    sntp_run();
+    // Requests are served from this task
+    heap_track_task(NULL);
+    // Pump curves and configs below are read from NVS
     storage_init();
+    sntp_restore();
+    pump_init();
+    ota_init();
+    power_init();
+    flow_init();
+    journal_init();
+    deferred_init();
+    encryption_init();
 
-
+    // Server is bound before the connection is up and starts answering with it
+    wifi_start();
     if (!server_init()) {
         ESP_LOGE(TAG, "Failed to initialize server");
     }
+    broker_start();
+    sntp_run();
+    schedule_init();
+    heap_track_start();
 
     while (1) {
         if (!server_response()) {
             ESP_LOGE(TAG, "Server error");
         }
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        broker_report();
+        heap_track_log();
     }
     return 0;
 }
\ No newline at end of file
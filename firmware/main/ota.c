@@ -0,0 +1,400 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : ota.c
+ * PURPOSE     : Firmware update module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Image or patch is read from HTTP in OTA_BUF_SIZE chunks and written
+ * to the other ota partition as it comes, patch COPY ops are read from
+ * the running partition. The signed command carries SHA-256 of the
+ * result, so the download itself needs no signature.
+ *
+ * A new image is confirmed by server_init(). Until then every boot is
+ * counted in NVS and after OTA_MAX_ATTEMPTS the previous image boots. */
+
+#include "ota.h"
+
+#include <string.h>
+
+#include "esp_http_client.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include <wolfssl/wolfcrypt/sha256.h>
+
+#include "storage.h"
+
+#define NVS_OTA_KEY "ota"
+
+#define OTA_BUF_SIZE 1024
+
+#define OTA_HTTP_TIMEOUT_MS 10000
+
+/* Boots of a new image without confirmation before rollback */
+#define OTA_MAX_ATTEMPTS 2
+
+/* Image hanging before server_init() is restarted and counted */
+#define OTA_CONFIRM_TIMEOUT_US (120 * 1000000LL)
+
+static const char TAG[] = "ota";
+
+/* Stored in NVS while a new image is not confirmed */
+struct ota_state {
+    uint8_t pending;
+    uint8_t attempts;
+    uint32_t previous; /* Address of the image to roll back to */
+};
+
+struct ota_job {
+    struct ota_request request;
+    char url[OTA_URL_MAX + 1];
+};
+
+struct ota_writer {
+    esp_ota_handle_t handle;
+    const esp_partition_t *running;
+    wc_Sha256 sha;
+    uint32_t written;
+    uint32_t image_size;
+};
+
+/* Patch parser state, op headers may be split between chunks */
+struct ota_patch {
+    byte header[sizeof(struct ota_patch_op)];
+    size_t header_size;
+    bool magic;
+    uint32_t insert_left;
+};
+
+static struct ota_job job;
+static volatile bool busy = false;
+static esp_timer_handle_t confirm_timer = NULL;
+
+static void ota_clear(void) {
+    struct ota_state state = {0};
+    storage_write(NVS_OTA_KEY, &state, sizeof(state));
+}
+
+static void ota_confirm_timeout(void *arg) {
+    ESP_LOGE(TAG, "Image was not confirmed in time");
+    esp_restart();
+}
+
+static const esp_partition_t *ota_find(uint32_t address) {
+    const esp_partition_t *result = NULL;
+    esp_partition_iterator_t it = esp_partition_find(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, NULL);
+
+    while (it != NULL) {
+        const esp_partition_t *partition = esp_partition_get(it);
+        if (partition->address == address) {
+            result = partition;
+            break;
+        }
+        it = esp_partition_next(it);
+    }
+    if (it != NULL) {
+        esp_partition_iterator_release(it);
+    }
+    return result;
+}
+
+void ota_init(void) {
+    struct ota_state state;
+    size_t size = sizeof(state);
+
+    if (!storage_read(NVS_OTA_KEY, &state, &size) || size != sizeof(state) || !state.pending) {
+        return;
+    }
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (running->address == state.previous) {
+        // Update never booted or was rolled back already
+        ota_clear();
+        return;
+    }
+
+    state.attempts++;
+    ESP_LOGW(TAG, "Unconfirmed image, boot %u of %u", (unsigned) state.attempts, OTA_MAX_ATTEMPTS);
+    if (state.attempts > OTA_MAX_ATTEMPTS) {
+        const esp_partition_t *previous = ota_find(state.previous);
+        ota_clear();
+        if (previous == NULL || esp_ota_set_boot_partition(previous) != ESP_OK) {
+            ESP_LOGE(TAG, "Can't roll back to 0x%X", state.previous);
+            return;
+        }
+        ESP_LOGE(TAG, "Rolling back to 0x%X", state.previous);
+        esp_restart();
+    }
+    storage_write(NVS_OTA_KEY, &state, sizeof(state));
+
+    const esp_timer_create_args_t args = {
+            .callback = ota_confirm_timeout,
+            .name = "ota confirm",
+    };
+    if (esp_timer_create(&args, &confirm_timer) != ESP_OK ||
+        esp_timer_start_once(confirm_timer, OTA_CONFIRM_TIMEOUT_US) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't start confirm timer");
+    }
+}
+
+void ota_confirm(void) {
+    if (confirm_timer == NULL) {
+        return;
+    }
+
+    esp_timer_stop(confirm_timer);
+    esp_timer_delete(confirm_timer);
+    confirm_timer = NULL;
+    ota_clear();
+    ESP_LOGI(TAG, "Image confirmed");
+}
+
+static bool ota_output(struct ota_writer *writer, const byte *data, size_t size) {
+    if (size > writer->image_size - writer->written) {
+        ESP_LOGE(TAG, "Image is longer than %u", writer->image_size);
+        return false;
+    }
+
+    esp_err_t err = esp_ota_write(writer->handle, data, size);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_write failed (%d)", err);
+        return false;
+    }
+    wc_Sha256Update(&writer->sha, data, size);
+    writer->written += size;
+    return true;
+}
+
+static bool ota_copy(struct ota_writer *writer, uint32_t offset, uint32_t length) {
+    static byte buf[OTA_BUF_SIZE];
+
+    if (offset > writer->running->size || length > writer->running->size - offset) {
+        ESP_LOGE(TAG, "Copy 0x%X+%u is out of the running image", offset, length);
+        return false;
+    }
+
+    while (length > 0) {
+        size_t size = length < sizeof(buf) ? length : sizeof(buf);
+        if (esp_partition_read(writer->running, offset, buf, size) != ESP_OK ||
+            !ota_output(writer, buf, size)) {
+            return false;
+        }
+        offset += size;
+        length -= size;
+    }
+    return true;
+}
+
+static bool ota_patch_feed(struct ota_patch *patch, struct ota_writer *writer, const byte *data, size_t size) {
+    while (size > 0) {
+        if (patch->insert_left > 0) {
+            size_t chunk = size < patch->insert_left ? size : patch->insert_left;
+            if (!ota_output(writer, data, chunk)) {
+                return false;
+            }
+            patch->insert_left -= chunk;
+            data += chunk;
+            size -= chunk;
+            continue;
+        }
+
+        size_t expected = patch->magic ? sizeof(struct ota_patch_op) : sizeof(uint32_t);
+        size_t chunk = expected - patch->header_size;
+        chunk = size < chunk ? size : chunk;
+        memcpy(patch->header + patch->header_size, data, chunk);
+        patch->header_size += chunk;
+        data += chunk;
+        size -= chunk;
+        if (patch->header_size < expected) {
+            continue;
+        }
+        patch->header_size = 0;
+
+        if (!patch->magic) {
+            uint32_t magic;
+            memcpy(&magic, patch->header, sizeof(magic));
+            if (magic != OTA_PATCH_MAGIC) {
+                ESP_LOGE(TAG, "Invalid patch magic 0x%08X", magic);
+                return false;
+            }
+            patch->magic = true;
+            continue;
+        }
+
+        struct ota_patch_op op;
+        memcpy(&op, patch->header, sizeof(op));
+        switch (op.op) {
+            case OTA_OP_COPY:
+                if (!ota_copy(writer, op.offset, op.length)) {
+                    return false;
+                }
+                break;
+            case OTA_OP_INSERT:
+                patch->insert_left = op.length;
+                break;
+            default:
+                ESP_LOGE(TAG, "Unknown patch op %u", (unsigned) op.op);
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool ota_download(const struct ota_job *update, struct ota_writer *writer) {
+    static byte buf[OTA_BUF_SIZE];
+    struct ota_patch patch = {0};
+
+    esp_http_client_config_t config = {
+            .url = update->url,
+            .timeout_ms = OTA_HTTP_TIMEOUT_MS,
+    };
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL) {
+        ESP_LOGE(TAG, "Can't create HTTP client");
+        return false;
+    }
+
+    bool ok = esp_http_client_open(client, 0) == ESP_OK;
+    if (ok) {
+        esp_http_client_fetch_headers(client);
+        int status = esp_http_client_get_status_code(client);
+        if (status != 200) {
+            ESP_LOGE(TAG, "HTTP status %d", status);
+            ok = false;
+        }
+    } else {
+        ESP_LOGE(TAG, "Can't connect to %s", update->url);
+    }
+
+    while (ok) {
+        int len = esp_http_client_read(client, (char *) buf, sizeof(buf));
+        if (len < 0) {
+            ESP_LOGE(TAG, "HTTP read error");
+            ok = false;
+        } else if (len == 0) {
+            break;
+        } else if (update->request.mode == OTA_DELTA) {
+            ok = ota_patch_feed(&patch, writer, buf, len);
+        } else {
+            ok = ota_output(writer, buf, len);
+        }
+    }
+
+    if (ok && (patch.insert_left != 0 || patch.header_size != 0)) {
+        ESP_LOGE(TAG, "Patch is truncated");
+        ok = false;
+    }
+
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return ok;
+}
+
+static bool ota_update(const struct ota_job *update) {
+    struct ota_writer writer = {
+            .running = esp_ota_get_running_partition(),
+            .image_size = update->request.image_size,
+    };
+    const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+
+    if (target == NULL || writer.image_size > target->size) {
+        ESP_LOGE(TAG, "No partition for %u bytes image", writer.image_size);
+        return false;
+    }
+
+    esp_err_t err = esp_ota_begin(target, writer.image_size, &writer.handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed (%d)", err);
+        return false;
+    }
+    wc_InitSha256(&writer.sha);
+
+    int64_t start = esp_timer_get_time();
+    bool ok = ota_download(update, &writer);
+
+    byte digest[OTA_SHA256_SIZE];
+    wc_Sha256Final(&writer.sha, digest);
+    if (ok && (writer.written != writer.image_size ||
+               memcmp(digest, update->request.image_sha256, sizeof(digest)) != 0)) {
+        ESP_LOGE(TAG, "Image mismatch, %u of %u bytes", writer.written, writer.image_size);
+        ok = false;
+    }
+
+    // Ends the update in any case to release the handle
+    err = esp_ota_end(writer.handle);
+    if (!ok || err != ESP_OK) {
+        ESP_LOGE(TAG, "Update failed (%d)", err);
+        return false;
+    }
+
+    struct ota_state state = {
+            .pending = 1,
+            .attempts = 0,
+            .previous = writer.running->address,
+    };
+    if (!storage_write(NVS_OTA_KEY, &state, sizeof(state)) ||
+        esp_ota_set_boot_partition(target) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't switch to the new image");
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Wrote %u bytes to 0x%X in %ums", writer.written, target->address,
+             (unsigned) ((esp_timer_get_time() - start) / 1000));
+    return true;
+}
+
+static void ota_task(void *pvParameters) {
+    if (ota_update(&job)) {
+        ESP_LOGI(TAG, "Restarting into the new image");
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+
+    busy = false;
+    vTaskDelete(NULL);
+}
+
+bool ota_start(const struct ota_request *request, const char *url, size_t url_size) {
+    if (busy) {
+        ESP_LOGE(TAG, "Update is running already");
+        return false;
+    }
+    if (url_size == 0 || url_size > OTA_URL_MAX || memchr(url, '\0', url_size) != NULL ||
+        (request->mode != OTA_FULL && request->mode != OTA_DELTA)) {
+        ESP_LOGE(TAG, "Invalid update request");
+        return false;
+    }
+
+    memcpy(&job.request, request, sizeof(job.request));
+    memcpy(job.url, url, url_size);
+    job.url[url_size] = '\0';
+    busy = true;
+
+    BaseType_t rc = xTaskCreate(
+            ota_task,
+            "OTA task",
+            4096,
+            NULL,
+            tskIDLE_PRIORITY + 1,
+            NULL);
+
+    if (rc != pdPASS) {
+        ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
+        busy = false;
+        return false;
+    }
+    ESP_LOGI(TAG, "Updating from %s", job.url);
+    return true;
+}
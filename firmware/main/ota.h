@@ -0,0 +1,33 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : ota.h
+ * PURPOSE     : Firmware update module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __OTA_H_
+#define __OTA_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+/* Counts boots of a not yet confirmed image, rolls back to
+ * the previous one after too many. Call after storage_init() */
+void ota_init(void);
+
+/* Running image works, stops the rollback */
+void ota_confirm(void);
+
+/* Starts the update task, `url` is not zero terminated */
+bool ota_start(const struct ota_request *request, const char *url, size_t url_size);
+
+#endif /* __OTA_H_ */
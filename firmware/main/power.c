@@ -0,0 +1,209 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : power.c
+ * PURPOSE     : Pump current budget
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Doses are admitted as a whole, a group never starts partially. Queued
+ * doses start first fit, so a small one may pass a big one waiting for
+ * more current, but only POWER_BYPASS_MAX times in a row. A dose for a
+ * channel that runs or is queued waits behind it, whatever the current,
+ * one channel is never switched by two doses. */
+
+#include "power.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "storage.h"
+
+#define POWER_NVS_KEY "power"
+
+/* Current of channels missing in the config */
+#define POWER_DEFAULT_PUMP_MA 250
+
+/* Times the queue head can be passed by smaller doses */
+#define POWER_BYPASS_MAX 4
+
+static const char TAG[] = "power";
+
+struct queued {
+    pump_mask_t mask;
+    uint32_t demand;
+    void *item;
+};
+
+static struct power_config config;
+static uint32_t in_use = 0;
+
+/* Channels with current reserved */
+static pump_mask_t running = 0;
+
+static struct queued queue[POWER_QUEUE_MAX];
+static size_t queue_count = 0;
+static uint32_t head_bypassed = 0;
+
+static SemaphoreHandle_t lock = NULL;
+
+static void power_defaults(struct power_config *value) {
+    memset(value, 0, sizeof(*value));
+    for (size_t i = 0; i < POWER_MAX_CHANNELS; i++) {
+        value->current_ma[i] = POWER_DEFAULT_PUMP_MA;
+    }
+}
+
+bool power_init(void) {
+    size_t size = sizeof(config);
+
+    lock = xSemaphoreCreateMutex();
+    if (lock == NULL) {
+        ESP_LOGE(TAG, "Can't create lock");
+        return false;
+    }
+
+    if (!storage_read(POWER_NVS_KEY, &config, &size) || size != sizeof(config)) {
+        power_defaults(&config);
+    }
+    ESP_LOGI(TAG, "Budget %umA", (unsigned) config.budget_ma);
+    return true;
+}
+
+bool power_set(const struct power_config *value, size_t size) {
+    if (size < POWER_CONFIG_SIZE(0) || value->channels_count > pump_driver_channels() ||
+        size != POWER_CONFIG_SIZE(value->channels_count)) {
+        ESP_LOGE(TAG, "Invalid power config size %u", size);
+        return false;
+    }
+
+    struct power_config updated;
+    power_defaults(&updated);
+    memcpy(&updated, value, size);
+
+    if (!storage_write(POWER_NVS_KEY, &updated, sizeof(updated))) {
+        ESP_LOGE(TAG, "Can't write to NVS");
+        return false;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    config = updated;
+    xSemaphoreGive(lock);
+    ESP_LOGI(TAG, "Budget %umA, %u channels set", (unsigned) config.budget_ma, (unsigned) config.channels_count);
+    return true;
+}
+
+static uint32_t power_demand(pump_mask_t mask) {
+    uint32_t demand = 0;
+    for (size_t pin = 0; pin < POWER_MAX_CHANNELS; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            demand += config.current_ma[pin];
+        }
+    }
+    return demand;
+}
+
+/* Nothing running always fits, a dose left over a lowered budget runs alone */
+static bool power_fits(uint32_t demand) {
+    return config.budget_ma == 0 || in_use == 0 || in_use + demand <= config.budget_ma;
+}
+
+/* Channels of queue items before `count` */
+static pump_mask_t power_queued(size_t count) {
+    pump_mask_t mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        mask |= queue[i].mask;
+    }
+    return mask;
+}
+
+enum power_admission power_admit(pump_mask_t mask, void *item) {
+    enum power_admission res = POWER_START;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t demand = power_demand(mask);
+
+    if (config.budget_ma != 0 && demand > config.budget_ma) {
+        ESP_LOGE(TAG, "Pumps 0x%X need %umA over the %umA budget", mask, demand, (unsigned) config.budget_ma);
+        res = POWER_REJECTED;
+    } else if (!(mask & (running | power_queued(queue_count))) && power_fits(demand) &&
+               (queue_count == 0 || head_bypassed < POWER_BYPASS_MAX)) {
+        in_use += demand;
+        running |= mask;
+        head_bypassed += queue_count != 0;
+    } else if (queue_count == POWER_QUEUE_MAX) {
+        ESP_LOGE(TAG, "Power queue is full");
+        res = POWER_REJECTED;
+    } else {
+        queue[queue_count].mask = mask;
+        queue[queue_count].demand = demand;
+        queue[queue_count].item = item;
+        queue_count++;
+        ESP_LOGI(TAG, "Pumps 0x%X queued, %umA in use", mask, in_use);
+        res = POWER_QUEUED;
+    }
+    xSemaphoreGive(lock);
+    return res;
+}
+
+void power_release(pump_mask_t mask) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    uint32_t demand = power_demand(mask);
+    in_use = demand > in_use ? 0 : in_use - demand;
+    running &= ~mask;
+    xSemaphoreGive(lock);
+}
+
+void *power_cancel(pump_mask_t mask) {
+    void *item = NULL;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (size_t i = 0; i < queue_count; i++) {
+        if (queue[i].mask & mask) {
+            item = queue[i].item;
+            head_bypassed = i == 0 ? 0 : head_bypassed;
+            queue_count--;
+            memmove(&queue[i], &queue[i + 1], (queue_count - i) * sizeof(queue[0]));
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return item;
+}
+
+void *power_next(void) {
+    void *item = NULL;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (size_t i = 0; i < queue_count; i++) {
+        // Waits for its channels, earlier doses of them go first
+        if (queue[i].mask & (running | power_queued(i))) {
+            continue;
+        }
+        if (!power_fits(queue[i].demand)) {
+            if (i == 0 && head_bypassed >= POWER_BYPASS_MAX) {
+                break;
+            }
+            continue;
+        }
+
+        item = queue[i].item;
+        in_use += queue[i].demand;
+        running |= queue[i].mask;
+        head_bypassed = i == 0 ? 0 : head_bypassed + 1;
+        queue_count--;
+        memmove(&queue[i], &queue[i + 1], (queue_count - i) * sizeof(queue[0]));
+        break;
+    }
+    xSemaphoreGive(lock);
+    return item;
+}
@@ -0,0 +1,51 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : power.h
+ * PURPOSE     : Pump current budget
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __POWER_H_
+#define __POWER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+#include "pump_driver.h"
+
+/* Doses waiting for current at once */
+#define POWER_QUEUE_MAX 8
+
+enum power_admission {
+    POWER_START,   /* Current is reserved, start now */
+    POWER_QUEUED,  /* Returned by power_next once current frees up */
+    POWER_REJECTED /* Over the whole budget or the queue is full */
+};
+
+/* Loads the budget from NVS, call after storage_init */
+bool power_init(void);
+
+bool power_set(const struct power_config *config, size_t size);
+
+/* Reserves current of `mask` channels or queues `item` for them, also
+ * while one of them runs or waits for an earlier dose */
+enum power_admission power_admit(pump_mask_t mask, void *item);
+
+/* Gives back current of stopped channels */
+void power_release(pump_mask_t mask);
+
+/* Removes the first queued item with a channel of `mask`, NULL if none */
+void *power_cancel(pump_mask_t mask);
+
+/* Next queued item that fits now with its current reserved, NULL if none */
+void *power_next(void);
+
+#endif /* __POWER_H_ */
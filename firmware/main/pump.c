@@ -6,7 +6,7 @@
 /* FILE NAME   : pump.c
  * PURPOSE     : Pump logic handler
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 06.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -14,166 +14,963 @@
 #include "pump.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
+#include "flow.h"
+#include "heap.h"
+#include "journal.h"
+#include "power.h"
+#include "pump_driver.h"
+#include "pump_state.h"
+#include "sntp.h"
 #include "storage.h"
 
 static const char TAG[] = "pump";
 
+/* Sensor doses stop anyway after this share of the curve time */
+#define FLOW_LIMIT_PERCENT 200
+
+/* Limit of sensor doses on channels without a curve yet */
+#define FLOW_UNCALIBRATED_LIMIT_MS (5 * 60 * 1000)
+
+/* Curve follows sensor doses off by more than this, by 1/FLOW_LEARN_DIVIDER
+ * of the error each time */
+#define FLOW_LEARN_MIN_PERCENT 2
+#define FLOW_LEARN_DIVIDER     4
+
+/* Sensor doses may learn the curve, NVS needs the bigger stack */
+#define PUMP_TASK_STACK 3072
+
+/* Doses running at once with HEAP_STATIC, a worker task each, one more
+ * fails to start. washer_sim shows how many run at once for a workload */
+#ifndef PUMP_STATIC_DOSES
+#define PUMP_STATIC_DOSES 8
+#endif
+
+/* Doses command tasks build at once, they hold a pool entry until the
+ * power queue takes or rejects them */
+#ifndef PUMP_STATIC_PENDING
+#define PUMP_STATIC_PENDING 4
+#endif
+
 #define NVS_KEY(PIN)           \
     char nvs_key[] = "pump_A"; \
     nvs_key[sizeof(nvs_key) - 2] += (PIN)
 
-static const int pin_to_gpio[] = {
-        GPIO_NUM_16,
-        GPIO_NUM_5,
-        GPIO_NUM_4,
-        GPIO_NUM_0,
-        GPIO_NUM_2,
-        GPIO_NUM_14,
-        GPIO_NUM_12,
-        GPIO_NUM_13,
-};
-static const size_t pins_count = sizeof(pin_to_gpio) / sizeof(pin_to_gpio[0]);
+/* NVS curves, loaded by pump_init so doses never wait for NVS */
+static struct pump_data curves[PUMP_CHANNELS_MAX];
+static bool curves_loaded[PUMP_CHANNELS_MAX];
 
-bool pump_init() {
-    esp_err_t err;
+/* Server and pump tasks both update curves */
+static SemaphoreHandle_t curves_lock = NULL;
 
-    for (int i = 0; i < pins_count; i++) {
-        gpio_num_t gpio_pin = pin_to_gpio[i];
+/* Stop commands and pump tasks both end doses */
+static SemaphoreHandle_t active_lock = NULL;
 
-        err = gpio_set_pull_mode(gpio_pin, GPIO_FLOATING);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "gpio pullmode failed for GPIO%d: %s",
-                     gpio_pin, esp_err_to_name(err));
-            return false;
-        }
+static size_t pins_count = 0;
 
-        err = gpio_set_direction(gpio_pin, GPIO_MODE_OUTPUT);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "gpio direction failed for GPIO%d: %s",
-                     gpio_pin, esp_err_to_name(err));
-            return false;
-        }
+static pump_listener_t listener = NULL;
+
+static bool pump_workers_init(void);
+static void pump_curve_load(int pin);
+
+bool pump_init() {
+    if (!pump_driver_init()) {
+        return false;
+    }
+
+    pins_count = pump_driver_channels();
+    curves_lock = xSemaphoreCreateMutex();
+    active_lock = xSemaphoreCreateMutex();
+    if (curves_lock == NULL || active_lock == NULL) {
+        return false;
+    }
+    for (size_t pin = 0; pin < pins_count; pin++) {
+        pump_curve_load(pin);
+    }
+    return pump_workers_init();
+}
 
-        err = gpio_set_level(gpio_pin, 0);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "gpio_set_level(0) failed for GPIO%d: %s",
-                     gpio_pin, esp_err_to_name(err));
+static bool pump_curve_valid(const struct calibration_point *points, size_t count) {
+    if (count == 0 || count > CALIBRATION_MAX_POINTS) {
+        ESP_LOGE(TAG, "Invalid calibration points count %u", count);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t prev_volume = i == 0 ? 0 : points[i - 1].volume;
+        uint32_t prev_time = i == 0 ? 0 : points[i - 1].time;
+        if (points[i].volume <= prev_volume || points[i].time < prev_time) {
+            ESP_LOGE(TAG, "Calibration point %u is not increasing", i);
             return false;
         }
     }
-
-    ESP_LOGI(TAG, "pump_init: configured %u GPIOs (with pull-down) and set to LOW",
-             pins_count);
     return true;
 }
 
-bool pump_callibrate(int pin, double new_speed) {
+bool pump_callibrate(int pin, const struct calibration_point *points, size_t count) {
+    if (pin < 0 || (size_t) pin >= pins_count) {
+        ESP_LOGE(TAG, "Invalid pin index %d", pin);
+        return false;
+    }
+
+    if (!pump_curve_valid(points, count)) {
+        return false;
+    }
+
     NVS_KEY(pin);
-    struct pump_data pump;
-    pump.speed = new_speed;
+    struct pump_data pump = {0};
+    pump.points_count = count;
+    memcpy(pump.points, points, count * sizeof(points[0]));
 
     if (!storage_write(nvs_key, (const void *) &pump, sizeof(pump))) {
         ESP_LOGE(TAG, "Can't write to NVS");
         return false;
     }
 
-    ESP_LOGE(TAG, "Pump %i updated", pin);
+    xSemaphoreTake(curves_lock, portMAX_DELAY);
+    curves[pin] = pump;
+    curves_loaded[pin] = true;
+    xSemaphoreGive(curves_lock);
+
+    ESP_LOGI(TAG, "Pump %i updated with %u points", pin, count);
     return true;
 }
 
-struct task_params {
-    int pin;
-    uint32_t time;
-};
+/* Boot only, a channel without a stored curve stays uncalibrated */
+static void pump_curve_load(int pin) {
+    NVS_KEY(pin);
+    struct pump_data pump;
+    size_t size = sizeof(pump);
 
-static void pump_work_time_task(void *pvParameters) {
-    struct task_params *params = (struct task_params *) pvParameters;
-    int pin = params->pin;
-    uint32_t time_ms = params->time;
-    free(pvParameters);
+    if (!storage_read(nvs_key, (void *) &pump, &size)) {
+        ESP_LOGW(TAG, "No curve for pump %i", pin);
+        return;
+    }
 
-    if (pin < 0 || (size_t) pin >= pins_count) {
-        ESP_LOGE(TAG, "Invalid pin index %d", pin);
-        vTaskDelete(NULL);
+    if (size != sizeof(pump) || !pump_curve_valid(pump.points, pump.points_count)) {
+        ESP_LOGE(TAG, "NVS data size does not match, please re-callibrate");
         return;
     }
 
-    ESP_LOGI(TAG, "Pump on %i pin will work for %ums", pin, time_ms);
-    int gpio_pin = pin_to_gpio[params->pin];
-    ESP_LOGI(TAG, "GPIO_NUM_%i for pin %i", gpio_pin, pin);
+    curves[pin] = pump;
+    curves_loaded[pin] = true;
+}
 
-    if (gpio_set_level(gpio_pin, 1) != 0) {
-        ESP_LOGE(TAG, "Can't turn pin %i on", pin);
-        vTaskDelete(NULL);
-        return;
+/* Call under curves_lock */
+static const struct pump_data *pump_curve(int pin) {
+    return curves_loaded[pin] ? &curves[pin] : NULL;
+}
+
+/* Piecewise-linear interpolation through (0, 0) and curve points,
+ * last segment is extrapolated */
+static uint32_t pump_volume_to_time(const struct pump_data *pump, uint32_t volume) {
+    uint32_t v0 = 0, t0 = 0;
+    uint32_t v1 = 0, t1 = 0;
+
+    for (int i = 0; i < pump->points_count; i++) {
+        v0 = v1;
+        t0 = t1;
+        v1 = pump->points[i].volume;
+        t1 = pump->points[i].time;
+        if (volume <= v1) {
+            break;
+        }
     }
-    ESP_LOGI(TAG, "Pump %i turned on", pin);
-    vTaskDelay(time_ms / portTICK_PERIOD_MS);
-    if (gpio_set_level(gpio_pin, 0) != 0) {
-        ESP_LOGE(TAG, "Can't turn pin %i off", pin);
-        ESP_LOGE(TAG, "Situation pizdec, force reseting");
-        esp_restart();
-        vTaskDelete(NULL);
-        return;
+
+    uint64_t dv = v1 - v0;
+    uint64_t dt = t1 - t0;
+    uint64_t time = t0 + ((uint64_t) (volume - v0) * dt + dv / 2) / dv;
+    return time > UINT32_MAX ? UINT32_MAX : (uint32_t) time;
+}
+
+/* Volume pumped in `time` ms, inverse of pump_volume_to_time */
+static uint32_t pump_time_to_volume(const struct pump_data *pump, uint32_t time) {
+    uint32_t v0 = 0, t0 = 0;
+    uint32_t v1 = 0, t1 = 0;
+
+    for (int i = 0; i < pump->points_count; i++) {
+        v0 = v1;
+        t0 = t1;
+        v1 = pump->points[i].volume;
+        t1 = pump->points[i].time;
+        if (time <= t1) {
+            break;
+        }
+    }
+
+    uint64_t dt = t1 - t0;
+    if (dt == 0) {
+        return v1;
     }
+    uint64_t volume = v0 + ((uint64_t) (time - t0) * (v1 - v0) + dt / 2) / dt;
+    return volume > UINT32_MAX ? UINT32_MAX : (uint32_t) volume;
+}
 
-    ESP_LOGI(TAG, "Pump %i turned off", pin);
+/* Channels switched off together */
+struct stop_entry {
+    pump_mask_t mask;
+    uint32_t time;     /* Milliseconds, limit of sensor stops */
+    uint32_t expected; /* Milliseconds by the curve, 0 without one */
+    uint32_t pulses;   /* Sensor stop target, 0 for timed stops */
+    uint32_t volume;
+    uint8_t pin;       /* Channel of a sensor stop */
+    bool shortened;    /* `time` was cut by a stop command */
+    int64_t off_at;    /* esp_timer time a stop command switched it off */
+    bool done;
+};
 
-    vTaskDelete(NULL);
+struct task_params {
+    struct pump_origin origin;
+    int64_t queued;      /* esp_timer time of the request */
+    int64_t started;     /* esp_timer time of the start */
+    uint32_t start_time; /* Unix time for the journal, 0 if unknown */
+    uint32_t waited;     /* Milliseconds in the power queue */
+    pump_mask_t mask;
+    TaskHandle_t task;   /* Stop task, NULL until it runs */
+    size_t count;
+    struct stop_entry stops[GROUP_MAX_STEPS];
+};
+
+/* Dose each running channel belongs to. Stop entries of running doses
+ * change only under active_lock */
+static struct task_params *active[PUMP_CHANNELS_MAX];
+
+#if HEAP_STATIC
+/* Running doses, one worker task each, the ones waiting for power and
+ * the ones not admitted yet */
+static struct task_params pool[PUMP_STATIC_DOSES + POWER_QUEUE_MAX + PUMP_STATIC_PENDING];
+static bool pool_used[PUMP_STATIC_DOSES + POWER_QUEUE_MAX + PUMP_STATIC_PENDING];
+static SemaphoreHandle_t pool_lock = NULL;
+
+struct worker {
+    TaskHandle_t task;
+    struct task_params *params; /* Reserved dose, NULL for idle workers */
+    bool started;               /* The dose is on and handed over */
+};
+
+static struct worker workers[PUMP_STATIC_DOSES];
+
+static struct task_params *pump_params_new(void) {
+    struct task_params *params = NULL;
+
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    for (size_t i = 0; i < sizeof(pool) / sizeof(pool[0]) && params == NULL; i++) {
+        if (!pool_used[i]) {
+            pool_used[i] = true;
+            params = &pool[i];
+            memset(params, 0, sizeof(*params));
+        }
+    }
+    xSemaphoreGive(pool_lock);
+
+    if (params == NULL) {
+        ESP_LOGE(TAG, "Dose pool is exhausted");
+    }
+    return params;
 }
 
-bool pump_work_time(int pin, uint32_t time_ms) {
+/* Also frees the worker running the dose */
+static void pump_params_free(struct task_params *params) {
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    pool_used[params - pool] = false;
+    for (size_t i = 0; i < PUMP_STATIC_DOSES; i++) {
+        if (workers[i].params == params) {
+            workers[i].params = NULL;
+            workers[i].started = false;
+        }
+    }
+    xSemaphoreGive(pool_lock);
+}
+#else
+static struct task_params *pump_params_new(void) {
     struct task_params *params = calloc(1, sizeof(struct task_params));
-
     if (params == NULL) {
         ESP_LOGE(TAG, "Can't allocate params structure for task");
+    }
+    return params;
+}
+
+static void pump_params_free(struct task_params *params) {
+    free(params);
+}
+#endif
+
+static void pump_journal(pump_mask_t mask, uint32_t time, uint32_t requested, uint32_t actual, enum dose_result result) {
+    for (size_t pin = 0; pin < pins_count; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            journal_add(pin, time, requested, actual, result);
+        }
+    }
+}
+
+/* Journals stopped channels and tells their origin */
+static void pump_report(const struct task_params *params, pump_mask_t mask, uint32_t requested, uint32_t actual, enum event_kind kind) {
+    pump_journal(mask, params->start_time, requested, actual, kind == EVENT_FINISHED ? DOSE_DONE : DOSE_FAILED);
+
+    if (listener == NULL || params->origin.client == 0 || params->origin.id == 0) {
+        return;
+    }
+    for (size_t pin = 0; pin < pins_count; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            struct pump_event event = {
+                    .id = params->origin.id,
+                    .pin = pin,
+                    .kind = kind,
+                    .elapsed = actual,
+                    .waited = params->waited,
+            };
+            listener(&params->origin, &event);
+        }
+    }
+}
+
+static void pump_journal_failed(const struct task_params *params) {
+    for (size_t i = 0; i < params->count; i++) {
+        pump_journal(params->stops[i].mask, params->start_time, params->stops[i].expected, 0, DOSE_FAILED);
+    }
+}
+
+static void pump_dispatch(void);
+
+/* Moves the curve 1/FLOW_LEARN_DIVIDER of the way to the time a sensor
+ * dose took. A channel without a curve gets a one point one */
+static void pump_learn(int pin, uint32_t volume, uint32_t actual_ms) {
+    struct pump_data pump = {0};
+
+    xSemaphoreTake(curves_lock, portMAX_DELAY);
+    const struct pump_data *curve = pump_curve(pin);
+    if (curve != NULL) {
+        pump = *curve;
+    }
+    xSemaphoreGive(curves_lock);
+
+    if (pump.points_count == 0) {
+        pump.points_count = 1;
+        pump.points[0].volume = volume;
+        pump.points[0].time = actual_ms;
+    } else {
+        int64_t expected = pump_volume_to_time(&pump, volume);
+        int64_t error = (int64_t) actual_ms - expected;
+        if (expected == 0 || llabs(error) * 100 < expected * FLOW_LEARN_MIN_PERCENT) {
+            return;
+        }
+
+        // Scale in 1/65536, times stay increasing
+        int64_t scale = 65536 + error * 65536 / (expected * FLOW_LEARN_DIVIDER);
+        for (int i = 0; i < pump.points_count; i++) {
+            pump.points[i].time = (uint32_t) (((uint64_t) pump.points[i].time * scale) >> 16);
+        }
+    }
+
+    ESP_LOGI(TAG, "Pump %d learned %ums for volume %u", pin, actual_ms, volume);
+    pump_callibrate(pin, pump.points, pump.points_count);
+}
+
+/* Stop entry done in one pass, reported after active_lock is given back */
+struct stop_done {
+    pump_mask_t mask;
+    uint32_t expected;
+    uint32_t actual;
+    uint32_t pulses;
+    uint32_t volume;
+    uint8_t pin;
+    enum event_kind kind;
+};
+
+/* Call under active_lock */
+static void pump_unregister(const struct task_params *params, pump_mask_t mask) {
+    for (size_t pin = 0; pin < pins_count; pin++) {
+        if ((mask & PUMP_MASK(pin)) && active[pin] == params) {
+            active[pin] = NULL;
+        }
+    }
+}
+
+/* Switches channels off as their time passes, their sensor counts the
+ * volume or a stop command cuts them, the ones due together in one write.
+ * `params` is freed once the last channel is off */
+static void pump_work(struct task_params *params) {
+    bool finished = false;
+
+    xSemaphoreTake(active_lock, portMAX_DELAY);
+    params->task = xTaskGetCurrentTaskHandle();
+    // Sensors wake the task as soon as the volume is there
+    for (size_t i = 0; i < params->count; i++) {
+        if (params->stops[i].pulses != 0) {
+            flow_watch(params->stops[i].pin, params->task);
+        }
+    }
+    xSemaphoreGive(active_lock);
+
+    while (!finished) {
+        struct stop_done done[GROUP_MAX_STEPS];
+        size_t done_count = 0;
+        bool due[GROUP_MAX_STEPS] = {false};
+        pump_mask_t mask = 0, released = 0;
+        uint32_t wait_ms = UINT32_MAX;
+
+        xSemaphoreTake(active_lock, portMAX_DELAY);
+        uint32_t now_ms = (esp_timer_get_time() - params->started) / 1000;
+        for (size_t i = 0; i < params->count; i++) {
+            struct stop_entry *stop = &params->stops[i];
+            if (stop->done) {
+                continue;
+            }
+            due[i] = stop->off_at != 0 || now_ms >= stop->time ||
+                     (stop->pulses != 0 && flow_count(stop->pin) >= stop->pulses);
+            if (!due[i]) {
+                wait_ms = stop->time - now_ms < wait_ms ? stop->time - now_ms : wait_ms;
+            } else if (stop->off_at == 0) {
+                mask |= stop->mask;
+            }
+        }
+
+        bool off = mask == 0 || pump_driver_set(mask, false, NULL);
+        int64_t now = esp_timer_get_time();
+        if (!off) {
+            ESP_LOGE(TAG, "Can't turn pins 0x%X off", mask);
+            ESP_LOGE(TAG, "Situation pizdec, force reseting");
+        } else if (mask != 0) {
+            pump_state_off(mask);
+            ESP_LOGI(TAG, "Pumps 0x%X turned off after %ums", mask, (unsigned) ((now - params->started) / 1000));
+        }
+
+        finished = true;
+        for (size_t i = 0; i < params->count; i++) {
+            struct stop_entry *stop = &params->stops[i];
+            if (due[i]) {
+                // Sensor stops that ran out of time did not pump the volume
+                bool counted = stop->pulses == 0 ? !stop->shortened : flow_count(stop->pin) >= stop->pulses;
+                struct stop_done *entry = &done[done_count++];
+                entry->mask = stop->mask;
+                entry->expected = stop->expected;
+                entry->actual = ((stop->off_at != 0 ? stop->off_at : now) - params->started) / 1000;
+                entry->pulses = stop->pulses;
+                entry->volume = stop->volume;
+                entry->pin = stop->pin;
+                entry->kind = stop->off_at != 0 ? EVENT_ABORTED
+                            : !off ? EVENT_GPIO_ERROR
+                            : counted ? EVENT_FINISHED : EVENT_ABORTED;
+                if (stop->pulses != 0) {
+                    flow_disarm(stop->pin);
+                }
+                pump_unregister(params, stop->mask);
+                released |= stop->mask;
+                stop->done = true;
+            }
+            finished = finished && stop->done;
+        }
+        xSemaphoreGive(active_lock);
+
+        if (done_count == 0) {
+            ulTaskNotifyTake(pdTRUE, (wait_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        for (size_t i = 0; i < done_count; i++) {
+            pump_report(params, done[i].mask, done[i].expected, done[i].actual, done[i].kind);
+            if (done[i].kind == EVENT_FINISHED && done[i].pulses != 0 && done[i].volume != 0) {
+                pump_learn(done[i].pin, done[i].volume, done[i].actual);
+            }
+        }
+
+        if (!off) {
+            esp_restart();
+            return;
+        }
+        power_release(released);
+        // Freed before the dispatch, a static worker can take the next dose
+        if (finished) {
+            pump_params_free(params);
+        }
+        pump_dispatch();
+    }
+}
+
+#if HEAP_STATIC
+/* Runs doses handed over by pump_task_start */
+static void pump_worker(void *pvParameters) {
+    struct worker *worker = &workers[(size_t) pvParameters];
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Wakes meant for a finished dose find no work
+        xSemaphoreTake(pool_lock, portMAX_DELAY);
+        struct task_params *params = worker->started ? worker->params : NULL;
+        xSemaphoreGive(pool_lock);
+        if (params != NULL) {
+            pump_work(params);
+        }
+    }
+}
+
+/* Takes an idle worker for the dose before anything is switched on,
+ * pump_params_free gives it back */
+static bool pump_task_reserve(struct task_params *params) {
+    bool reserved = false;
+
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    for (size_t i = 0; i < PUMP_STATIC_DOSES && !reserved; i++) {
+        if (workers[i].params == NULL) {
+            workers[i].params = params;
+            reserved = true;
+        }
+    }
+    xSemaphoreGive(pool_lock);
+
+    if (!reserved) {
+        ESP_LOGE(TAG, "All %u pump workers are busy", PUMP_STATIC_DOSES);
+    }
+    return reserved;
+}
+
+/* Hands the dose to its reserved worker */
+static bool pump_task_start(struct task_params *params) {
+    xSemaphoreTake(pool_lock, portMAX_DELAY);
+    for (size_t i = 0; i < PUMP_STATIC_DOSES; i++) {
+        if (workers[i].params == params) {
+            workers[i].started = true;
+            xTaskNotifyGive(workers[i].task);
+        }
+    }
+    xSemaphoreGive(pool_lock);
+    return true;
+}
+
+/* Workers and their stacks come from the heap once, at boot */
+static bool pump_workers_init(void) {
+    pool_lock = xSemaphoreCreateMutex();
+    if (pool_lock == NULL) {
         return false;
     }
 
-    params->pin = pin;
-    params->time = time_ms;
+    for (size_t i = 0; i < PUMP_STATIC_DOSES; i++) {
+        BaseType_t rc = xTaskCreate(
+                pump_worker,
+                "Pump worker",
+                PUMP_TASK_STACK,
+                (void *) i,
+                tskIDLE_PRIORITY + 1,
+                &workers[i].task);
+
+        if (rc != pdPASS) {
+            ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
+            return false;
+        }
+        heap_track_task(workers[i].task);
+    }
+    return true;
+}
+#else
+static void pump_work_time_task(void *pvParameters) {
+    pump_work((struct task_params *) pvParameters);
+    vTaskDelete(NULL);
+}
+
+/* The task is created on start */
+static bool pump_task_reserve(struct task_params *params) {
+    (void) params;
+    return true;
+}
 
+static bool pump_task_start(struct task_params *params) {
     BaseType_t rc = xTaskCreate(
             pump_work_time_task,
             "Pump task",
-            2048,
+            PUMP_TASK_STACK,
             params,
             tskIDLE_PRIORITY + 1,
             NULL);
 
     if (rc != pdPASS) {
-        printf("xTaskCreate failed (%d)\n", rc);
-        free(params);
+        ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
         return false;
     }
     return true;
 }
 
-bool pump_work_volume(int pin, double volume) {
-    NVS_KEY(pin);
-    struct pump_data pump;
-    size_t size = sizeof(pump);
+static bool pump_workers_init(void) {
+    return true;
+}
+#endif
 
-    if (!storage_read(nvs_key, (void *) &pump, &size)) {
-        ESP_LOGE(TAG, "Can't read pump %i data", pin);
+static bool pump_step_time(const struct group_step *step, uint32_t *time_ms) {
+    if (step->pin >= pins_count) {
+        ESP_LOGE(TAG, "Invalid pin index %d", step->pin);
         return false;
     }
 
-    if (size != sizeof(pump)) {
-        ESP_LOGE(TAG, "NVS data size does not match, please re-callibrate");
+    switch (step->command) {
+        case CMD_PUMP_WORK_TIME:
+            *time_ms = step->time;
+            return true;
+        case CMD_PUMP_WORK_VOLUME: {
+            xSemaphoreTake(curves_lock, portMAX_DELAY);
+            const struct pump_data *pump = pump_curve(step->pin);
+            *time_ms = pump == NULL ? 0 : pump_volume_to_time(pump, step->volume);
+            xSemaphoreGive(curves_lock);
+
+            // A sensor channel learns its curve on the first dose
+            if (pump == NULL && flow_pulses(step->pin, step->volume) == 0) {
+                return false;
+            }
+            ESP_LOGI(TAG, "Calculated time for pin %u: %u", (unsigned) step->pin, *time_ms);
+            return true;
+        }
+    }
+
+    ESP_LOGE(TAG, "Invalid group command 0x%X", (unsigned) step->command);
+    return false;
+}
+
+/* Undoes pump_start for channels that are off again, call under active_lock */
+static void pump_stop_failed(const struct task_params *params) {
+    for (size_t i = 0; i < params->count; i++) {
+        if (params->stops[i].pulses != 0) {
+            flow_disarm(params->stops[i].pin);
+        }
+    }
+    pump_unregister(params, params->mask);
+    pump_state_off(params->mask);
+    power_release(params->mask);
+}
+
+/* Turns channels on and hands them to a stop task. Power for them is
+ * reserved, failure gives it back */
+static bool pump_start(struct task_params *params, uint32_t *skew_cycles) {
+    if (!pump_task_reserve(params)) {
+        power_release(params->mask);
+        return false;
+    }
+
+    params->start_time = sntp_time_valid() ? (uint32_t) time(NULL) : 0;
+    params->started = esp_timer_get_time();
+    params->waited = (params->started - params->queued) / 1000;
+
+    for (size_t i = 0; i < params->count; i++) {
+        if (params->stops[i].pulses != 0) {
+            flow_arm(params->stops[i].pin, params->stops[i].pulses);
+        }
+    }
+
+    // A stop command sees the channels only once they are on
+    xSemaphoreTake(active_lock, portMAX_DELAY);
+    if (!pump_driver_set(params->mask, true, skew_cycles)) {
+        ESP_LOGE(TAG, "Can't turn pins 0x%X on", params->mask);
+        pump_driver_set(params->mask, false, NULL);
+        pump_stop_failed(params);
+        xSemaphoreGive(active_lock);
+        return false;
+    }
+    ESP_LOGI(TAG, "Pumps 0x%X turned on after %ums in queue", params->mask, params->waited);
+    for (size_t i = 0; i < params->count; i++) {
+        pump_state_on(params->stops[i].mask, params->origin.id, params->started,
+                      params->started + params->stops[i].time * 1000LL);
+    }
+    for (size_t pin = 0; pin < pins_count; pin++) {
+        if (params->mask & PUMP_MASK(pin)) {
+            active[pin] = params;
+        }
+    }
+    xSemaphoreGive(active_lock);
+
+    if (!pump_task_start(params)) {
+        xSemaphoreTake(active_lock, portMAX_DELAY);
+        pump_driver_set(params->mask, false, NULL);
+        pump_stop_failed(params);
+        xSemaphoreGive(active_lock);
+        return false;
+    }
+    return true;
+}
+
+/* Starts queued doses the freed current fits */
+static void pump_dispatch(void) {
+    struct task_params *params;
+    while ((params = power_next()) != NULL) {
+        pump_state_queue(params->mask, -1);
+        if (!pump_start(params, NULL)) {
+            for (size_t i = 0; i < params->count; i++) {
+                pump_report(params, params->stops[i].mask, params->stops[i].expected, 0, EVENT_ABORTED);
+            }
+            pump_params_free(params);
+        }
+    }
+}
+
+/* Entry of `pin` alone, a shared timed entry gives the pin its own copy.
+ * Call under active_lock */
+static struct stop_entry *pump_split(struct task_params *params, int pin) {
+    for (size_t i = 0; i < params->count; i++) {
+        struct stop_entry *stop = &params->stops[i];
+        if (stop->done || !(stop->mask & PUMP_MASK(pin))) {
+            continue;
+        }
+        if (stop->mask == PUMP_MASK(pin)) {
+            return stop;
+        }
+
+        // A shared entry has two channels or more, so there is room
+        struct stop_entry *own = &params->stops[params->count++];
+        *own = *stop;
+        own->mask = PUMP_MASK(pin);
+        own->pin = pin;
+        stop->mask &= ~PUMP_MASK(pin);
+        return own;
+    }
+    return NULL;
+}
+
+/* Volume a stopped entry has dispensed, 0 if unknown. Call under active_lock */
+static uint32_t pump_dispensed(const struct stop_entry *stop, int pin, uint32_t elapsed) {
+    if (stop->pulses != 0) {
+        return flow_volume(pin);
+    }
+
+    xSemaphoreTake(curves_lock, portMAX_DELAY);
+    const struct pump_data *pump = pump_curve(pin);
+    uint32_t volume = pump == NULL ? 0 : pump_time_to_volume(pump, elapsed);
+    xSemaphoreGive(curves_lock);
+    return volume;
+}
+
+bool pump_stop(uint32_t pin, uint32_t after_ms, uint8_t *reply, size_t size, size_t *reply_size) {
+    struct stop_report *report = (struct stop_report *) reply;
+    if (pin != PUMP_STOP_ALL && pin >= pins_count) {
+        ESP_LOGE(TAG, "Invalid pin index %u", pin);
+        return false;
+    }
+    pump_mask_t mask = pin == PUMP_STOP_ALL ? ~(pump_mask_t) 0 : PUMP_MASK(pin);
+    if (size < sizeof(*report)) {
+        return false;
+    }
+    memset(report, 0, sizeof(*report));
+    *reply_size = sizeof(*report);
+
+    // Queued doses go first, current freed below must not start them
+    struct task_params *queued;
+    while ((queued = power_cancel(mask)) != NULL) {
+        pump_state_queue(queued->mask, -1);
+        for (size_t i = 0; i < queued->count; i++) {
+            pump_report(queued, queued->stops[i].mask, queued->stops[i].expected, 0, EVENT_ABORTED);
+        }
+        pump_params_free(queued);
+        report->cancelled++;
+    }
+
+    xSemaphoreTake(active_lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    pump_mask_t off = 0;
+    for (size_t i = 0; i < pins_count; i++) {
+        struct task_params *params = active[i];
+        if (!(mask & PUMP_MASK(i)) || params == NULL) {
+            continue;
+        }
+
+        struct stop_entry *stop = pump_split(params, i);
+        uint64_t time = (now - params->started) / 1000 + (uint64_t) after_ms;
+        if (stop->off_at != 0) {
+            continue;
+        }
+        if (after_ms == 0) {
+            off |= PUMP_MASK(i);
+        } else if (time < stop->time) {
+            stop->time = time;
+            stop->shortened = true;
+            pump_state_on(PUMP_MASK(i), params->origin.id, params->started, params->started + time * 1000);
+        }
+    }
+
+    // One write for all channels, the stop tasks only do the accounting
+    if (off != 0 && !pump_driver_set(off, false, NULL)) {
+        ESP_LOGE(TAG, "Can't turn pins 0x%X off", off);
+        ESP_LOGE(TAG, "Situation pizdec, force reseting");
+        esp_restart();
+    }
+    now = esp_timer_get_time();
+    if (off != 0) {
+        pump_state_off(off);
+        ESP_LOGI(TAG, "Pumps 0x%X stopped", off);
+    }
+
+    for (size_t i = 0; i < pins_count; i++) {
+        struct task_params *params = active[i];
+        if (!(mask & PUMP_MASK(i)) || params == NULL) {
+            continue;
+        }
+
+        struct stop_entry *stop = pump_split(params, i);
+        if (off & PUMP_MASK(i)) {
+            stop->off_at = now;
+        }
+        if (size - *reply_size >= sizeof(struct stop_result)) {
+            struct stop_result *result = (struct stop_result *) (reply + *reply_size);
+            result->pin = i;
+            result->id = params->origin.id;
+            result->elapsed = (now - params->started) / 1000;
+            result->volume = pump_dispensed(stop, i, result->elapsed);
+            report->count++;
+            *reply_size += sizeof(*result);
+        }
+        if (params->task != NULL) {
+            xTaskNotifyGive(params->task);
+        }
+    }
+    xSemaphoreGive(active_lock);
+    return true;
+}
+
+void pump_set_listener(pump_listener_t value) {
+    listener = value;
+}
+
+/* A dose that got no params is journaled as failed all the same */
+static void pump_journal_rejected(const struct group_step *steps, size_t count) {
+    uint32_t start_time = sntp_time_valid() ? (uint32_t) time(NULL) : 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t time_ms;
+        if (pump_step_time(&steps[i], &time_ms)) {
+            pump_journal(PUMP_MASK(steps[i].pin), start_time, time_ms, 0, DOSE_FAILED);
+        }
+    }
+}
+
+bool pump_work_group(const struct group_step *steps, size_t count, uint32_t *skew_ns, const struct pump_origin *origin) {
+    if (count == 0 || count > GROUP_MAX_STEPS) {
+        ESP_LOGE(TAG, "Invalid group size %u", count);
         return false;
     }
 
-    uint32_t time = (uint32_t) (volume * pump.speed);
+    struct task_params *params = pump_params_new();
+    if (params == NULL) {
+        pump_journal_rejected(steps, count);
+        return false;
+    }
 
-    ESP_LOGI(TAG, "Calculated time: %u", time);
+    // Stops sorted by time, timed ones with equal times share one mask
+    pump_mask_t mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t time_ms, pulses = 0;
 
-    return pump_work_time(pin, time);
-}
\ No newline at end of file
+        if (!pump_step_time(&steps[i], &time_ms) || (mask & PUMP_MASK(steps[i].pin))) {
+            ESP_LOGE(TAG, "Invalid group step %u", i);
+            pump_params_free(params);
+            return false;
+        }
+        mask |= PUMP_MASK(steps[i].pin);
+
+        struct stop_entry stop = {
+                .time = time_ms,
+                .expected = time_ms,
+                .pin = steps[i].pin,
+        };
+        if (steps[i].command == CMD_PUMP_WORK_VOLUME) {
+            pulses = flow_pulses(steps[i].pin, steps[i].volume);
+        }
+        if (pulses != 0) {
+            stop.pulses = pulses;
+            stop.volume = steps[i].volume;
+            stop.time = time_ms == 0 ? FLOW_UNCALIBRATED_LIMIT_MS
+                                     : (uint32_t) ((uint64_t) time_ms * FLOW_LIMIT_PERCENT / 100);
+        }
+
+        size_t j = 0;
+        while (j < params->count && params->stops[j].time < stop.time) {
+            j++;
+        }
+        if (j == params->count || params->stops[j].time != stop.time || pulses != 0 || params->stops[j].pulses != 0) {
+            memmove(&params->stops[j + 1], &params->stops[j], (params->count - j) * sizeof(params->stops[0]));
+            params->stops[j] = stop;
+            params->count++;
+        }
+        params->stops[j].mask |= PUMP_MASK(steps[i].pin);
+    }
+
+    if (origin != NULL) {
+        params->origin = *origin;
+    }
+    params->mask = mask;
+    params->queued = esp_timer_get_time();
+    params->start_time = sntp_time_valid() ? (uint32_t) time(NULL) : 0;
+
+    // Counted before the dose can leave the queue
+    uint32_t skew_cycles = 0;
+    pump_state_queue(mask, 1);
+    enum power_admission admission = power_admit(mask, params);
+    if (admission != POWER_QUEUED) {
+        pump_state_queue(mask, -1);
+    }
+
+    switch (admission) {
+        case POWER_QUEUED:
+            if (skew_ns != NULL) {
+                *skew_ns = 0;
+            }
+            return true;
+        case POWER_START:
+            if (pump_start(params, &skew_cycles)) {
+                if (skew_ns != NULL) {
+                    *skew_ns = pump_driver_cycles_to_ns(skew_cycles);
+                }
+                return true;
+            }
+            break;
+        case POWER_REJECTED:
+            break;
+    }
+
+    pump_journal_failed(params);
+    pump_params_free(params);
+    return false;
+}
+
+bool pump_set_power(const struct power_config *config, size_t size) {
+    if (!power_set(config, size)) {
+        return false;
+    }
+
+    // A raised budget may fit queued doses
+    pump_dispatch();
+    return true;
+}
+
+bool pump_work_time(int pin, uint32_t time_ms, const struct pump_origin *origin) {
+    struct group_step step = {
+            .command = CMD_PUMP_WORK_TIME,
+            .pin = pin,
+            .time = time_ms,
+    };
+
+    if (pin < 0 || (size_t) pin >= pins_count) {
+        ESP_LOGE(TAG, "Invalid pin index %d", pin);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Pump on %i pin will work for %ums", pin, time_ms);
+    return pump_work_group(&step, 1, NULL, origin);
+}
+
+bool pump_work_volume(int pin, uint32_t volume, const struct pump_origin *origin) {
+    struct group_step step = {
+            .command = CMD_PUMP_WORK_VOLUME,
+            .pin = pin,
+            .volume = volume,
+    };
+
+    if (pin < 0 || (size_t) pin >= pins_count) {
+        ESP_LOGE(TAG, "Invalid pin index %d", pin);
+        return false;
+    }
+
+    return pump_work_group(&step, 1, NULL, origin);
+}
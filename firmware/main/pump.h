@@ -6,7 +6,7 @@
 /* FILE NAME   : pump.c
  * PURPOSE     : Pump logic handler
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 06.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -17,16 +17,48 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "../../payload.h"
+
+#define PUMP_CHANNELS_MAX 32
+
+/* Calibration curve, stored in NVS */
 struct pump_data {
-    double speed;
+    uint8_t points_count;
+    struct calibration_point points[CALIBRATION_MAX_POINTS];
 };
 
+/* Who started a dose, gets its completion events */
+struct pump_origin {
+    uint32_t client; /* Server connection, 0 is nobody */
+    uint32_t id;     /* Command ID, 0 asks for no events */
+};
+
+typedef void (*pump_listener_t)(const struct pump_origin *origin, const struct pump_event *event);
+
 bool pump_init();
 
-bool pump_callibrate(int pin, double new_speed);
+/* Called from pump tasks for every stopped channel with an origin */
+void pump_set_listener(pump_listener_t listener);
+
+bool pump_callibrate(int pin, const struct calibration_point *points, size_t count);
+
+/* Stores the current budget, queued doses that fit start right away */
+bool pump_set_power(const struct power_config *config, size_t size);
+
+/* `origin` may be NULL in all pump_work functions */
+bool pump_work_time(int pin, uint32_t time_ms, const struct pump_origin *origin);
+
+/* `volume` in 1/VOLUME_SCALE units */
+bool pump_work_volume(int pin, uint32_t volume, const struct pump_origin *origin);
 
-bool pump_work_time(int pin, uint32_t time_ms);
+/* Starts all steps with one output write, each stops after its own time.
+ * Over the power budget the group waits in a queue and true is returned.
+ * `skew_ns` receives measured start skew between channels, may be NULL */
+bool pump_work_group(const struct group_step *steps, size_t count, uint32_t *skew_ns, const struct pump_origin *origin);
 
-bool pump_work_volume(int pin, double volume);
+/* Switches `pin` or PUMP_STOP_ALL channels off, or with `after_ms` set
+ * shortens their doses to at most that much longer, and drops their
+ * queued doses. Fills `reply` with struct stop_report and results */
+bool pump_stop(uint32_t pin, uint32_t after_ms, uint8_t *reply, size_t size, size_t *reply_size);
 
 #endif /* __PUMP_H_ */
\ No newline at end of file
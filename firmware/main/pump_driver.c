@@ -0,0 +1,92 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : pump_driver.c
+ * PURPOSE     : Pump channels output driver
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#include "pump_driver.h"
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "rom/ets_sys.h"
+
+#include "board.h"
+
+static const char TAG[] = "pump_driver";
+
+#if BOARD_PROFILE == BOARD_HC595
+static const struct pump_board *board = &pump_board_hc595;
+#elif BOARD_PROFILE == BOARD_MCP23017
+static const struct pump_board *board = &pump_board_mcp23017;
+#elif BOARD_PROFILE == BOARD_SIM
+static const struct pump_board *board = &pump_board_sim;
+#else
+static const struct pump_board *board = &pump_board_gpio8;
+#endif
+
+/* Last flushed state of every channel */
+static pump_mask_t shadow = 0;
+static SemaphoreHandle_t lock = NULL;
+
+bool pump_driver_init() {
+    if (board->channels > PUMP_DRIVER_CHANNELS_MAX) {
+        ESP_LOGE(TAG, "Board %s has %u channels, at most %u supported",
+                 board->name, board->channels, PUMP_DRIVER_CHANNELS_MAX);
+        return false;
+    }
+
+    lock = xSemaphoreCreateMutex();
+    if (lock == NULL) {
+        ESP_LOGE(TAG, "Can't create driver lock");
+        return false;
+    }
+
+    if (!board->init()) {
+        ESP_LOGE(TAG, "Board %s init failed", board->name);
+        return false;
+    }
+    ESP_LOGI(TAG, "Board %s with %u channels", board->name, board->channels);
+    return true;
+}
+
+size_t pump_driver_channels() {
+    return board->channels;
+}
+
+bool pump_driver_set(pump_mask_t mask, bool on, uint32_t *skew_cycles) {
+    uint32_t skew;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    pump_mask_t state = on ? shadow | mask : shadow & ~mask;
+    bool ok = board->flush(state, mask, &skew);
+    if (ok) {
+        shadow = state;
+    }
+    xSemaphoreGive(lock);
+
+    if (skew_cycles != NULL) {
+        *skew_cycles = skew;
+    }
+    return ok;
+}
+
+bool pump_driver_refresh(pump_mask_t mask) {
+    uint32_t skew;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    bool ok = board->flush(shadow, mask, &skew);
+    xSemaphoreGive(lock);
+    return ok;
+}
+
+uint32_t pump_driver_cycles_to_ns(uint32_t cycles) {
+    return (uint32_t) ((uint64_t) cycles * 1000 / ets_get_cpu_frequency());
+}
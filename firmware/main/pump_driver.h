@@ -0,0 +1,42 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : pump_driver.h
+ * PURPOSE     : Pump channels output driver
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __PUMP_DRIVER_H_
+#define __PUMP_DRIVER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Bit N is pump channel N */
+typedef uint32_t pump_mask_t;
+
+#define PUMP_MASK(PIN) ((pump_mask_t) 1 << (PIN))
+
+#define PUMP_DRIVER_CHANNELS_MAX (sizeof(pump_mask_t) * 8)
+
+bool pump_driver_init();
+
+size_t pump_driver_channels();
+
+/* Switches every channel in `mask` in one board transfer, other channels
+ * keep their state. `skew_cycles` receives CPU cycles between the first
+ * and the last switched channel */
+bool pump_driver_set(pump_mask_t mask, bool on, uint32_t *skew_cycles);
+
+/* Writes `mask` channels again with the state they have, for timing */
+bool pump_driver_refresh(pump_mask_t mask);
+
+uint32_t pump_driver_cycles_to_ns(uint32_t cycles);
+
+#endif /* __PUMP_DRIVER_H_ */
@@ -0,0 +1,132 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : pump_state.c
+ * PURPOSE     : Live channel state table
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Sequence lock. Writers are pump code in several tasks, each update is
+ * a few stores in a critical section with `seq` odd while it runs. The
+ * server copies the table without waiting and copies again if `seq`
+ * was odd or changed, so a status never mixes two updates. */
+
+#include "pump_state.h"
+
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* Keeps the compiler from moving table accesses over `seq` */
+#define STATE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+struct channel_state {
+    uint32_t id;
+    int64_t started; /* 0 when off */
+    int64_t end;
+    uint8_t queued;
+};
+
+static volatile uint32_t seq = 0;
+static struct channel_state table[PUMP_DRIVER_CHANNELS_MAX];
+static uint8_t queued_total = 0;
+
+static void pump_state_begin(void) {
+    portENTER_CRITICAL();
+    seq++;
+    STATE_BARRIER();
+}
+
+static void pump_state_end(void) {
+    STATE_BARRIER();
+    seq++;
+    portEXIT_CRITICAL();
+}
+
+void pump_state_on(pump_mask_t mask, uint32_t id, int64_t started, int64_t end) {
+    pump_state_begin();
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            table[pin].id = id;
+            table[pin].started = started;
+            table[pin].end = end;
+        }
+    }
+    pump_state_end();
+}
+
+void pump_state_off(pump_mask_t mask) {
+    pump_state_begin();
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            table[pin].started = 0;
+        }
+    }
+    pump_state_end();
+}
+
+void pump_state_queue(pump_mask_t mask, int delta) {
+    pump_state_begin();
+    queued_total += delta;
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        if (mask & PUMP_MASK(pin)) {
+            table[pin].queued += delta;
+        }
+    }
+    pump_state_end();
+}
+
+size_t pump_state_report(uint8_t *reply, size_t size) {
+    struct channel_state copy[PUMP_DRIVER_CHANNELS_MAX];
+    uint8_t queued;
+    uint32_t before;
+
+    do {
+        before = seq;
+        STATE_BARRIER();
+        memcpy(copy, table, sizeof(copy));
+        queued = queued_total;
+        STATE_BARRIER();
+    } while ((before & 1) || seq != before);
+
+    int64_t now = esp_timer_get_time();
+    struct status_report *report = (struct status_report *) reply;
+    size_t offset = sizeof(*report);
+    if (size < offset) {
+        return 0;
+    }
+    memset(report, 0, sizeof(*report));
+    report->queued = queued;
+
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        const struct channel_state *state = &copy[pin];
+        if (state->started == 0 && state->queued == 0) {
+            continue;
+        }
+        if (size - offset < sizeof(struct channel_status)) {
+            return 0;
+        }
+
+        struct channel_status *status = (struct channel_status *) (reply + offset);
+        memset(status, 0, sizeof(*status));
+        status->pin = pin;
+        status->queued = state->queued;
+        if (state->started != 0) {
+            report->running |= PUMP_MASK(pin);
+            status->id = state->id;
+            status->elapsed = (now - state->started) / 1000;
+            status->remaining = state->end > now ? (state->end - now) / 1000 : 0;
+        }
+        report->count++;
+        offset += sizeof(*status);
+    }
+    return offset;
+}
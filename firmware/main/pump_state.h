@@ -0,0 +1,36 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : pump_state.h
+ * PURPOSE     : Live channel state table
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __PUMP_STATE_H_
+#define __PUMP_STATE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+#include "pump_driver.h"
+
+/* `end` is the esp_timer time of the planned stop */
+void pump_state_on(pump_mask_t mask, uint32_t id, int64_t started, int64_t end);
+
+void pump_state_off(pump_mask_t mask);
+
+/* Adds `delta` to queued doses of every channel in `mask` */
+void pump_state_queue(pump_mask_t mask, int delta);
+
+/* Fills `reply` with struct status_report and channel states.
+ * Returns reply size, 0 if it does not fit */
+size_t pump_state_report(uint8_t *reply, size_t size);
+
+#endif /* __PUMP_STATE_H_ */
@@ -0,0 +1,228 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : schedule.c
+ * PURPOSE     : Device-resident dosing schedule.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#include "schedule.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "heap.h"
+#include "pump.h"
+#include "pump_driver.h"
+#include "sntp.h"
+#include "storage.h"
+
+static const char TAG[] = "schedule";
+
+#define NVS_SCHEDULE_KEY "schedule"
+
+#define SCHEDULE_TICK_MS 500
+
+/* Missed steps are still run after this many seconds of delay,
+ * larger gaps (time sync jumps) are skipped */
+#define SCHEDULE_CATCH_UP 120
+
+#define SECONDS_PER_DAY (24 * 60 * 60)
+
+static struct schedule active = {0};
+static SemaphoreHandle_t active_lock = NULL;
+
+static bool schedule_validate(const struct schedule *data, size_t size) {
+    if (size < SCHEDULE_SIZE(0)) {
+        ESP_LOGE(TAG, "Schedule size (%u) is too short", size);
+        return false;
+    }
+
+    if (data->entries_count > SCHEDULE_MAX_ENTRIES || size != SCHEDULE_SIZE(data->entries_count)) {
+        ESP_LOGE(TAG, "Schedule size (%u) does not match %u entries", size, (unsigned) data->entries_count);
+        return false;
+    }
+
+    for (int i = 0; i < data->entries_count; i++) {
+        const struct schedule_entry *entry = &data->entries[i];
+
+        if (entry->minute >= 24 * 60 || entry->steps_count > SCHEDULE_MAX_STEPS) {
+            ESP_LOGE(TAG, "Invalid schedule entry %i", i);
+            return false;
+        }
+
+        for (int j = 0; j < entry->steps_count; j++) {
+            uint8_t command = entry->steps[j].command;
+            if (entry->steps[j].pin >= PUMP_CHANNELS_MAX) {
+                ESP_LOGE(TAG, "Invalid pin %u in schedule entry %i", (unsigned) entry->steps[j].pin, i);
+                return false;
+            }
+            if (command != CMD_PUMP_WORK_VOLUME && command != CMD_PUMP_WORK_TIME) {
+                ESP_LOGE(TAG, "Invalid command 0x%X in schedule entry %i", (unsigned) command, i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Steps firing in the same second start together,
+ * a pin repeated within the second gets its own start */
+static void schedule_run_group(const struct group_step *steps, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    if (!pump_work_group(steps, count, NULL, NULL)) {
+        ESP_LOGE(TAG, "Scheduled group of %u steps failed", count);
+    }
+}
+
+/* Runs every step which fires at local time `t` (seconds) */
+static void schedule_run_second(int64_t t) {
+    struct group_step group[GROUP_MAX_STEPS];
+    size_t count = 0;
+    pump_mask_t pins = 0;
+
+    for (int i = 0; i < active.entries_count; i++) {
+        const struct schedule_entry *entry = &active.entries[i];
+
+        for (int j = 0; j < entry->steps_count; j++) {
+            const struct schedule_step *step = &entry->steps[j];
+            int64_t start = t - step->delay;
+
+            if (start < 0 || start % SECONDS_PER_DAY != entry->minute * 60) {
+                continue;
+            }
+
+            // 01.01.1970 is Thursday
+            int day = (int) ((start / SECONDS_PER_DAY + 4) % 7);
+            if (!(entry->days & (1 << day))) {
+                continue;
+            }
+
+            ESP_LOGI(TAG, "Running entry %i step %i", i, j);
+            if (count == GROUP_MAX_STEPS || (pins & PUMP_MASK(step->pin))) {
+                schedule_run_group(group, count);
+                count = 0;
+                pins = 0;
+            }
+
+            group[count].command = step->command;
+            group[count].pin = step->pin;
+            group[count].volume = step->volume;
+            group[count].time = step->time;
+            count++;
+            pins |= PUMP_MASK(step->pin);
+        }
+    }
+
+    schedule_run_group(group, count);
+}
+
+static void schedule_task(void *pvParameters) {
+    int64_t last = 0;
+
+    while (1) {
+        vTaskDelay(SCHEDULE_TICK_MS / portTICK_PERIOD_MS);
+
+        if (!sntp_time_valid()) {
+            continue;
+        }
+
+        xSemaphoreTake(active_lock, portMAX_DELAY);
+
+        int64_t now = (int64_t) time(NULL) + active.utc_offset * 60;
+        if (last == 0 || now < last || now - last > SCHEDULE_CATCH_UP) {
+            last = now - 1;
+        }
+
+        for (int64_t t = last + 1; t <= now; t++) {
+            schedule_run_second(t);
+        }
+        last = now;
+
+        xSemaphoreGive(active_lock);
+    }
+}
+
+bool schedule_init() {
+    active_lock = xSemaphoreCreateMutex();
+    if (active_lock == NULL) {
+        ESP_LOGE(TAG, "Can't create schedule lock");
+        return false;
+    }
+
+    size_t size = sizeof(active);
+    if (!storage_read(NVS_SCHEDULE_KEY, &active, &size) || !schedule_validate(&active, size)) {
+        ESP_LOGW(TAG, "No stored schedule");
+        memset(&active, 0, sizeof(active));
+    } else {
+        ESP_LOGI(TAG, "Loaded schedule revision %u with %u entries",
+                 active.revision, (unsigned) active.entries_count);
+    }
+
+    TaskHandle_t task;
+    BaseType_t rc = xTaskCreate(
+            schedule_task,
+            "Schedule task",
+            2048,
+            NULL,
+            tskIDLE_PRIORITY + 2,
+            &task);
+
+    if (rc != pdPASS) {
+        ESP_LOGE(TAG, "xTaskCreate failed (%d)", rc);
+        return false;
+    }
+    heap_track_task(task);
+    return true;
+}
+
+bool schedule_set(const uint8_t *data, size_t size) {
+    const struct schedule *update = (const struct schedule *) data;
+
+    if (!schedule_validate(update, size)) {
+        return false;
+    }
+
+    // NVS blob update is atomic, old schedule stays on failure
+    if (!storage_write(NVS_SCHEDULE_KEY, data, size)) {
+        ESP_LOGE(TAG, "Can't write schedule to NVS");
+        return false;
+    }
+
+    xSemaphoreTake(active_lock, portMAX_DELAY);
+    memset(&active, 0, sizeof(active));
+    memcpy(&active, data, size);
+    xSemaphoreGive(active_lock);
+
+    ESP_LOGI(TAG, "Schedule revision %u with %u entries activated",
+             update->revision, (unsigned) update->entries_count);
+    return true;
+}
+
+size_t schedule_get(uint8_t *out, size_t size) {
+    xSemaphoreTake(active_lock, portMAX_DELAY);
+
+    size_t result = SCHEDULE_SIZE(active.entries_count);
+    if (result > size) {
+        ESP_LOGE(TAG, "Schedule does not fit into %u bytes", size);
+        result = 0;
+    } else {
+        memcpy(out, &active, result);
+    }
+
+    xSemaphoreGive(active_lock);
+    return result;
+}
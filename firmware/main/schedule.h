@@ -0,0 +1,30 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : schedule.h
+ * PURPOSE     : Device-resident dosing schedule.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+#ifndef __SCHEDULE_H_
+#define __SCHEDULE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+bool schedule_init();
+
+/* Validates, stores to NVS and activates a new schedule */
+bool schedule_set(const uint8_t *data, size_t size);
+
+/* Returns serialized schedule size, 0 on error */
+size_t schedule_get(uint8_t *out, size_t size);
+
+#endif /* __SCHEDULE_H_ */
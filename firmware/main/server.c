@@ -6,7 +6,7 @@
 /* FILE NAME   : server.c
  * PURPOSE     : Server logic module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -18,79 +18,631 @@
 
 #include "driver/gpio.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 
+#include "admission.h"
+#include "benchmark.h"
+#include "broker.h"
+#include "dedupe.h"
+#include "deferred.h"
 #include "encryption.h"
+#include "flow.h"
+#include "journal.h"
+#include "ota.h"
 #include "pump.h"
+#include "pump_state.h"
+#include "schedule.h"
 #include "secret.h"
+#include "session.h"
 #include "sockets.h"
+#include "wifi.h"
 
-SOCKET server_socket;
+SOCKET server_socket = -1;
 
 #define SERVER_PORT 30239
 
-#define BUF_SIZE 512
+#define BUF_SIZE 2048
+
+#define REPLY_SIZE 1024
+
+#define RECV_TIMEOUT_MS 2000
+
+#define ACCEPT_TIMEOUT_MS 1000
+
+/* Kept-alive client connections */
+#define SERVER_MAX_CLIENTS 4
+
+#define CLIENT_IDLE_TIMEOUT_US (30 * 1000000LL)
+
+#define ADMISSION_LOG_US (60 * 1000000LL)
 
 #define BUILTIN_LED GPIO_NUM_2
 
 static const char TAG[] = "server";
 
+struct client {
+    SOCKET socket;
+    IP ip;
+    int64_t last_seen;
+    uint32_t generation; /* Tells events of a reused slot apart */
+    uint32_t adopted;    /* Closed connection whose events come here */
+    uint32_t pending;    /* Started channels not reported yet */
+};
+
+static struct client clients[SERVER_MAX_CLIENTS];
+
+/* Origin of packets that came over MQTT, never a connection generation */
+#define BROKER_ORIGIN 0xFFFFFFFF
+
+/* One pseudo connection for all MQTT packets, they share the admission
+ * budget of source 0 */
+static struct client broker_client = {.socket = -1, .generation = BROKER_ORIGIN};
+
+static uint32_t generation = 0;
+
+/* Pump tasks send events, sockets change under it */
+static SemaphoreHandle_t send_lock = NULL;
+
+/* Server and MQTT client tasks run packets in turn */
+static SemaphoreHandle_t serve_lock = NULL;
+
+/* Boot to first accepted command, 0 until then */
+static int64_t first_command_us = 0;
+
+/* Wi-Fi recoveries the listener was opened after */
+static uint32_t recoveries_seen = 0;
+static uint32_t address_changes_seen = 0;
+
+static void server_notify(const struct pump_origin *origin, const struct pump_event *event);
+
+static void server_run_deferred(const struct payload *packet, const byte *body, uint32_t origin);
+
+static size_t server_broker_packet(const byte *packet, size_t size, byte *frame, size_t frame_size);
+
 bool server_init() {
+    if (send_lock == NULL) {
+        send_lock = xSemaphoreCreateMutex();
+        serve_lock = xSemaphoreCreateMutex();
+        pump_set_listener(server_notify);
+        deferred_set_handler(server_run_deferred);
+        deferred_set_listener(server_notify);
+        broker_set_handler(server_broker_packet);
+        for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+            clients[i].socket = -1;
+        }
+    }
+
+    struct wifi_stats stats;
+    wifi_get_stats(&stats);
+    recoveries_seen = stats.recoveries;
+    address_changes_seen = stats.address_changes;
+
     server_socket = socket_tcp(SERVER_PORT);
     if (server_socket < 0) {
         return false;
     }
     ESP_LOGI(TAG, "Opened server socket %i", server_socket);
+
+    // Reaching here is what makes an updated image good
+    ota_confirm();
+    return true;
+}
+
+static bool server_execute(const struct payload *data, const byte *body, byte *reply, size_t *reply_size,
+                           struct client *client);
+
+/* Runs CMD_BATCH items, one status byte per item in reply */
+static bool server_execute_batch(const byte *body, size_t size, byte *reply, size_t *reply_size,
+                                 struct client *client, uint32_t id) {
+    size_t offset = 0;
+    size_t count = 0;
+    bool ok = true;
+
+    while (offset < size) {
+        const struct batch_item *item = (const struct batch_item *) (body + offset);
+        if (size - offset < sizeof(*item) || size - offset - sizeof(*item) < item->size) {
+            ESP_LOGE(TAG, "Batch item %u is truncated", count);
+            return false;
+        }
+        if (item->command == CMD_BATCH || item->command == CMD_SCHEDULE_GET || item->command == CMD_HISTORY ||
+            item->command == CMD_SESSION_OPEN || item->command == CMD_OTA || item->command == CMD_STATUS ||
+            item->command == CMD_PUMP_STOP || item->command == CMD_BENCHMARK || count == BATCH_MAX_ITEMS) {
+            ESP_LOGE(TAG, "Invalid batch item %u", count);
+            return false;
+        }
+        offset += sizeof(*item) + item->size;
+        count++;
+    }
+
+    offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct batch_item *item = (const struct batch_item *) (body + offset);
+        struct payload data = {
+                .version = PAYLOAD_VERSION,
+                .id = id,
+                .command = item->command,
+                .pin = item->pin,
+                .volume = item->volume,
+                .time = item->time,
+                .size = item->size,
+        };
+        size_t unused;
+
+        bool item_ok = server_execute(&data, body + offset + sizeof(*item), reply + count, &unused, client);
+        reply[i] = item_ok ? STATUS_OK : STATUS_FAILED;
+        ok = ok && item_ok;
+        offset += sizeof(*item) + item->size;
+    }
+
+    *reply_size = count;
+    return ok;
+}
+
+/* Counts channels the client waits events for */
+static bool server_started(struct client *client, const struct payload *data, bool ok, size_t channels) {
+    if (ok && data->id != 0) {
+        xSemaphoreTake(send_lock, portMAX_DELAY);
+        client->pending += channels;
+        xSemaphoreGive(send_lock);
+    }
+    return ok;
+}
+
+/* Pump doses and stops can be held for execute_at, nothing else. Held
+ * doses count as pending, the connection waits for their events */
+static bool server_defer(const struct payload *data, const byte *body, struct client *client) {
+    switch (data->command) {
+        case CMD_PUMP_WORK_VOLUME:
+        case CMD_PUMP_WORK_TIME:
+            return server_started(client, data, deferred_add(data, body, client->generation), 1);
+        case CMD_PUMP_STOP:
+            return deferred_add(data, body, client->generation);
+        case CMD_PUMP_WORK_GROUP:
+            if (data->size == 0 || data->size % sizeof(struct group_step) != 0) {
+                ESP_LOGE(TAG, "Invalid group data size %u", (unsigned) data->size);
+                return false;
+            }
+            return server_started(client, data, deferred_add(data, body, client->generation),
+                                  data->size / sizeof(struct group_step));
+    }
+    ESP_LOGE(TAG, "Command 0x%X can't be held", (unsigned) data->command);
+    return false;
+}
+
+/* Stops channels and drops their held doses, for direct and held stops */
+static bool server_stop(const struct payload *data, byte *reply, size_t size, size_t *reply_size) {
+    if (!pump_stop(data->pin, data->time, reply, size, reply_size)) {
+        return false;
+    }
+    ((struct stop_report *) reply)->cancelled += deferred_cancel(data->pin);
     return true;
 }
 
-static bool server_execute(const struct payload *data) {
+/* Deferred task handler. Events go to the connection that sent the
+ * command if it is still open */
+static void server_run_deferred(const struct payload *packet, const byte *body, uint32_t origin_client) {
+    // Only the deferred task uses it
+    static byte reply[REPLY_SIZE];
+    struct pump_origin origin = {origin_client, packet->id};
+    size_t channels = 1, reply_size;
+    bool ok = false;
+
+    switch (packet->command) {
+        case CMD_PUMP_WORK_VOLUME:
+            ok = pump_work_volume(packet->pin, packet->volume, &origin);
+            break;
+        case CMD_PUMP_WORK_TIME:
+            ok = pump_work_time(packet->pin, packet->time, &origin);
+            break;
+        case CMD_PUMP_WORK_GROUP:
+            channels = packet->size / sizeof(struct group_step);
+            ok = pump_work_group((const struct group_step *) body, channels, NULL, &origin);
+            break;
+        case CMD_PUMP_STOP:
+            channels = 0;
+            ok = server_stop(packet, reply, sizeof(reply), &reply_size);
+            break;
+    }
+    if (ok || packet->id == 0 || channels == 0) {
+        return;
+    }
+
+    // No events will come for a dose that did not start
+    ESP_LOGE(TAG, "Held command 0x%X failed", (unsigned) packet->command);
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].socket >= 0 && clients[i].generation == origin_client) {
+            clients[i].pending = clients[i].pending > channels ? clients[i].pending - channels : 0;
+        }
+    }
+    xSemaphoreGive(send_lock);
+}
+
+static bool server_execute(const struct payload *data, const byte *body, byte *reply, size_t *reply_size,
+                           struct client *client) {
+    struct pump_origin origin = {client->generation, data->id};
+    *reply_size = 0;
+
+    if (data->execute_at != 0) {
+        return server_defer(data, body, client);
+    }
+
     switch (data->command) {
         case CMD_PUMP_WORK_VOLUME:
-            return pump_work_volume(data->pin, data->volume);
+            return server_started(client, data, pump_work_volume(data->pin, data->volume, &origin), 1);
         case CMD_PUMP_WORK_TIME:
-            return pump_work_time(data->pin, data->time);
+            return server_started(client, data, pump_work_time(data->pin, data->time, &origin), 1);
         case CMD_PUMP_CALLIBRATE:
-            return pump_callibrate(data->pin, data->volume);
+            if (data->size % sizeof(struct calibration_point) != 0) {
+                ESP_LOGE(TAG, "Invalid calibration data size %u", (unsigned) data->size);
+                return false;
+            }
+            return pump_callibrate(data->pin, (const struct calibration_point *) body,
+                                   data->size / sizeof(struct calibration_point));
+        case CMD_STATUS:
+            *reply_size = pump_state_report(reply, REPLY_SIZE);
+            return *reply_size != 0;
+        case CMD_PUMP_STOP:
+            return server_stop(data, reply, REPLY_SIZE, reply_size);
+        case CMD_BENCHMARK:
+            *reply_size = benchmark_run(body, data->size, data->time, data->pin, reply, REPLY_SIZE);
+            return *reply_size != 0;
+        case CMD_FLOW_SET:
+            return flow_set(data->pin, (const struct flow_config *) body, data->size);
+        case CMD_POWER_SET:
+            return pump_set_power((const struct power_config *) body, data->size);
+        case CMD_SCHEDULE_SET:
+            return schedule_set(body, data->size);
+        case CMD_SCHEDULE_GET:
+            *reply_size = schedule_get(reply, REPLY_SIZE);
+            return *reply_size != 0;
+        case CMD_BATCH:
+            return server_execute_batch(body, data->size, reply, reply_size, client, data->id);
+        case CMD_PUMP_WORK_GROUP: {
+            struct group_result *result = (struct group_result *) reply;
+            if (data->size % sizeof(struct group_step) != 0) {
+                ESP_LOGE(TAG, "Invalid group data size %u", (unsigned) data->size);
+                return false;
+            }
+            size_t count = data->size / sizeof(struct group_step);
+            *reply_size = sizeof(*result);
+            return server_started(client, data,
+                                  pump_work_group((const struct group_step *) body, count, &result->skew_ns, &origin),
+                                  count);
+        }
+        case CMD_SESSION_OPEN:
+            // A session can not extend itself
+            if (data->auth != AUTH_RSA) {
+                ESP_LOGE(TAG, "Session open requires a signed packet");
+                return false;
+            }
+            *reply_size = session_open(reply, REPLY_SIZE);
+            return *reply_size != 0;
+        case CMD_HISTORY:
+            if (data->size != sizeof(struct history_request)) {
+                ESP_LOGE(TAG, "Invalid history request size %u", (unsigned) data->size);
+                return false;
+            }
+            *reply_size = journal_query((const struct history_request *) body, reply, REPLY_SIZE);
+            return *reply_size != 0;
+        case CMD_OTA:
+            if (data->size <= sizeof(struct ota_request)) {
+                ESP_LOGE(TAG, "Invalid update data size %u", (unsigned) data->size);
+                return false;
+            }
+            return ota_start((const struct ota_request *) body, (const char *) body + sizeof(struct ota_request),
+                             data->size - sizeof(struct ota_request));
     }
     ESP_LOGE(TAG, "Unknown command 0x%X", (unsigned) data->command);
     return false;
 }
 
-bool server_response() {
-    static byte buf[BUF_SIZE] = {0};
-    int size = BUF_SIZE;
+/* Receives header, command data and signature or session tag */
+static bool server_receive(SOCKET c, byte *buf, int *size) {
+    int received = 0;
+    int expected = sizeof(struct payload);
+    bool header = false;
 
-    if (!socket_has_data(server_socket)) {
-        return true;
+    while (received < expected) {
+        int len = expected - received;
+        if (!socket_recv(c, (char *) buf + received, &len) || len == 0) {
+            if (received != 0) {
+                ESP_LOGE(TAG, "Recv error after %i of %i bytes", received, expected);
+            }
+            return false;
+        }
+        received += len;
+
+        if (!header && received >= expected) {
+            header = true;
+            size_t trailer_size = encryption_trailer_size((const struct payload *) buf);
+            if (trailer_size == 0) {
+                ESP_LOGE(TAG, "Unknown packet authentication");
+                return false;
+            }
+            expected += ((const struct payload *) buf)->size + trailer_size;
+            if (expected > BUF_SIZE) {
+                ESP_LOGE(TAG, "Packet size %i exceeds buffer", expected);
+                return false;
+            }
+        }
     }
 
-    SOCKET c = socket_accept(server_socket, NULL);
+    *size = received;
+    return true;
+}
 
+static void server_reply(SOCKET c, byte status, byte *reply, size_t size) {
+    struct response *header = (struct response *) reply;
 
-    if (!socket_has_data(c)) {
-        ESP_LOGI(TAG, "No data");
-        socket_close(c);
-        return false;
+    header->status = status;
+    header->size = size;
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    socket_send(c, (const char *) reply, sizeof(*header) + size);
+    xSemaphoreGive(send_lock);
+}
+
+/* Pump listener, pushes the event to the connection that started the dose.
+ * Events of closed connections are dropped, the journal still has them */
+static void server_notify(const struct pump_origin *origin, const struct pump_event *event) {
+    byte frame[sizeof(struct response) + sizeof(struct pump_event)];
+    struct response *header = (struct response *) frame;
+
+    header->status = STATUS_EVENT;
+    header->size = sizeof(*event);
+    memcpy(frame + sizeof(*header), event, sizeof(*event));
+
+    if (origin->client == BROKER_ORIGIN || (broker_client.adopted != 0 && broker_client.adopted == origin->client)) {
+        broker_publish_event(event);
+        return;
     }
 
-    if (!socket_recv(c, (char *) buf, &size)) {
-        ESP_LOGI(TAG, "Recv error");
-        return false;
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        struct client *client = &clients[i];
+        if (client->socket < 0 || (client->generation != origin->client && client->adopted != origin->client)) {
+            continue;
+        }
+        if (!socket_send(client->socket, (const char *) frame, sizeof(frame))) {
+            ESP_LOGW(TAG, "Event %u for pin %u not sent", event->id, (unsigned) event->pin);
+        }
+        if (client->pending > 0) {
+            client->pending--;
+        }
+        break;
     }
+    xSemaphoreGive(send_lock);
+}
 
-    ESP_LOGI(TAG, "Recv %i bytes", size);
+/* A retry on a new connection takes over the events of the first run,
+ * unless the connection that sent it is still open */
+static void server_adopt(struct client *client, uint32_t origin) {
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    bool open = false;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        open = open || (clients[i].socket >= 0 && clients[i].generation == origin);
+    }
+    if (!open) {
+        client->adopted = origin;
+    }
+    xSemaphoreGive(send_lock);
+}
 
+/* Admits, verifies and runs one packet, the response data goes to `reply`.
+ * False if the sender is to be cut off. Call under serve_lock */
+static bool server_handle(struct client *client, const byte *buf, int size, byte *reply, byte *status,
+                          size_t *reply_size) {
     struct payload packet;
+    *reply_size = 0;
+
+    // Cheap header checks first, crypto only for admitted packets
+    enum admission admission = admission_check(client->ip, buf, size);
+    if (admission == ADMISSION_LIMITED) {
+        *status = STATUS_BUSY;
+        return true;
+    }
+    if (admission != ADMISSION_ACCEPTED) {
+        *status = STATUS_DENIED;
+        return false;
+    }
 
+    int64_t verify_start = esp_timer_get_time();
     if (!encryption_extract(buf, size, &packet)) {
         ESP_LOGE(TAG, "Failed to verify payload");
-        socket_send(c, "\xFF", 1);
+        *status = STATUS_DENIED;
+        return false;
+    }
+    if (packet.auth != AUTH_SESSION) {
+        admission_verified(esp_timer_get_time() - verify_start);
+    }
+
+    ESP_LOGI(TAG, "Payload command: 0x%X pin:%u volume:%u time:%u", (unsigned) packet.command, packet.pin, packet.volume, packet.time);
+
+    if (first_command_us == 0) {
+        first_command_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "First command accepted %ums after boot", (unsigned) (first_command_us / 1000));
+    }
+
+    const byte *body = buf + sizeof(struct payload);
+    const struct dedupe_entry *repeated = dedupe_find(&packet, body);
+    if (repeated != NULL) {
+        server_adopt(client, repeated->origin);
+        memcpy(reply, repeated->reply, repeated->size);
+        *reply_size = repeated->size;
+        *status = repeated->status;
+        return true;
+    }
+
+    bool ok = server_execute(&packet, body, reply, reply_size, client);
+    *status = ok ? STATUS_OK : STATUS_FAILED;
+
+    dedupe_store(&packet, body, client->generation, *status, reply, *reply_size);
+    return true;
+}
+
+/* Serves one packet, false closes the connection */
+static bool server_serve(struct client *client) {
+    SOCKET c = client->socket;
+    static byte buf[BUF_SIZE] = {0};
+    static byte reply[sizeof(struct response) + REPLY_SIZE] = {0};
+    int size = BUF_SIZE;
+
+    if (!server_receive(c, buf, &size)) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Recv %i bytes", size);
+
+    byte status;
+    size_t reply_size;
+    xSemaphoreTake(serve_lock, portMAX_DELAY);
+    bool keep = server_handle(client, buf, size, reply + sizeof(struct response), &status, &reply_size);
+    xSemaphoreGive(serve_lock);
+
+    server_reply(c, status, reply, reply_size);
+    return keep;
+}
+
+/* Broker handler, runs in the MQTT client task */
+static size_t server_broker_packet(const byte *packet, size_t size, byte *frame, size_t frame_size) {
+    struct response *header = (struct response *) frame;
+    byte status;
+    size_t reply_size;
+
+    if (size > BUF_SIZE || frame_size < sizeof(*header) + REPLY_SIZE) {
+        ESP_LOGE(TAG, "Packet size %u exceeds buffer", (unsigned) size);
+        return 0;
+    }
+
+    ESP_LOGI(TAG, "MQTT %u bytes", (unsigned) size);
+    xSemaphoreTake(serve_lock, portMAX_DELAY);
+    server_handle(&broker_client, packet, size, frame + sizeof(*header), &status, &reply_size);
+    xSemaphoreGive(serve_lock);
+
+    header->status = status;
+    header->size = reply_size;
+    return sizeof(*header) + reply_size;
+}
+
+static void server_drop(struct client *client) {
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    socket_close(client->socket);
+    client->socket = -1;
+    xSemaphoreGive(send_lock);
+}
+
+static void server_accept(void) {
+    IP ip;
+    SOCKET c = socket_accept(server_socket, &ip);
+    if (c < 0) {
+        return;
+    }
+    socket_set_timeout(c, RECV_TIMEOUT_MS);
+
+    // Full table evicts the longest idle connection
+    struct client *slot = &clients[0];
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].socket < 0) {
+            slot = &clients[i];
+            break;
+        }
+        if (clients[i].last_seen < slot->last_seen) {
+            slot = &clients[i];
+        }
+    }
+    if (slot->socket >= 0) {
+        server_drop(slot);
+    }
+
+    xSemaphoreTake(send_lock, portMAX_DELAY);
+    slot->socket = c;
+    slot->ip = ip;
+    slot->last_seen = esp_timer_get_time();
+    // 0 is no connection in pump origins, BROKER_ORIGIN is MQTT
+    if (++generation == 0 || generation == BROKER_ORIGIN) {
+        generation = 1;
+    }
+    slot->generation = generation;
+    slot->adopted = 0;
+    slot->pending = 0;
+    xSemaphoreGive(send_lock);
+}
+
+int64_t server_first_command_time() {
+    return first_command_us;
+}
+
+/* Link came back after an outage, the listener is opened again. Connections
+ * only go with a new address, on the old one they may still be alive */
+static void server_rearm(void) {
+    struct wifi_stats stats;
+    wifi_get_stats(&stats);
+    if (stats.recoveries == recoveries_seen) {
+        return;
+    }
+
+    bool address_changed = stats.address_changes != address_changes_seen;
+    ESP_LOGI(TAG, "Link recovered, re-arming server socket%s", address_changed ? " and dropping connections" : "");
+    for (int i = 0; address_changed && i < SERVER_MAX_CLIENTS; i++) {
+        if (clients[i].socket >= 0) {
+            server_drop(&clients[i]);
+        }
+    }
+    if (server_socket >= 0) {
+        socket_close(server_socket);
+        server_socket = -1;
+    }
+    // A failed open is retried on the next call
+    server_init();
+}
+
+bool server_response() {
+    SOCKET sockets[SERVER_MAX_CLIENTS + 1];
+    bool ready[SERVER_MAX_CLIENTS + 1];
+
+    server_rearm();
+    if (server_socket < 0 && !server_init()) {
+        vTaskDelay(ACCEPT_TIMEOUT_MS / portTICK_PERIOD_MS);
         return false;
     }
 
-    ESP_LOGI(TAG, "Payload command: 0x%X pin:%u volume:%f time:%u", (unsigned) packet.command, packet.pin, packet.volume, packet.time);
-    socket_send(c, "\0", 1);
-    return server_execute(&packet);
+    sockets[0] = server_socket;
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        sockets[i + 1] = clients[i].socket;
+    }
+
+    if (!socket_wait_any(sockets, SERVER_MAX_CLIENTS + 1, ready, ACCEPT_TIMEOUT_MS)) {
+        return true;
+    }
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        struct client *client = &clients[i];
+        if (client->socket < 0) {
+            continue;
+        }
+
+        if (ready[i + 1]) {
+            client->last_seen = now;
+            if (!server_serve(client)) {
+                server_drop(client);
+            }
+        } else if (now - client->last_seen > CLIENT_IDLE_TIMEOUT_US && client->pending == 0) {
+            server_drop(client);
+        }
+    }
+
+    if (ready[0]) {
+        server_accept();
+    }
+
+    static int64_t admission_logged = 0;
+    if (now - admission_logged > ADMISSION_LOG_US) {
+        admission_logged = now;
+        admission_log();
+    }
+    return true;
 }
@@ -6,7 +6,7 @@
 /* FILE NAME   : server.h
  * PURPOSE     : Server logic module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -16,9 +16,14 @@
 #define __SERVER_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 bool server_init();
 
+/* Waits for one connection up to a second and serves it */
 bool server_response();
 
+/* Microseconds from boot to the first accepted command, 0 if none */
+int64_t server_first_command_time();
+
 #endif /* __SERVER_H_ */
\ No newline at end of file
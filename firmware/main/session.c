@@ -0,0 +1,152 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : session.c
+ * PURPOSE     : Session keys module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* A controller opens a session with one RSA signed CMD_SESSION_OPEN and
+ * gets a random key encrypted with its public key. Later packets carry
+ * HMAC-SHA256 of that key instead of the RSA signature. Sessions live in
+ * RAM only, a reboot makes the client open a new one. */
+
+#include "session.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <wolfssl/wolfcrypt/hmac.h>
+
+#include "encryption.h"
+
+#define SESSION_MAX 8
+
+#define SESSION_LIFETIME_S 600
+
+static const char TAG[] = "session";
+
+struct session {
+    uint32_t id;
+    uint32_t counter;
+    int64_t expires;
+    byte key[SESSION_KEY_SIZE];
+};
+
+static struct session sessions[SESSION_MAX];
+
+static struct session *session_find(uint32_t id) {
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < SESSION_MAX; i++) {
+        if (sessions[i].id == id && sessions[i].expires > now) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+size_t session_open(byte *reply, size_t size) {
+    struct session_open *result = (struct session_open *) reply;
+    size_t key_size = encryption_signature_size();
+    if (key_size == 0 || size < sizeof(*result) + key_size) {
+        ESP_LOGE(TAG, "No room for the session key");
+        return 0;
+    }
+
+    // Expired slot or the one closest to expiry
+    int64_t now = esp_timer_get_time();
+    struct session *slot = &sessions[0];
+    for (int i = 0; i < SESSION_MAX; i++) {
+        if (sessions[i].expires <= now) {
+            slot = &sessions[i];
+            break;
+        }
+        if (sessions[i].expires < slot->expires) {
+            slot = &sessions[i];
+        }
+    }
+
+    uint32_t id;
+    do {
+        id = esp_random();
+    } while (id == 0 || session_find(id) != NULL);
+
+    memset(slot, 0, sizeof(*slot));
+    esp_fill_random(slot->key, SESSION_KEY_SIZE);
+    if (!encryption_encrypt(slot->key, SESSION_KEY_SIZE, reply + sizeof(*result))) {
+        memset(slot, 0, sizeof(*slot));
+        return 0;
+    }
+    slot->id = id;
+    slot->expires = now + SESSION_LIFETIME_S * 1000000LL;
+
+    result->session = id;
+    result->lifetime = SESSION_LIFETIME_S;
+    ESP_LOGI(TAG, "Opened session 0x%08X", id);
+    return sizeof(*result) + key_size;
+}
+
+/* Live session whose counter is below the tag one */
+static struct session *session_check(const struct session_tag *tag) {
+    struct session *session = session_find(tag->session);
+    if (session == NULL) {
+        ESP_LOGE(TAG, "Unknown or expired session 0x%08X", tag->session);
+        return NULL;
+    }
+
+    if (tag->counter <= session->counter) {
+        ESP_LOGE(TAG, "Session counter %u is not above %u", tag->counter, session->counter);
+        return NULL;
+    }
+    return session;
+}
+
+bool session_admit(const struct session_tag *tag) {
+    return session_check(tag) != NULL;
+}
+
+bool session_verify(const byte *data, size_t signed_size, const struct session_tag *tag) {
+    struct session *session = session_check(tag);
+    if (session == NULL) {
+        return false;
+    }
+
+    Hmac hmac;
+    byte mac[WC_SHA256_DIGEST_SIZE];
+    int ret = wc_HmacSetKey(&hmac, WC_SHA256, session->key, SESSION_KEY_SIZE);
+    if (ret == 0) {
+        ret = wc_HmacUpdate(&hmac, data, signed_size);
+    }
+    if (ret == 0) {
+        ret = wc_HmacUpdate(&hmac, (const byte *) tag, offsetof(struct session_tag, mac));
+    }
+    if (ret == 0) {
+        ret = wc_HmacFinal(&hmac, mac);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "HMAC failed, error %d", ret);
+        return false;
+    }
+
+    // Constant time compare
+    byte diff = 0;
+    for (int i = 0; i < SESSION_MAC_SIZE; i++) {
+        diff |= mac[i] ^ tag->mac[i];
+    }
+    if (diff != 0) {
+        ESP_LOGE(TAG, "Session MAC mismatch");
+        return false;
+    }
+
+    session->counter = tag->counter;
+    return true;
+}
@@ -0,0 +1,37 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : session.h
+ * PURPOSE     : Session keys module.
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SESSION_H_
+#define __SESSION_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../../payload.h"
+
+#include <wolfssl/wolfcrypt/types.h>
+
+/* Creates a session, writes struct session_open and the encrypted key
+ * to `reply`. Returns reply size, 0 on failure */
+size_t session_open(byte *reply, size_t size);
+
+/* Session exists and counter was not used, no MAC check */
+bool session_admit(const struct session_tag *tag);
+
+/* Checks `tag` of the first `signed_size` bytes of `data`
+ * and moves the session counter */
+bool session_verify(const byte *data, size_t signed_size, const struct session_tag *tag);
+
+#endif /* __SESSION_H_ */
@@ -6,24 +6,107 @@
 /* FILE NAME   : sntp.c
  * PURPOSE     : Time sync module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
  */
 #include "sntp.h"
 
+#include <stdbool.h>
+#include <sys/time.h>
 #include <time.h>
 
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
 
 static const char TAG[] = "sntp";
 
+#define RTC_TIME_MAGIC 0x54696D65
+
+#define RTC_TIME_SAVE_PERIOD_US 1000000
+
+/* Last known time, survives resets but not power loss */
+struct rtc_time {
+    uint32_t magic;
+    uint64_t time;
+    uint32_t check;
+};
+
+static RTC_DATA_ATTR struct rtc_time rtc_time;
+
+static volatile bool time_valid = false;
+
+static esp_timer_handle_t save_timer = NULL;
+
+uint64_t sntp_now(void) {
+    struct timeval now_tv;
+    gettimeofday(&now_tv, NULL);
+    return (uint64_t) now_tv.tv_sec * 1000000ULL + (uint64_t) now_tv.tv_usec;
+}
+
+static uint32_t sntp_rtc_check(uint64_t time) {
+    return RTC_TIME_MAGIC ^ (uint32_t) time ^ (uint32_t) (time >> 32);
+}
+
+static void sntp_save(void *arg) {
+    uint64_t now = sntp_now();
+
+    rtc_time.magic = 0;
+    rtc_time.time = now;
+    rtc_time.check = sntp_rtc_check(now);
+    rtc_time.magic = RTC_TIME_MAGIC;
+}
+
+static void sntp_start_saving(void) {
+    if (save_timer != NULL) {
+        return;
+    }
+
+    const esp_timer_create_args_t args = {
+            .callback = sntp_save,
+            .name = "rtc time",
+    };
+    if (esp_timer_create(&args, &save_timer) != ESP_OK ||
+        esp_timer_start_periodic(save_timer, RTC_TIME_SAVE_PERIOD_US) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't start RTC time saving");
+    }
+}
+
 static void sntp_notification(struct timeval *tv) {
     time_t now = 0;
     time(&now);
-    ESP_LOGI(TAG, "Time synchronized %li", now);
+    time_valid = true;
+    sntp_save(NULL);
+    sntp_start_saving();
+    ESP_LOGI(TAG, "Time synchronized %li in %ums", now, (unsigned) (esp_timer_get_time() / 1000));
+}
+
+bool sntp_restore(void) {
+    if (rtc_time.magic != RTC_TIME_MAGIC || rtc_time.check != sntp_rtc_check(rtc_time.time)) {
+        ESP_LOGI(TAG, "No cached time");
+        return false;
+    }
+
+    // Time since the last save before reset is unknown, only boot time is added
+    uint64_t restored = rtc_time.time + (uint64_t) esp_timer_get_time();
+    struct timeval tv = {
+            .tv_sec = restored / 1000000ULL,
+            .tv_usec = restored % 1000000ULL,
+    };
+    settimeofday(&tv, NULL);
+
+    time_valid = true;
+    sntp_start_saving();
+    ESP_LOGI(TAG, "Time restored from RTC memory %li", (long) tv.tv_sec);
+    return true;
+}
+
+/* True after SNTP sync or restore from RTC memory */
+bool sntp_time_valid(void) {
+    return time_valid;
 }
 
 void sntp_run(void) {
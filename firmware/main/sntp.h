@@ -6,7 +6,7 @@
 /* FILE NAME   : sntp.h
  * PURPOSE     : Time sync module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -14,6 +14,17 @@
 #ifndef __SNTP_H_
 #define __SNTP_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void sntp_run(void);
 
+/* Restores time cached in RTC memory before reset */
+bool sntp_restore(void);
+
+bool sntp_time_valid(void);
+
+/* Unix time in microseconds */
+uint64_t sntp_now(void);
+
 #endif /* __SNTP_H_ */
\ No newline at end of file
@@ -6,7 +6,7 @@
 /* FILE NAME   : sockets.c
  * PURPOSE     : UNIX sockets module
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -22,8 +22,15 @@
 static const char TAG[] = "sockets";
 
 bool socket_has_data(SOCKET sock) {
+    return socket_wait_data(sock, 0);
+}
+
+bool socket_wait_data(SOCKET sock, int timeout_ms) {
     fd_set set;
-    struct timeval time = {0};
+    struct timeval time = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+    };
 
     FD_ZERO(&set);
     FD_SET(sock, &set);
@@ -35,6 +42,34 @@ bool socket_has_data(SOCKET sock) {
     return val > 0;
 }
 
+bool socket_wait_any(const SOCKET *sockets, int count, bool *ready, int timeout_ms) {
+    fd_set set;
+    SOCKET max = -1;
+    struct timeval time = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    FD_ZERO(&set);
+    for (int i = 0; i < count; i++) {
+        if (sockets[i] >= 0) {
+            FD_SET(sockets[i], &set);
+            max = sockets[i] > max ? sockets[i] : max;
+        }
+    }
+
+    int val = select(max + 1, &set, NULL, NULL, &time);
+    if (val < 0) {
+        ESP_LOGE(TAG, "select() error: %i", errno);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        ready[i] = sockets[i] >= 0 && FD_ISSET(sockets[i], &set);
+    }
+    return val > 0;
+}
+
 bool socket_recvfrom(SOCKET s, char *buf, int *len, IP *ip) {
     struct sockaddr_in addr = {0};
     socklen_t addr_len = sizeof(addr);
@@ -111,6 +146,20 @@ SOCKET socket_accept(SOCKET s, IP *ip) {
     return c;
 }
 
+bool socket_set_timeout(SOCKET s, int timeout_ms) {
+    struct timeval time = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof(time)) < 0 ||
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &time, sizeof(time)) < 0) {
+        ESP_LOGE(TAG, "setsockopt() error: %i", errno);
+        return false;
+    }
+    return true;
+}
+
 bool socket_recv(SOCKET s, char *buf, int *len) {
     *len = recv(s, buf, *len, 0);
     if (*len < 0) {
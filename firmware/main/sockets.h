@@ -6,7 +6,7 @@
 /* FILE NAME   : sockets.c
  * PURPOSE     : UNIX sockets module
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -34,6 +34,13 @@ SOCKET socket_accept(SOCKET s, IP *ip);
 
 bool socket_has_data(SOCKET s);
 
+bool socket_wait_data(SOCKET s, int timeout_ms);
+
+/* Marks readable sockets in `ready`, negative sockets are skipped */
+bool socket_wait_any(const SOCKET *sockets, int count, bool *ready, int timeout_ms);
+
+bool socket_set_timeout(SOCKET s, int timeout_ms);
+
 bool socket_recv(SOCKET s, char *buf, int *len);
 
 bool socket_recvfrom(SOCKET s, char *buf, int *len, IP *ip);
@@ -6,24 +6,83 @@
 /* FILE NAME   : storage.c
  * PURPOSE     : NVS storage handle
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 06.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
  */
 
+/* nvs_open allocates a handle entry and writes may allocate pages, so
+ * after storage_init every access runs in the storage task, which heap
+ * tracking leaves alone, and the caller waits for it. Request paths that
+ * still reach NVS this way: CMD_PUMP_CALLIBRATE and curves learned by
+ * sensor doses, CMD_FLOW_SET, CMD_POWER_SET, CMD_SCHEDULE_SET, CMD_OTA
+ * state and CMD_BENCHMARK. Doses read curves loaded by pump_init. */
+
 #include "storage.h"
 
 #include <string.h>
 
 #include "esp_err.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
 static const char *TAG = "storage";
 #define NVS_NAMESPACE "storage"// Namespace in NVS; must match across functions
 
+#define STORAGE_TASK_STACK 3072
+
+struct storage_request {
+    const char *key;
+    const void *data;  /* Written blob */
+    void *out_data;    /* Read buffer, NULL for writes */
+    size_t size;
+    size_t *inout_size;
+    bool result;
+};
+
+/* One request at a time, the caller waits for request_done */
+static struct storage_request request;
+static SemaphoreHandle_t request_lock = NULL;
+static SemaphoreHandle_t request_done = NULL;
+static TaskHandle_t task = NULL;
+
+static bool storage_nvs_write(const char *key, const void *data, size_t size);
+static bool storage_nvs_read(const char *key, void *out_data, size_t *inout_size);
+
+static bool storage_do(const struct storage_request *value) {
+    return value->out_data == NULL ? storage_nvs_write(value->key, value->data, value->size)
+                                   : storage_nvs_read(value->key, value->out_data, value->inout_size);
+}
+
+static void storage_task(void *pvParameters) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        request.result = storage_do(&request);
+        xSemaphoreGive(request_done);
+    }
+}
+
+/* Hands `value` to the storage task and waits for its result */
+static bool storage_run(const struct storage_request *value) {
+    // Without the task the caller uses NVS itself
+    if (task == NULL) {
+        return storage_do(value);
+    }
+
+    xSemaphoreTake(request_lock, portMAX_DELAY);
+    request = *value;
+    xTaskNotifyGive(task);
+    xSemaphoreTake(request_done, portMAX_DELAY);
+    bool result = request.result;
+    xSemaphoreGive(request_lock);
+    return result;
+}
+
 /**
  * @brief  Initialize NVS. Must be called once at startup before any NVS operations.
  */
@@ -36,6 +95,24 @@ void storage_init() {
     }
     ESP_ERROR_CHECK(err);
     ESP_LOGI(TAG, "NVS initialized");
+
+    request_lock = xSemaphoreCreateMutex();
+    request_done = xSemaphoreCreateBinary();
+    if (request_lock == NULL || request_done == NULL ||
+        xTaskCreate(storage_task, "Storage task", STORAGE_TASK_STACK, NULL, tskIDLE_PRIORITY + 3, &task) != pdPASS) {
+        ESP_LOGE(TAG, "Can't start storage task, NVS is used from the calling tasks");
+        task = NULL;
+    }
+}
+
+bool storage_write(const char *key, const void *data, size_t size) {
+    const struct storage_request value = {.key = key, .data = data, .size = size};
+    return storage_run(&value);
+}
+
+bool storage_read(const char *key, void *out_data, size_t *inout_size) {
+    const struct storage_request value = {.key = key, .out_data = out_data, .inout_size = inout_size};
+    return storage_run(&value);
 }
 
 /**
@@ -45,7 +122,7 @@ void storage_init() {
  * @param  size   Length of the buffer in bytes.
  * @return ESP_OK on success, otherwise an ESP error code.
  */
-bool storage_write(const char *key, const void *data, size_t size) {
+static bool storage_nvs_write(const char *key, const void *data, size_t size) {
     nvs_handle_t handle;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
     if (err != ESP_OK) {
@@ -68,7 +145,7 @@ bool storage_write(const char *key, const void *data, size_t size) {
     }
 
     nvs_close(handle);
-    return true;
+    return err == ESP_OK;
 }
 
 /**
@@ -79,7 +156,7 @@ bool storage_write(const char *key, const void *data, size_t size) {
  * @return ESP_OK on success, ESP_ERR_NVS_NOT_FOUND if key not found, 
  *         ESP_ERR_NVS_INVALID_LENGTH if buffer is too small, or another ESP error.
  */
-bool storage_read(const char *key, void *out_data, size_t *inout_size) {
+static bool storage_nvs_read(const char *key, void *out_data, size_t *inout_size) {
     nvs_handle_t handle;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
     if (err != ESP_OK) {
@@ -17,6 +17,7 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+/* Also starts the task all later NVS access runs in */
 void storage_init();
 bool storage_write(const char *key, const void *data, size_t size);
 bool storage_read(const char *key, void *out_data, size_t *inout_size);
@@ -6,7 +6,7 @@
 /* FILE NAME   : wifi.c
  * PURPOSE     : Wifi connection module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 29.05.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -14,15 +14,16 @@
 
 #include "esp_event_loop.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/event_groups.h"
-#include "nvs_flash.h"
+#include "freertos/task.h"
 #include "tcpip_adapter.h"
 
 #include <string.h>
 
 #include "secret.h"
+#include "storage.h"
 #include "wifi.h"
 
 static const char TAG[] = "wifi";
@@ -31,8 +32,116 @@ static const char TAG[] = "wifi";
 #error "Please define wifi creditals in secret.h"
 #endif /* !WIFI_SSID || !WIFI_PASS */
 
-static EventGroupHandle_t s_wifi_event_group;
-#define WIFI_CONNECTED_BIT BIT0
+#define NVS_AP_KEY "wifi_ap"
+
+/* Reconnects to the cached AP before falling back to the full scan */
+#ifndef WIFI_FAST_RETRIES
+#define WIFI_FAST_RETRIES 2
+#endif /* WIFI_FAST_RETRIES */
+
+/* Delay before a scanning reconnect, doubled after each failure */
+#define WIFI_BACKOFF_MIN_MS 250
+#define WIFI_BACKOFF_MAX_MS (30 * 1000)
+
+/* Last AP, lets the next boot skip the full scan */
+struct wifi_ap {
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
+static struct wifi_ap cached_ap;
+static bool cached_ap_valid = false;
+static bool cached_ap_used = false;
+
+static esp_timer_handle_t retry_timer = NULL;
+static uint32_t fast_retries = 0;
+static uint32_t backoff_ms = WIFI_BACKOFF_MIN_MS;
+
+/* Link lost at, 0 while connected and before the first connection */
+static int64_t outage_start = 0;
+static bool link_up = false;
+
+static struct wifi_stats stats;
+
+/* Points the station at the cached AP or lets it scan for the SSID */
+static void wifi_use_cached_ap(bool use) {
+    wifi_config_t wifi_config;
+
+    cached_ap_used = use;
+    esp_wifi_get_config(ESP_IF_WIFI_STA, &wifi_config);
+    wifi_config.sta.bssid_set = use;
+    if (use) {
+        memcpy(wifi_config.sta.bssid, cached_ap.bssid, sizeof(cached_ap.bssid));
+    }
+    wifi_config.sta.channel = use ? cached_ap.channel : 0;
+    esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+}
+
+static void wifi_remember_ap(const system_event_sta_connected_t *connected) {
+    struct wifi_ap ap;
+
+    memcpy(ap.bssid, connected->bssid, sizeof(ap.bssid));
+    ap.channel = connected->channel;
+    if (cached_ap_valid && memcmp(&ap, &cached_ap, sizeof(ap)) == 0) {
+        return;
+    }
+
+    cached_ap = ap;
+    cached_ap_valid = true;
+    storage_write(NVS_AP_KEY, &ap, sizeof(ap));
+}
+
+static void wifi_retry(void *arg) {
+    esp_wifi_connect();
+}
+
+/* Cached AP first, right away. Once it fails the full scan runs after a
+ * growing delay, a missing AP is not hammered with connects */
+static void wifi_reconnect(void) {
+    if (cached_ap_valid && fast_retries < WIFI_FAST_RETRIES) {
+        fast_retries++;
+        if (!cached_ap_used) {
+            wifi_use_cached_ap(true);
+        }
+        esp_wifi_connect();
+        return;
+    }
+
+    if (cached_ap_used) {
+        ESP_LOGW(TAG, "Cached AP failed, scanning");
+        wifi_use_cached_ap(false);
+    }
+    portENTER_CRITICAL();
+    stats.scans++;
+    portEXIT_CRITICAL();
+    ESP_LOGI(TAG, "Scanning in %ums", (unsigned) backoff_ms);
+    if (retry_timer == NULL || esp_timer_start_once(retry_timer, backoff_ms * 1000ULL) != ESP_OK) {
+        esp_wifi_connect();
+    }
+    backoff_ms = backoff_ms * 2 > WIFI_BACKOFF_MAX_MS ? WIFI_BACKOFF_MAX_MS : backoff_ms * 2;
+}
+
+static void wifi_recovered(bool ip_changed) {
+    fast_retries = 0;
+    backoff_ms = WIFI_BACKOFF_MIN_MS;
+    link_up = true;
+    if (outage_start == 0) {
+        return;
+    }
+
+    uint32_t recover_ms = (esp_timer_get_time() - outage_start) / 1000;
+    portENTER_CRITICAL();
+    stats.recoveries++;
+    stats.address_changes += ip_changed ? 1 : 0;
+    stats.last_recover_ms = recover_ms;
+    stats.max_recover_ms = recover_ms > stats.max_recover_ms ? recover_ms : stats.max_recover_ms;
+    stats.outage_ms += recover_ms;
+    portEXIT_CRITICAL();
+    outage_start = 0;
+
+    ESP_LOGI(TAG, "Link recovered in %ums%s, %u disconnects, worst %ums", (unsigned) recover_ms,
+             ip_changed ? " with a new address" : "", stats.disconnects, stats.max_recover_ms);
+}
 
 static esp_err_t wifi_event_handler(void *ctx, system_event_t *event) {
     switch (event->event_id) {
@@ -41,16 +150,29 @@ static esp_err_t wifi_event_handler(void *ctx, system_event_t *event) {
             ESP_LOGI(TAG, "SYSTEM_EVENT_STA_START: connecting...");
             break;
 
+        case SYSTEM_EVENT_STA_CONNECTED:
+            wifi_remember_ap(&event->event_info.connected);
+            break;
+
         case SYSTEM_EVENT_STA_GOT_IP:
-            ESP_LOGI(TAG, "SYSTEM_EVENT_STA_GOT_IP: IP=%s",
-                     ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip));
-            xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+            ESP_LOGI(TAG, "SYSTEM_EVENT_STA_GOT_IP: IP=%s in %ums",
+                     ip4addr_ntoa(&event->event_info.got_ip.ip_info.ip),
+                     (unsigned) (esp_timer_get_time() / 1000));
+            wifi_recovered(event->event_info.got_ip.ip_changed);
             break;
 
         case SYSTEM_EVENT_STA_DISCONNECTED:
-            ESP_LOGI(TAG, "SYSTEM_EVENT_STA_DISCONNECTED: retrying...");
-            esp_wifi_connect();
-            xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+            ESP_LOGI(TAG, "SYSTEM_EVENT_STA_DISCONNECTED: reason %u, retrying...",
+                     (unsigned) event->event_info.disconnected.reason);
+            // Failed connects come here too, only a lost link starts an outage
+            if (link_up) {
+                link_up = false;
+                outage_start = esp_timer_get_time();
+                portENTER_CRITICAL();
+                stats.disconnects++;
+                portEXIT_CRITICAL();
+            }
+            wifi_reconnect();
             break;
 
         default:
@@ -60,8 +182,6 @@ static esp_err_t wifi_event_handler(void *ctx, system_event_t *event) {
 }
 
 static void wifi_init_sta(void) {
-    s_wifi_event_group = xEventGroupCreate();
-
     tcpip_adapter_init();
     ESP_ERROR_CHECK(esp_event_loop_init(wifi_event_handler, NULL));
 
@@ -79,28 +199,39 @@ static void wifi_init_sta(void) {
                     },
             },
     };
+
+    size_t size = sizeof(cached_ap);
+    if (storage_read(NVS_AP_KEY, &cached_ap, &size) && size == sizeof(cached_ap)) {
+        ESP_LOGI(TAG, "Fast connect to cached AP on channel %u", (unsigned) cached_ap.channel);
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, cached_ap.bssid, sizeof(cached_ap.bssid));
+        wifi_config.sta.channel = cached_ap.channel;
+        cached_ap_valid = true;
+        cached_ap_used = true;
+    }
+
+    const esp_timer_create_args_t args = {
+            .callback = wifi_retry,
+            .name = "wifi retry",
+    };
+    if (esp_timer_create(&args, &retry_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Can't create retry timer");
+    }
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-    // Blocking
-    xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT,
-                        pdFALSE, pdTRUE, portMAX_DELAY);
 }
 
-void wifi_connect(void) {
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
-        ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
+void wifi_start(void) {
     ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
     wifi_init_sta();
+}
 
-    ESP_LOGI(TAG, "Connected to SSID:%s", WIFI_SSID);
+void wifi_get_stats(struct wifi_stats *out) {
+    portENTER_CRITICAL();
+    *out = stats;
+    portEXIT_CRITICAL();
 }
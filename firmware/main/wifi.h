@@ -6,7 +6,7 @@
 /* FILE NAME   : wifi.c
  * PURPOSE     : Wifi connection module.
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 29.05.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
@@ -16,7 +16,22 @@
 #define __WIFI_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
-void wifi_connect(void);
+/* Link outages since boot, the first connection is not one */
+struct wifi_stats {
+    uint32_t disconnects;
+    uint32_t recoveries;      /* Outages ended with an address, listeners re-arm on it */
+    uint32_t address_changes; /* Recoveries that came with a new address */
+    uint32_t scans;           /* Reconnects that fell back to the full scan */
+    uint32_t last_recover_ms;
+    uint32_t max_recover_ms;
+    uint64_t outage_ms;       /* Total time without a link */
+};
+
+/* Starts connecting in background, NVS must be initialized */
+void wifi_start(void);
+
+void wifi_get_stats(struct wifi_stats *stats);
 
 #endif /* __WIFI_H__ */
\ No newline at end of file
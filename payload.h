@@ -8,23 +8,380 @@ extern "C" {
 #endif
 #pragma pack(push, 1)
 
+#define PAYLOAD_VERSION 7
+
+/* Volumes are fixed-point, 1/VOLUME_SCALE of the unit */
+#define VOLUME_SCALE 1000
+
 enum command {
     CMD_UNUSED,
     CMD_PUMP_WORK_VOLUME,
     CMD_PUMP_WORK_TIME,
     CMD_PUMP_CALLIBRATE,
+    CMD_SCHEDULE_SET,
+    CMD_SCHEDULE_GET,
+    CMD_BATCH,
+    CMD_PUMP_WORK_GROUP,
+    CMD_SESSION_OPEN,
+    CMD_OTA,
+    CMD_HISTORY,
+    CMD_POWER_SET,
+    CMD_FLOW_SET,
+    CMD_STATUS,
+    CMD_PUMP_STOP,
+    CMD_BENCHMARK,
 
     CMD_TOTAL
 };
 
+/* Response status */
+enum status {
+    STATUS_OK = 0x00,
+    STATUS_FAILED = 0x01,
+    STATUS_BUSY = 0x02, /* Rate limited before verification, retry later */
+
+    STATUS_EVENT = 0xFE, /* Not a response, struct pump_event pushed by the device */
+
+    STATUS_DENIED = 0xFF
+};
+
+/* Response header, followed by `size` bytes of command specific data */
+struct response {
+    uint8_t  status;
+    uint16_t size;
+};
+
+/* Packet authentication, selects what follows the command data */
+enum auth {
+    AUTH_RSA,           /* RSA signature of MD5 over header and data */
+    AUTH_SESSION,       /* struct session_tag */
+    AUTH_MERKLE = 0x10  /* Low bits are the proof depth, struct merkle_tag */
+};
+
+#define MERKLE_HASH_SIZE 32
+#define MERKLE_MAX_DEPTH 15
+
+#define AUTH_IS_MERKLE(AUTH)    (((AUTH) & ~MERKLE_MAX_DEPTH) == AUTH_MERKLE)
+#define AUTH_MERKLE_DEPTH(AUTH) ((AUTH) & MERKLE_MAX_DEPTH)
+
+/* AUTH_MERKLE trailer, followed by depth sibling hashes from the leaf up
+ * and the RSA signature of MD5 over the root. The leaf is SHA-256 of 0x00,
+ * the target device IPv4 address as in sockaddr_in, header and data, a
+ * node is SHA-256 of 0x01 and its two children. A node left without a
+ * sibling moves up unchanged and has no proof hash. A device takes a
+ * timestamp once from Merkle packets, a batch has one leaf per device */
+struct merkle_tag {
+    uint32_t path; /* Bit N set: at proof step N the sibling is on the left */
+};
+
+/* Header, followed by `size` bytes of command data and the signature */
 struct payload {
+    uint8_t  version;
+    uint8_t  auth;
     uint64_t timestamp;
+    uint32_t id;      /* Chosen by the client, not 0 asks for completion events.
+                       * A repeated id of the same command gets the first result */
     uint8_t  command;
     uint32_t pin;
-    double   volume;
+    uint32_t volume;
+    uint32_t time;
+    uint64_t execute_at; /* Unix time in microseconds to run at, 0 runs on receipt.
+                          * Held pump doses and stops reply once queued */
+    uint16_t size;
+};
+
+enum event_kind {
+    EVENT_FINISHED,
+    EVENT_ABORTED,   /* Stopped before its time */
+    EVENT_GPIO_ERROR /* Channel could not be switched off, device restarts */
+};
+
+/* Sent on the connection of command `id` when a started channel stops,
+ * one per channel of groups and batches */
+struct pump_event {
+    uint32_t id;
+    uint8_t  pin;
+    uint8_t  kind;    /* enum event_kind */
+    uint32_t elapsed; /* Milliseconds the channel was on */
+    uint32_t waited;  /* Milliseconds queued for the power budget or the channel */
+};
+
+#define SESSION_KEY_SIZE 32
+#define SESSION_MAC_SIZE 16
+
+/* AUTH_SESSION trailer. `mac` is HMAC-SHA256 truncated to SESSION_MAC_SIZE
+ * over header, data, `session` and `counter`; counter grows every packet */
+struct session_tag {
+    uint32_t session;
+    uint32_t counter;
+    uint8_t  mac[SESSION_MAC_SIZE];
+};
+
+/* CMD_SESSION_OPEN response, RSA signed packets only. Followed by
+ * SESSION_KEY_SIZE random bytes encrypted with the public key (PKCS#1) */
+struct session_open {
+    uint32_t session;
+    uint32_t lifetime; /* Seconds */
+};
+
+#define BATCH_MAX_ITEMS 16
+
+/* CMD_BATCH data is a sequence of items, each followed by `size`
+ * bytes of its data. Response data is one status per item */
+struct batch_item {
+    uint8_t  command;
+    uint32_t pin;
+    uint32_t volume;
+    uint32_t time;
+    uint16_t size;
+};
+
+#define GROUP_MAX_STEPS 8
+
+/* CMD_PUMP_WORK_GROUP data is an array of steps with distinct pins,
+ * all of them start together. Response data is struct group_result */
+struct group_step {
+    uint8_t  command; /* CMD_PUMP_WORK_VOLUME or CMD_PUMP_WORK_TIME */
+    uint8_t  pin;
+    uint32_t volume;
+    uint32_t time;
+};
+
+struct group_result {
+    uint32_t skew_ns; /* Measured start skew between channels, 0 if queued */
+};
+
+#define POWER_MAX_CHANNELS 32
+
+/* CMD_POWER_SET data, only `channels_count` currents are transferred.
+ * Doses start while the sum of running pump currents fits `budget_ma`,
+ * others wait in a queue. Budget 0 is unlimited. A dose for a channel that
+ * is on or queued waits in the queue behind it */
+struct power_config {
+    uint16_t budget_ma;
+    uint8_t  channels_count;
+    uint16_t current_ma[POWER_MAX_CHANNELS];
+};
+
+#define POWER_CONFIG_SIZE(N) (sizeof(struct power_config) - sizeof(uint16_t) * (POWER_MAX_CHANNELS - (N)))
+
+/* CMD_STATUS response, followed by `count` channel_status of channels
+ * that run or wait for power */
+struct status_report {
+    uint32_t running; /* Channel mask */
+    uint8_t  queued;  /* Doses waiting for power */
+    uint8_t  count;
+};
+
+struct channel_status {
+    uint8_t  pin;
+    uint8_t  queued;    /* Doses of the channel waiting for power */
+    uint32_t id;        /* Command of the running dose */
+    uint32_t elapsed;   /* Milliseconds on */
+    uint32_t remaining; /* Milliseconds to the planned stop, limit of sensor doses */
+};
+
+/* CMD_PUMP_STOP header `pin`, every channel */
+#define PUMP_STOP_ALL 0xFFFFFFFF
+
+/* CMD_PUMP_STOP response. Header `time` 0 switches the channel off now,
+ * otherwise a running dose stops at most `time` ms later. Queued doses and
+ * doses held for execute_at of the channel are dropped either way.
+ * Followed by `count` stop_result of channels that were running */
+struct stop_report {
+    uint8_t  cancelled; /* Queued and held doses dropped */
+    uint8_t  count;
+};
+
+struct stop_result {
+    uint8_t  pin;
+    uint32_t id;      /* Command of the dose */
+    uint32_t elapsed; /* Milliseconds on, so far if shortened */
+    uint32_t volume;  /* Dispensed so far in 1/VOLUME_SCALE units, 0 if unknown */
+};
+
+#define BENCHMARK_MAX_ITERATIONS 64
+
+enum benchmark_primitive {
+    BENCHMARK_MD5,          /* encryption_md5() over the request data */
+    BENCHMARK_VERIFY,       /* encryption_verify() of the request sample */
+    BENCHMARK_STORAGE_READ, /* storage_read() of a small blob */
+    BENCHMARK_OUTPUT_WRITE, /* Output write of channel `pin` to its current state */
+
+    BENCHMARK_TOTAL
+};
+
+/* CMD_BENCHMARK data, followed by an RSA signature of `md5` with the
+ * command key. Header `time` is the iteration count, 1..BENCHMARK_MAX_ITERATIONS */
+struct benchmark_request {
+    uint8_t  md5[16];
+};
+
+/* CMD_BENCHMARK response, followed by `count` benchmark_result */
+struct benchmark_report {
+    uint32_t cpu_mhz;
+    uint16_t iterations;
+    uint8_t  count;
+};
+
+/* CPU cycles of one run of the primitive */
+struct benchmark_result {
+    uint8_t  primitive;
+    uint32_t min;
+    uint32_t median;
+    uint32_t max;
+};
+
+#define FLOW_GPIO_NONE      0xFF
+#define FLOW_GPIO_SIMULATED 0xFE /* Timer pulses at `simulated_hz`, for tests */
+
+/* CMD_FLOW_SET data, header `pin` is the channel. Volume doses of a
+ * channel with a sensor stop on its pulse count, the measured time
+ * corrects the calibration curve */
+struct flow_config {
+    uint8_t  gpio;         /* Sensor pulse output */
+    uint32_t pulses;       /* Pulses per unit, VOLUME_SCALE volume */
+    uint32_t simulated_hz;
+};
+
+#define OTA_URL_MAX 128
+#define OTA_SHA256_SIZE 32
+
+enum ota_mode {
+    OTA_FULL,  /* URL serves the image */
+    OTA_DELTA  /* URL serves a patch against the running image */
+};
+
+/* CMD_OTA data, followed by the http:// URL without terminating zero.
+ * The device answers once the download starts, checks `image_sha256`
+ * of the written image and reboots into it */
+struct ota_request {
+    uint8_t  mode;
+    uint32_t image_size;
+    uint8_t  image_sha256[OTA_SHA256_SIZE];
+};
+
+/* OTA_DELTA patch is OTA_PATCH_MAGIC followed by ops until the image
+ * is complete, OTA_OP_INSERT ops are followed by `length` bytes */
+#define OTA_PATCH_MAGIC 0x31504457 /* "WDP1" */
+
+enum ota_op {
+    OTA_OP_COPY = 1, /* `length` bytes of the running image from `offset` */
+    OTA_OP_INSERT = 2
+};
+
+struct ota_patch_op {
+    uint8_t  op;
+    uint32_t offset;
+    uint32_t length;
+};
+
+enum dose_result {
+    DOSE_DONE,
+    DOSE_FAILED /* Pump did not start or could not be stopped */
+};
+
+/* Journal record of one dose */
+struct dose_record {
+    uint32_t seq;       /* Grows by one every record */
+    uint32_t time;      /* Unix seconds of the start, 0 before time sync */
+    uint32_t requested; /* Milliseconds */
+    uint32_t actual;    /* Milliseconds */
+    uint8_t  pin;
+    uint8_t  result;    /* enum dose_result */
+    uint16_t check;     /* Fletcher-16 of the fields above */
+};
+
+/* CMD_HISTORY data, asks for records with `from` <= time < `to`
+ * and seq >= `seq`. `to` 0 is no upper limit */
+struct history_request {
+    uint32_t from;
+    uint32_t to;
+    uint32_t seq;
+};
+
+/* CMD_HISTORY response, followed by matching records in seq order.
+ * While `more` is set the next page starts at `next_seq` */
+struct history_page {
+    uint32_t next_seq;
+    uint8_t  more;
+};
+
+/* MQTT channel. Packets are published as they go over TCP to
+ * MQTT_TOPIC_PREFIX "<device>/command" or, for every device of a group,
+ * MQTT_TOPIC_PREFIX "group/<group>/command". A device is the hex of its
+ * station MAC. It publishes to MQTT_TOPIC_PREFIX "<device>/" topics:
+ *   ack     struct mqtt_ack followed by the response frame
+ *   event   struct pump_event of doses started over MQTT
+ *   status  CMD_STATUS response data
+ *   metrics struct device_metrics
+ *   online  "1", "0" retained by the broker once the device is gone */
+#define MQTT_TOPIC_PREFIX "washer/"
+
+struct mqtt_ack {
+    uint64_t timestamp; /* Of the packet, tells acks of one device apart */
+    uint32_t id;
+    uint8_t  command;
+};
+
+struct device_metrics {
+    uint32_t uptime;          /* Seconds */
+    uint32_t free_heap;
+    int8_t   rssi;
+    uint32_t disconnects;     /* Wi-Fi link losses */
+    uint32_t last_recover_ms;
+    uint32_t max_recover_ms;
+    uint32_t outage;          /* Seconds without a link in total */
+    uint32_t broker_connects;
+    uint32_t packets;         /* Received over MQTT */
+    uint32_t denied;          /* ... and rejected before running */
+    uint32_t verified;        /* Signed packets checked, over TCP and MQTT */
+    uint32_t verify_us;       /* Average time of a check */
+    uint32_t avoided;         /* Signed packets rejected before the check */
+    uint32_t first_command;   /* Milliseconds from boot to it, 0 before it */
+};
+
+#define CALIBRATION_MAX_POINTS 8
+
+/* CMD_PUMP_CALLIBRATE data is an array of points,
+ * volume strictly increasing */
+struct calibration_point {
+    uint32_t volume;
+    uint32_t time; /* Milliseconds to pump `volume` */
+};
+
+#define SCHEDULE_MAX_ENTRIES 16
+#define SCHEDULE_MAX_STEPS   4
+
+/* Every day of week, bit 0 is Sunday */
+#define SCHEDULE_DAYS_ALL 0x7F
+
+struct schedule_step {
+    uint16_t delay;   /* Seconds after the entry start */
+    uint8_t  command; /* CMD_PUMP_WORK_VOLUME or CMD_PUMP_WORK_TIME */
+    uint8_t  pin;
+    uint32_t volume;
     uint32_t time;
 };
 
+struct schedule_entry {
+    uint16_t minute; /* Minute of the day in schedule local time */
+    uint8_t  days;   /* Day of week mask */
+    uint8_t  steps_count;
+    struct schedule_step steps[SCHEDULE_MAX_STEPS];
+};
+
+/* CMD_SCHEDULE_SET data and CMD_SCHEDULE_GET response,
+ * only `entries_count` entries are transferred */
+struct schedule {
+    uint32_t revision;
+    int16_t  utc_offset; /* Minutes */
+    uint8_t  entries_count;
+    struct schedule_entry entries[SCHEDULE_MAX_ENTRIES];
+};
+
+#define SCHEDULE_SIZE(N) (sizeof(struct schedule) - sizeof(struct schedule_entry) * (SCHEDULE_MAX_ENTRIES - (N)))
+
 #pragma pack(pop)
 #ifdef __cplusplus
 }
@@ -0,0 +1,78 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : capture.cpp
+ * PURPOSE     : Device traffic capture file
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#include "capture.h"
+
+#include <chrono>
+#include <iostream>
+
+bool capture_writer::open(const std::string &path) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    file.open(path, std::ios::binary | std::ios::app);
+    if (!file) {
+        std::cerr << "Can't open capture " << path << std::endl;
+        return false;
+    }
+
+    file.seekp(0, std::ios::end);
+    if (file.tellp() == 0) {
+        capture_header header = {CAPTURE_MAGIC, CAPTURE_VERSION};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+    return file.good();
+}
+
+void capture_writer::write(capture_kind kind, uint32_t host, uint16_t port, const uint8_t *data, size_t size) {
+    capture_record record = {};
+    record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    record.host = host;
+    record.port = port;
+    record.kind = kind;
+    record.size = size;
+
+    // Records stay whole even if the tool is killed right after
+    std::lock_guard<std::mutex> guard(lock);
+    file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    file.write(reinterpret_cast<const char *>(data), size);
+    file.flush();
+}
+
+bool capture_read(const std::string &path, std::vector<capture_entry> &entries) {
+    std::ifstream file(path, std::ios::binary);
+    capture_header header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+        std::cerr << path << " is not a capture" << std::endl;
+        return false;
+    }
+
+    entries.clear();
+    capture_entry entry;
+    bool truncated = false;
+    while (file.read(reinterpret_cast<char *>(&entry.record), sizeof(entry.record))) {
+        entry.data.resize(entry.record.size);
+        if (!file.read(reinterpret_cast<char *>(entry.data.data()), entry.data.size())) {
+            truncated = true;
+            break;
+        }
+        entries.push_back(entry);
+    }
+
+    // A writer killed mid record leaves a partial tail
+    if (truncated || file.gcount() != 0) {
+        std::cerr << "Capture is truncated after " << entries.size() << " records" << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : capture.h
+ * PURPOSE     : Device traffic capture file
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __CAPTURE_H_
+#define __CAPTURE_H_
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define CAPTURE_MAGIC   0x50414357 /* "WCAP" */
+#define CAPTURE_VERSION 1
+
+enum capture_kind : uint8_t {
+    CAPTURE_PACKET,   /* Signed packet as sent */
+    CAPTURE_RESPONSE, /* struct response and its data */
+    CAPTURE_EVENT     /* Pushed STATUS_EVENT frame */
+};
+
+#pragma pack(push, 1)
+
+/* Written once at the start of a new file */
+struct capture_header {
+    uint32_t magic;
+    uint8_t  version;
+};
+
+/* Every record, followed by `size` bytes */
+struct capture_record {
+    uint64_t time_us; /* Unix time, records of several runs keep their pacing */
+    uint32_t host;    /* Device address in network order */
+    uint16_t port;
+    uint8_t  kind;
+    uint32_t size;
+};
+
+#pragma pack(pop)
+
+struct capture_entry {
+    capture_record record;
+    std::vector<uint8_t> data;
+};
+
+/* Appends records to a capture file, shared by connections of all threads */
+class capture_writer {
+public:
+    /* Existing capture files are continued */
+    bool open(const std::string &path);
+
+    void write(capture_kind kind, uint32_t host, uint16_t port, const uint8_t *data, size_t size);
+
+private:
+    std::mutex lock;
+    std::ofstream file;
+};
+
+/* Reads a whole capture, a truncated last record is dropped */
+bool capture_read(const std::string &path, std::vector<capture_entry> &entries);
+
+#endif /* __CAPTURE_H_ */
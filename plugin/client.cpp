@@ -6,223 +6,672 @@
 /* FILE NAME   : client.cpp
  * PURPOSE     : Client command line tool
  * PROGRAMMER  : KM6.
- * LAST UPDATE : 04.06.2025.
+ * LAST UPDATE : 19.10.2026.
  *
  * No part of this file may be changed without agreement of
  * Konstantin Mitish
  */
 
-#include <arpa/inet.h>
 #include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <sstream>
 #include <vector>
 
-#include <unistd.h>
+#include "mqtt.h"
+#include "protocol.h"
 
-#include <openssl/err.h>
-#include <openssl/evp.h>
-#include <openssl/md5.h>
-#include <openssl/pem.h>
-#include <openssl/rsa.h>
+/* Longest dose the client waits completion events for */
+#define EVENT_WAIT_MS (15 * 60 * 1000)
 
-#include "../payload.h"
+/* Devices answer over MQTT within it, a group is waited for this long */
+#define MQTT_ACK_WAIT_MS 5000
 
-std::vector<uint8_t> compute_md5(const std::vector<uint8_t> &data) {
-    std::vector<uint8_t> digest(EVP_MD_size(EVP_md5()));
-    std::shared_ptr<EVP_MD_CTX> mdctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
-    if (!mdctx) {
-        std::cerr << "EVP_MD_CTX_new failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+/* Calibration points list: <volume>:<time_ms>[,<volume>:<time_ms>...] */
+std::vector<uint8_t> parse_calibration(const std::string &text) {
+    std::vector<uint8_t> res;
+    std::istringstream in(text);
+    std::string point;
+    while (std::getline(in, point, ',')) {
+        size_t colon = point.find(':');
+        if (colon == std::string::npos) {
+            std::cerr << "Invalid calibration point: " << point << std::endl;
+            return {};
+        }
+        calibration_point value;
+        value.volume = parse_volume(point.substr(0, colon));
+        value.time = std::stoul(point.substr(colon + 1), nullptr, 0);
+        const uint8_t *raw = reinterpret_cast<const uint8_t *>(&value);
+        res.insert(res.end(), raw, raw + sizeof(value));
+    }
+    if (res.empty() || res.size() > CALIBRATION_MAX_POINTS * sizeof(calibration_point)) {
+        std::cerr << "Expected 1.." << CALIBRATION_MAX_POINTS << " calibration points" << std::endl;
         return {};
     }
+    return res;
+}
 
-    if (EVP_DigestInit_ex(mdctx.get(), EVP_md5(), nullptr) != 1) {
-        std::cerr << "EVP_DigestInit_ex failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+/* Group steps list: <command>:<pin>:<volume or time>[,...] */
+std::vector<uint8_t> parse_group(const std::string &text) {
+    std::vector<uint8_t> res;
+    std::istringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        std::istringstream fields(item);
+        std::string command, pin, value;
+        if (!std::getline(fields, command, ':') || !std::getline(fields, pin, ':') || !std::getline(fields, value)) {
+            std::cerr << "Invalid group step: " << item << std::endl;
+            return {};
+        }
+        group_step step = {};
+        step.command = std::stoul(command, nullptr, 0);
+        step.pin = std::stoul(pin, nullptr, 0);
+        if (step.command == CMD_PUMP_WORK_VOLUME) {
+            step.volume = parse_volume(value);
+        } else {
+            step.time = std::stoul(value, nullptr, 0);
+        }
+        const uint8_t *raw = reinterpret_cast<const uint8_t *>(&step);
+        res.insert(res.end(), raw, raw + sizeof(step));
+    }
+    if (res.empty() || res.size() > GROUP_MAX_STEPS * sizeof(group_step)) {
+        std::cerr << "Expected 1.." << GROUP_MAX_STEPS << " group steps" << std::endl;
         return {};
     }
+    return res;
+}
+
+/* Power budget: <budget_ma>[:<pump_ma>[,<pump_ma>...]], pumps by channel */
+std::vector<uint8_t> parse_power(const std::string &text) {
+    power_config config = {};
+    size_t colon = text.find(':');
+    config.budget_ma = std::stoul(text.substr(0, colon), nullptr, 0);
+    if (colon != std::string::npos) {
+        std::istringstream in(text.substr(colon + 1));
+        std::string current;
+        while (std::getline(in, current, ',')) {
+            if (config.channels_count == POWER_MAX_CHANNELS) {
+                std::cerr << "Expected up to " << POWER_MAX_CHANNELS << " pump currents" << std::endl;
+                return {};
+            }
+            config.current_ma[config.channels_count++] = std::stoul(current, nullptr, 0);
+        }
+    }
 
-    if (EVP_DigestUpdate(mdctx.get(), data.data(), data.size()) != 1) {
-        std::cerr << "EVP_DigestUpdate failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+    std::vector<uint8_t> res(POWER_CONFIG_SIZE(config.channels_count));
+    memcpy(res.data(), &config, res.size());
+    return res;
+}
+
+/* Flow sensor: none, sim:<pulses per unit>:<pulses per second>
+ * or <gpio>:<pulses per unit> */
+std::vector<uint8_t> parse_flow(const std::string &text) {
+    flow_config config = {};
+    std::istringstream in(text);
+    std::string source, pulses, rate;
+    std::getline(in, source, ':');
+    std::getline(in, pulses, ':');
+    std::getline(in, rate);
+
+    if (source == "none") {
+        config.gpio = FLOW_GPIO_NONE;
+    } else if (source == "sim" && !pulses.empty() && !rate.empty()) {
+        config.gpio = FLOW_GPIO_SIMULATED;
+        config.pulses = std::stoul(pulses, nullptr, 0);
+        config.simulated_hz = std::stoul(rate, nullptr, 0);
+    } else if (!source.empty() && !pulses.empty()) {
+        config.gpio = std::stoul(source, nullptr, 0);
+        config.pulses = std::stoul(pulses, nullptr, 0);
+    } else {
+        std::cerr << "Invalid flow sensor: " << text << std::endl;
         return {};
     }
 
-    unsigned int out_len = 0;
-    if (EVP_DigestFinal_ex(mdctx.get(), digest.data(), &out_len) != 1) {
-        std::cerr << "EVP_DigestFinal_ex failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+    std::vector<uint8_t> res(sizeof(config));
+    memcpy(res.data(), &config, sizeof(config));
+    return res;
+}
+
+/* Schedule text format, one step per line:
+ *   offset <minutes from UTC>
+ *   revision <number>
+ *   <HH:MM> <days mask> <delay seconds> <command> <pin> <volume> <time>
+ * Consecutive steps with the same start and days form one entry */
+std::vector<uint8_t> load_schedule(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Cannot open schedule file: " << path << std::endl;
         return {};
     }
 
-    digest.resize(out_len);
-    return digest;
+    schedule data = {};
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string first;
+        fields >> first;
+        if (first == "offset") {
+            fields >> data.utc_offset;
+        } else if (first == "revision") {
+            fields >> data.revision;
+        } else {
+            unsigned hours = 0, minutes = 0;
+            char colon = 0;
+            std::istringstream(first) >> hours >> colon >> minutes;
+
+            std::string days, delay, command, pin, volume, time;
+            fields >> days >> delay >> command >> pin >> volume >> time;
+            if (colon != ':' || hours >= 24 || minutes >= 60 || time.empty()) {
+                std::cerr << path << ":" << line_number << ": invalid step" << std::endl;
+                return {};
+            }
+
+            uint16_t minute = hours * 60 + minutes;
+            uint8_t days_mask = std::stoul(days, nullptr, 0);
+            schedule_entry *entry = data.entries_count == 0 ? nullptr : &data.entries[data.entries_count - 1];
+            if (entry == nullptr || entry->minute != minute || entry->days != days_mask) {
+                if (data.entries_count == SCHEDULE_MAX_ENTRIES) {
+                    std::cerr << path << ":" << line_number << ": too many entries" << std::endl;
+                    return {};
+                }
+                entry = &data.entries[data.entries_count++];
+                entry->minute = minute;
+                entry->days = days_mask;
+            }
+
+            if (entry->steps_count == SCHEDULE_MAX_STEPS) {
+                std::cerr << path << ":" << line_number << ": too many steps" << std::endl;
+                return {};
+            }
+            schedule_step &step = entry->steps[entry->steps_count++];
+            step.delay = std::stoul(delay, nullptr, 0);
+            step.command = std::stoul(command, nullptr, 0);
+            step.pin = std::stoul(pin, nullptr, 0);
+            step.volume = parse_volume(volume);
+            step.time = std::stoul(time, nullptr, 0);
+        }
+    }
+
+    std::vector<uint8_t> res(SCHEDULE_SIZE(data.entries_count));
+    memcpy(res.data(), &data, res.size());
+    return res;
 }
 
-EVP_PKEY *load_private_key(const std::string &key_path) {
-    FILE *fp = fopen(key_path.c_str(), "rb");
-    if (!fp) {
-        std::cerr << "Cannot open private key file: " << key_path << "\n";
-        return nullptr;
+void print_schedule(const std::vector<uint8_t> &data) {
+    schedule value = {};
+    if (data.size() < SCHEDULE_SIZE(0) || data.size() > sizeof(value)) {
+        std::cerr << "Invalid schedule size " << data.size() << std::endl;
+        return;
     }
-    EVP_PKEY *pkey = PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr);
-    fclose(fp);
-    if (!pkey) {
-        std::cerr << "PEM_read_PrivateKey failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+    memcpy(&value, data.data(), data.size());
+
+    std::cout << "revision " << value.revision << std::endl
+              << "offset " << value.utc_offset << std::endl;
+    for (int i = 0; i < value.entries_count && i < SCHEDULE_MAX_ENTRIES; i++) {
+        const schedule_entry &entry = value.entries[i];
+        for (int j = 0; j < entry.steps_count && j < SCHEDULE_MAX_STEPS; j++) {
+            const schedule_step &step = entry.steps[j];
+            std::cout << std::setfill('0') << std::setw(2) << entry.minute / 60 << ":"
+                      << std::setw(2) << entry.minute % 60 << std::setfill(' ')
+                      << " 0x" << std::hex << (unsigned) entry.days << std::dec
+                      << " " << step.delay
+                      << " " << (unsigned) step.command
+                      << " " << (unsigned) step.pin
+                      << " " << format_volume(step.volume)
+                      << " " << step.time << std::endl;
+        }
     }
-    return pkey;
 }
 
-std::vector<uint8_t> sign(std::shared_ptr<EVP_PKEY> pkey, const std::vector<uint8_t> &data) {
-    std::shared_ptr<EVP_PKEY_CTX> ctx(EVP_PKEY_CTX_new(pkey.get(), nullptr), EVP_PKEY_CTX_free);
-    if (!ctx) {
-        std::cerr << "EVP_PKEY_CTX_new failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
-        return {};
+void print_status(const std::vector<uint8_t> &data) {
+    status_report report;
+    if (data.size() < sizeof(report)) {
+        std::cerr << "Invalid status size " << data.size() << std::endl;
+        return;
+    }
+    memcpy(&report, data.data(), sizeof(report));
+    if (data.size() != sizeof(report) + report.count * sizeof(channel_status)) {
+        std::cerr << "Invalid status size " << data.size() << std::endl;
+        return;
     }
 
-    if (EVP_PKEY_sign_init(ctx.get()) <= 0) {
-        std::cerr << "EVP_PKEY_sign_init failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
-        return {};
+    std::cout << "running 0x" << std::hex << report.running << std::dec
+              << ", queued " << (unsigned) report.queued << std::endl;
+    for (size_t i = 0; i < report.count; i++) {
+        channel_status channel;
+        memcpy(&channel, &data[sizeof(report) + i * sizeof(channel)], sizeof(channel));
+        std::cout << "pin " << (unsigned) channel.pin;
+        if (report.running & (1u << channel.pin)) {
+            std::cout << " on " << channel.elapsed << "ms, " << channel.remaining << "ms left, id " << channel.id;
+        }
+        std::cout << ", queued " << (unsigned) channel.queued << std::endl;
     }
+}
 
-    if (EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_md5()) <= 0) {
-        std::cerr << "EVP_PKEY_CTX_set_signature_md failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
-        return {};
+void print_stop(const std::vector<uint8_t> &data) {
+    stop_report report;
+    if (data.size() < sizeof(report)) {
+        std::cerr << "Invalid stop report size " << data.size() << std::endl;
+        return;
+    }
+    memcpy(&report, data.data(), sizeof(report));
+    if (data.size() != sizeof(report) + report.count * sizeof(stop_result)) {
+        std::cerr << "Invalid stop report size " << data.size() << std::endl;
+        return;
     }
 
-    size_t siglen = 0;
-    if (EVP_PKEY_sign(ctx.get(), nullptr, &siglen, data.data(), data.size()) <= 0) {
-        std::cerr << "EVP_PKEY_sign (get length) failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
-        return {};
+    std::cout << "cancelled " << (unsigned) report.cancelled << " queued" << std::endl;
+    for (size_t i = 0; i < report.count; i++) {
+        stop_result result;
+        memcpy(&result, &data[sizeof(report) + i * sizeof(result)], sizeof(result));
+        std::cout << "pin " << (unsigned) result.pin << " id " << result.id
+                  << " on " << result.elapsed << "ms, dispensed " << format_volume(result.volume) << std::endl;
     }
+}
 
-    std::vector<uint8_t> signature(siglen);
-    if (EVP_PKEY_sign(ctx.get(), signature.data(), &siglen, data.data(), data.size()) <= 0) {
-        std::cerr << "EVP_PKEY_sign failed: "
-                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+/* Sample the device verifies: MD5 of fixed bytes and its signature */
+std::vector<uint8_t> make_benchmark_request(std::shared_ptr<EVP_PKEY> pkey) {
+    std::vector<uint8_t> md5 = compute_md5(std::vector<uint8_t>(64, 0x5A));
+    std::vector<uint8_t> signature = sign(pkey, md5);
+    if (md5.size() != sizeof(benchmark_request::md5) || signature.empty()) {
         return {};
     }
+    md5.insert(md5.end(), signature.begin(), signature.end());
+    return md5;
+}
+
+void print_benchmark(const std::vector<uint8_t> &data) {
+    static const char *names[] = {"md5", "verify", "storage read", "output write"};
+    benchmark_report report;
+    if (data.size() < sizeof(report)) {
+        std::cerr << "Invalid benchmark size " << data.size() << std::endl;
+        return;
+    }
+    memcpy(&report, data.data(), sizeof(report));
+    if (data.size() != sizeof(report) + report.count * sizeof(benchmark_result) || report.cpu_mhz == 0) {
+        std::cerr << "Invalid benchmark size " << data.size() << std::endl;
+        return;
+    }
 
-    return signature;
+    std::cout << report.iterations << " runs at " << report.cpu_mhz << "MHz, cycles min/median/max" << std::endl;
+    for (size_t i = 0; i < report.count; i++) {
+        benchmark_result result;
+        memcpy(&result, &data[sizeof(report) + i * sizeof(result)], sizeof(result));
+        std::cout << (result.primitive < std::size(names) ? names[result.primitive] : "unknown") << ": "
+                  << result.min << "/" << result.median << "/" << result.max
+                  << " (" << std::fixed << std::setprecision(1) << (double) result.median / report.cpu_mhz << "us)" << std::endl;
+    }
 }
 
-std::vector<uint8_t> send_tcp_and_receive(const std::vector<uint8_t> &buf,
-                                          uint32_t host,
-                                          uint16_t port) {
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) {
-        perror("socket");
-        return {};
+/* Sends the command to every device with one Merkle root signature */
+int broadcast(const std::vector<uint32_t> &ips, uint16_t port, const payload &command, const std::vector<uint8_t> &body,
+              std::shared_ptr<EVP_PKEY> pkey, std::shared_ptr<capture_writer> capture) {
+    std::vector<payload> data(ips.size(), command);
+    std::vector<std::vector<uint8_t>> bodies(ips.size(), body);
+    std::vector<std::vector<uint8_t>> packets = build_merkle_payloads(data, bodies, ips, pkey);
+    if (packets.empty()) {
+        std::cerr << "Failed to build payloads" << std::endl;
+        return 3;
     }
 
-    sockaddr_in serv_addr = {0};
+    size_t failed = 0;
+    for (size_t i = 0; i < ips.size(); i++) {
+        device_connection connection;
+        response header;
+        std::vector<uint8_t> response;
+        connection.set_capture(capture);
+        connection.set_verbose(false);
+        if (!connection.connect(ips[i], port) ||
+            connection.transact(packets[i], header, response) != device_connection::result::ok) {
+            std::cout << ips[i] << ": TCP send/receive error" << std::endl;
+            failed++;
+            continue;
+        }
+        std::cout << ips[i] << ": status " << (unsigned) header.status << " " << to_hex(response) << std::endl;
+        failed += header.status != STATUS_OK;
+    }
+    std::cout << ips.size() - failed << " of " << ips.size() << " devices accepted" << std::endl;
+    return failed == 0 ? 0 : 5;
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr.s_addr = host;
+/* Command specific response data */
+void print_reply(const payload &data, const std::vector<uint8_t> &response) {
+    if (data.command == CMD_SCHEDULE_GET) {
+        print_schedule(response);
+    }
 
-    if (connect(s, (sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        std::cerr << "connect" << std::endl;
-        close(s);
-        return {};
+    if (data.command == CMD_STATUS) {
+        print_status(response);
     }
 
-    if (send(s, buf.data(), buf.size(), 0) != buf.size()) {
-        std::cerr << "send" << std::endl;
-        close(s);
-        return {};
+    if (data.command == CMD_PUMP_STOP) {
+        print_stop(response);
     }
 
-    std::vector<uint8_t> resp(256);
-    ssize_t received = recv(s, resp.data(), resp.size(), 0);
-    if (received < 0) {
-        std::cerr << "recv" << std::endl;
-        close(s);
-        return {};
+    if (data.command == CMD_BENCHMARK) {
+        print_benchmark(response);
     }
-    resp.resize(static_cast<size_t>(received));
-    close(s);
-    return resp;
-}
 
-std::string to_hex(const std::vector<uint8_t> &data) {
-    static const char hex_chars[] = "0123456789abcdef";
-    std::string out;
-    out.reserve(data.size() * 2);
-    for (uint8_t b: data) {
-        out.push_back(hex_chars[b >> 4]);
-        out.push_back(hex_chars[b & 0xF]);
+    if (data.command == CMD_PUMP_WORK_GROUP && response.size() == sizeof(group_result)) {
+        group_result result;
+        memcpy(&result, response.data(), sizeof(result));
+        std::cout << "start skew: " << result.skew_ns << "ns" << std::endl;
     }
-    return out;
 }
 
-class openssl_scope {
-public:
-    openssl_scope() { OPENSSL_init(); }
-    ~openssl_scope() { OPENSSL_cleanup(); }
-};
+void print_event(const pump_event &event) {
+    static const char *kinds[] = {"finished", "aborted", "gpio error"};
+    std::cout << "event: pin " << (unsigned) event.pin << " "
+              << (event.kind < std::size(kinds) ? kinds[event.kind] : "unknown")
+              << " after " << event.elapsed << "ms, queued " << event.waited << "ms" << std::endl;
+}
 
-std::vector<uint8_t> build_packet(const payload &data) {
-    std::vector<uint8_t> res;
-    res.resize(sizeof(payload));
-    memcpy(res.data(), static_cast<const void *>(&data), sizeof(payload));
-    return res;
+/* Device of a MQTT_TOPIC_PREFIX "<device>/<leaf>" topic, empty if it is another one */
+static std::string topic_device(const std::string &topic, const std::string &leaf) {
+    std::string prefix = MQTT_TOPIC_PREFIX, suffix = "/" + leaf;
+    if (topic.size() <= prefix.size() + suffix.size() || topic.compare(0, prefix.size(), prefix) != 0 ||
+        topic.compare(topic.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return {};
+    }
+    return topic.substr(prefix.size(), topic.size() - prefix.size() - suffix.size());
 }
 
-std::vector<uint8_t> build_payload(payload &data, std::shared_ptr<EVP_PKEY> pkey) {
-    data.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+/* Publishes the command through the broker at `ip`:`port` to devices or to
+ * group/<name>. Every device of a group that acks within MQTT_ACK_WAIT_MS
+ * counts, listed devices are waited for until all of them ack */
+int publish_mqtt(uint32_t ip, uint16_t port, const std::string &targets, payload &data, const std::vector<uint8_t> &body,
+                 std::shared_ptr<EVP_PKEY> pkey, size_t events) {
+    std::vector<std::string> devices;
+    std::istringstream list(targets);
+    for (std::string item; std::getline(list, item, ',');) {
+        devices.push_back(item);
+    }
+    bool group = devices.size() == 1 && devices[0].compare(0, 6, "group/") == 0;
+
+    mqtt_connection connection;
+    std::ostringstream client_id;
+    client_id << "washer-client-" << std::hex << make_command_id();
+    if (!connection.connect(ip, port, client_id.str())) {
+        return 4;
+    }
+    for (const std::string &device: group ? std::vector<std::string>{"+"} : devices) {
+        if (!connection.subscribe(MQTT_TOPIC_PREFIX + device + "/ack") ||
+            (events != 0 && !connection.subscribe(MQTT_TOPIC_PREFIX + device + "/event"))) {
+            std::cerr << "MQTT subscribe error" << std::endl;
+            return 4;
+        }
+    }
 
-    std::vector<uint8_t> packet = build_packet(data);
+    // Devices do not check who a packet was for, one signature serves all
+    std::vector<uint8_t> packet = build_payload(data, body, pkey);
     if (packet.empty()) {
-        std::cerr << "Failed to build packet" << std::endl;
-        return {};
+        std::cerr << "Failed to build payload" << std::endl;
+        return 3;
+    }
+    for (const std::string &device: devices) {
+        if (!connection.publish(MQTT_TOPIC_PREFIX + device + "/command", packet)) {
+            std::cerr << "MQTT publish error" << std::endl;
+            return 4;
+        }
     }
 
-    std::cout << "packet:" << std::endl
-              << to_hex(packet) << std::endl;
+    // Device to events it still owes, only accepted commands send them
+    std::map<std::string, size_t> waiting;
+    // Events of short doses come in while acks are still awaited
+    std::deque<std::pair<std::string, pump_event>> early;
+    size_t acked = 0, failed = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(MQTT_ACK_WAIT_MS);
+    while (group || acked < devices.size()) {
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        mqtt_message message;
+        if (left <= 0 || !connection.wait_message(message, left)) {
+            break;
+        }
+
+        std::string device = topic_device(message.topic, "ack");
+        mqtt_ack ack;
+        response header;
+        if (device.empty()) {
+            pump_event event;
+            device = topic_device(message.topic, "event");
+            if (!device.empty() && message.data.size() == sizeof(event)) {
+                memcpy(&event, message.data.data(), sizeof(event));
+                early.emplace_back(device, event);
+            }
+            continue;
+        }
+        if (message.data.size() < sizeof(ack) + sizeof(header)) {
+            continue;
+        }
+        memcpy(&ack, message.data.data(), sizeof(ack));
+        memcpy(&header, message.data.data() + sizeof(ack), sizeof(header));
+        if (ack.timestamp != data.timestamp || message.data.size() != sizeof(ack) + sizeof(header) + header.size) {
+            continue;
+        }
+
+        std::vector<uint8_t> response(message.data.begin() + sizeof(ack) + sizeof(header), message.data.end());
+        std::cout << device << ": status " << (unsigned) header.status << " " << to_hex(response) << std::endl;
+        print_reply(data, response);
+        acked++;
+        if (header.status != STATUS_OK) {
+            failed++;
+        } else if (events != 0) {
+            waiting[device] = events;
+        }
+    }
+    if (group) {
+        std::cout << acked - failed << " of " << acked << " devices accepted" << std::endl;
+    } else if (acked < devices.size()) {
+        std::cerr << devices.size() - acked << " devices did not ack" << std::endl;
+        failed += devices.size() - acked;
+    }
 
-    auto md5 = compute_md5(packet);
-    std::cout << "md5:" << to_hex(md5) << std::endl;
+    bool finished = true;
+    size_t owed = 0;
+    for (const auto &item: waiting) {
+        owed += item.second;
+    }
+    deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(EVENT_WAIT_MS);
+    while (owed > 0) {
+        pump_event event;
+        std::string device;
+        if (!early.empty()) {
+            device = early.front().first;
+            event = early.front().second;
+            early.pop_front();
+        } else {
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            mqtt_message message;
+            if (left <= 0 || !connection.wait_message(message, left)) {
+                std::cerr << "No completion event" << std::endl;
+                return 6;
+            }
+            device = topic_device(message.topic, "event");
+            if (device.empty() || message.data.size() != sizeof(event)) {
+                continue;
+            }
+            memcpy(&event, message.data.data(), sizeof(event));
+        }
+        if (event.id != data.id) {
+            continue;
+        }
+        auto found = waiting.find(device);
+        if (found == waiting.end() || found->second == 0) {
+            continue;
+        }
+        found->second--;
+        owed--;
+        std::cout << found->first << " ";
+        print_event(event);
+        finished = finished && event.kind == EVENT_FINISHED;
+    }
 
-    std::vector<uint8_t> signature = sign(pkey, md5);
-    if (signature.empty()) {
-        std::cerr << "payload sign error" << std::endl;
-        return {};
+    return failed != 0 || acked == 0 ? 5 : finished ? 0 : 5;
+}
+
+/* execute_at from Unix milliseconds, or milliseconds from now with a leading + */
+uint64_t parse_execute_at(const std::string &text) {
+    if (!text.empty() && text[0] == '+') {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return std::chrono::duration_cast<std::chrono::microseconds>(now).count() + std::stoull(text.substr(1)) * 1000;
     }
+    return std::stoull(text) * 1000;
+}
 
-    std::cout << "signature :" << to_hex(signature) << std::endl;
+/* Time range: <from>[:<to>] in unix seconds, `to` 0 or missing is open */
+bool parse_history(const std::string &text, history_request &request) {
+    size_t colon = text.find(':');
+    request.from = std::stoul(text.substr(0, colon), nullptr, 0);
+    request.to = colon == std::string::npos ? 0 : std::stoul(text.substr(colon + 1), nullptr, 0);
+    request.seq = 0;
+    return request.to == 0 || request.from < request.to;
+}
 
-    packet.insert(packet.end(), signature.begin(), signature.end());
-    std::cout << "payload:" << std::endl
-              << to_hex(packet) << std::endl;
-    return packet;
+/* Pages through the journal on one connection, printing records as they
+ * come. One RSA signed session open, every page is HMAC authenticated */
+int fetch_history(device_connection &connection, std::shared_ptr<EVP_PKEY> pkey, history_request request) {
+    device_session session;
+    if (!open_session(connection, pkey, session, false)) {
+        std::cerr << "Failed to open session" << std::endl;
+        return 4;
+    }
+
+    static const char *results[] = {"done", "failed"};
+    size_t total = 0;
+    std::string line;
+    while (true) {
+        payload data = {};
+        data.command = CMD_HISTORY;
+        std::vector<uint8_t> body(sizeof(request));
+        memcpy(body.data(), &request, sizeof(request));
+
+        response header = {};
+        std::vector<uint8_t> page_data;
+        if (connection.transact(build_session_payload(data, body, session), header, page_data) != device_connection::result::ok) {
+            std::cerr << "TCP send/receive error" << std::endl;
+            return 4;
+        }
+        if (header.status != STATUS_OK || page_data.size() < sizeof(history_page) ||
+            (page_data.size() - sizeof(history_page)) % sizeof(dose_record) != 0) {
+            std::cerr << "History failed, status " << (unsigned) header.status << std::endl;
+            return 5;
+        }
+
+        history_page page;
+        memcpy(&page, page_data.data(), sizeof(page));
+        std::ostringstream out;
+        for (size_t offset = sizeof(page); offset < page_data.size(); offset += sizeof(dose_record)) {
+            dose_record record;
+            memcpy(&record, &page_data[offset], sizeof(record));
+            out << record.seq << " " << record.time << " " << (unsigned) record.pin
+                << " " << (record.result < std::size(results) ? results[record.result] : "unknown")
+                << " " << record.requested << " " << record.actual << "\n";
+            total++;
+        }
+        std::cout << out.str() << std::flush;
+
+        if (!page.more) {
+            break;
+        }
+        request.seq = page.next_seq;
+    }
+    std::cerr << total << " records" << std::endl;
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     openssl_scope scope_guard;
+
+    // Options may come anywhere, the rest is positional
+    std::shared_ptr<capture_writer> capture;
+    uint64_t execute_at = 0;
+    std::string mqtt_targets;
+    std::vector<char *> args;
+    for (int i = 0; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--capture" && i + 1 < argc) {
+            capture = std::make_shared<capture_writer>();
+            if (!capture->open(argv[++i])) {
+                return 1;
+            }
+            continue;
+        }
+        if (option == "--at" && i + 1 < argc) {
+            execute_at = parse_execute_at(argv[++i]);
+            continue;
+        }
+        if (option == "--mqtt" && i + 1 < argc) {
+            mqtt_targets = argv[++i];
+            continue;
+        }
+        args.push_back(argv[i]);
+    }
+    argc = args.size();
+    argv = args.data();
+
     if (argc < 8) {
-        std::cerr << "Usage: " << argv[0] << " <path_to_rsa_key.pem> <IP> <PORT> <command> <pin> <voulme> <time>" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <path_to_rsa_key.pem> <IP>[,<IP>...] <PORT> <command> <pin> <voulme> <time> [schedule_file|calibration_points|group_steps|from:to|budget|flow_sensor] [--capture <file>] [--at <unix ms>|+<ms>]" << std::endl
+                  << "    [--mqtt <device>[,<device>...]|group/<name>], IP and PORT are then the broker" << std::endl;
         return 1;
     }
     std::string key_path = argv[1];
-    uint32_t ip = std::stoul(argv[2], nullptr, 0);
+    // Several IPs share one signature, see broadcast
+    std::vector<uint32_t> ips;
+    std::istringstream ip_list(argv[2]);
+    for (std::string item; std::getline(ip_list, item, ',');) {
+        ips.push_back(std::stoul(item, nullptr, 0));
+    }
+    uint32_t ip = ips.at(0);
     uint16_t port = std::stoul(argv[3], nullptr, 0);
 
-    payload data;
+    payload data = {};
     data.command = std::stoul(argv[4], nullptr, 0);
     data.pin = std::stoul(argv[5], nullptr, 0);
-    data.volume = std::stod(argv[6]);
+    data.volume = parse_volume(argv[6]);
     data.time = std::stoul(argv[7], nullptr, 0);
+    data.execute_at = execute_at;
+
+    std::vector<uint8_t> body;
+    if (data.command == CMD_SCHEDULE_SET || data.command == CMD_PUMP_CALLIBRATE || data.command == CMD_PUMP_WORK_GROUP ||
+        data.command == CMD_POWER_SET || data.command == CMD_FLOW_SET) {
+        if (argc < 9) {
+            std::cerr << "Schedule file, calibration points, group steps, power budget or flow sensor are required" << std::endl;
+            return 1;
+        }
+        switch (data.command) {
+            case CMD_SCHEDULE_SET:
+                body = load_schedule(argv[8]);
+                break;
+            case CMD_PUMP_CALLIBRATE:
+                body = parse_calibration(argv[8]);
+                break;
+            case CMD_PUMP_WORK_GROUP:
+                body = parse_group(argv[8]);
+                break;
+            case CMD_POWER_SET:
+                body = parse_power(argv[8]);
+                break;
+            case CMD_FLOW_SET:
+                body = parse_flow(argv[8]);
+                break;
+        }
+        if (body.empty()) {
+            return 1;
+        }
+    }
 
     std::cout << "ip: " << ip << std::endl;
     std::cout << "port: " << port << std::endl;
@@ -233,24 +682,88 @@ int main(int argc, char *argv[]) {
         return 2;
     }
 
-    std::vector<uint8_t> payload = build_payload(data, pkey);
+    // Doses report when their channels stop
+    size_t events = 0;
+    if (data.command == CMD_PUMP_WORK_VOLUME || data.command == CMD_PUMP_WORK_TIME) {
+        events = 1;
+    } else if (data.command == CMD_PUMP_WORK_GROUP) {
+        events = body.size() / sizeof(group_step);
+    }
+    if (events != 0) {
+        data.id = make_command_id();
+    }
+
+    if (data.command == CMD_BENCHMARK) {
+        body = make_benchmark_request(pkey);
+        if (body.empty()) {
+            std::cerr << "Failed to sign benchmark sample" << std::endl;
+            return 3;
+        }
+    }
+
+    if (!mqtt_targets.empty()) {
+        return publish_mqtt(ip, port, mqtt_targets, data, body, pkey, events);
+    }
+
+    if (ips.size() > 1) {
+        return broadcast(ips, port, data, body, pkey, capture);
+    }
+
+    if (data.command == CMD_HISTORY) {
+        history_request request = {};
+        if (argc > 8 && !parse_history(argv[8], request)) {
+            std::cerr << "Invalid time range " << argv[8] << std::endl;
+            return 1;
+        }
+        device_connection connection;
+        connection.set_capture(capture);
+        if (!connection.connect(ip, port)) {
+            std::cerr << "TCP connect error" << std::endl;
+            return 4;
+        }
+        return fetch_history(connection, pkey, request);
+    }
+
+    std::vector<uint8_t> payload = build_payload(data, body, pkey);
 
     if (payload.empty()) {
         std::cerr << "Failed to build payload" << std::endl;
         return 3;
     }
 
-    std::vector<uint8_t> response = send_tcp_and_receive(payload, ip, port);
-    if (response.empty()) {
+    device_connection connection;
+    response header;
+    std::vector<uint8_t> response;
+    connection.set_capture(capture);
+    if (!connection.connect(ip, port) ||
+        connection.transact(payload, header, response) != device_connection::result::ok) {
         std::cerr << "TCP send/receive error" << std::endl;
         return 4;
     }
 
-    std::cout << to_hex(response) << std::endl;
-    if (response[0] != 0) {
+    std::cout << "status: " << (unsigned) header.status << std::endl
+              << to_hex(response) << std::endl;
+    if (header.status != STATUS_OK) {
         std::cerr << "recv error code" << std::endl;
         return 5;
     }
 
-    return 0;
+    print_reply(data, response);
+
+    bool finished = true;
+    while (events > 0) {
+        pump_event event;
+        if (!connection.wait_event(event, EVENT_WAIT_MS)) {
+            std::cerr << "No completion event" << std::endl;
+            return 6;
+        }
+        if (event.id != data.id) {
+            continue;
+        }
+        events--;
+        print_event(event);
+        finished = finished && event.kind == EVENT_FINISHED;
+    }
+
+    return finished ? 0 : 5;
 }
\ No newline at end of file
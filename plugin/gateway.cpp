@@ -0,0 +1,647 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : gateway.cpp
+ * PURPOSE     : HTTP gateway daemon
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* REST API:
+ *   POST /devices/<ip>[:<port>]/commands?command=&pin=&volume=&time=[&priority=][&wait=0]
+ *        Idempotency-Key header (or `key` parameter) makes retries safe,
+ *        a repeated key returns the original command instead of a new one
+ *   GET  /commands/<key>
+ *   GET  /metrics
+ *
+ * Every device has its own worker with a priority queue and a kept-alive
+ * connection. Queued pump commands are coalesced into one CMD_BATCH.
+ * Packets are authenticated with a session key, opened with one RSA
+ * signed packet, and fall back to RSA signatures when it fails.
+ *
+ * Every packet carries a command id. A lost reply is retried with the
+ * same id and a short, doubling timeout, the device answers a repeated
+ * id with the first result instead of running it again.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "protocol.h"
+
+using gateway_clock = std::chrono::steady_clock;
+
+#define DEVICE_PORT 30239
+
+/* Device drops idle connections after 30s */
+#define CONNECTION_IDLE_LIMIT std::chrono::seconds(20)
+
+#define BATCH_MAX_DATA 1024
+
+#define WAIT_TIMEOUT std::chrono::seconds(30)
+
+/* Attempts of a packet, the first waits RETRY_TIMEOUT_MS for the reply
+ * and every next one twice as long */
+#define RETRY_ATTEMPTS   4
+#define RETRY_TIMEOUT_MS 300
+
+#define STATES_MAX 4096
+
+#define LATENCY_SAMPLES 1024
+
+#define HTTP_MAX_REQUEST 8192
+
+#define KEY_MAX 128
+
+struct command_state {
+    std::string key;
+    bool done = false;
+    uint8_t status = 0;
+    std::string error;
+    std::vector<uint8_t> data;
+    gateway_clock::time_point queued, sent, finished;
+};
+
+struct queued_command {
+    int priority;
+    uint64_t seq;
+    batch_item item;
+    std::vector<uint8_t> body;
+    std::shared_ptr<command_state> state;
+};
+
+struct queue_order {
+    bool operator()(const queued_command &a, const queued_command &b) const {
+        return a.priority != b.priority ? a.priority < b.priority : a.seq > b.seq;
+    }
+};
+
+/* Idempotency keys of recent commands */
+static std::mutex states_lock;
+static std::condition_variable states_changed;
+static std::map<std::string, std::shared_ptr<command_state>> states;
+static std::deque<std::string> states_order;
+
+static std::atomic<uint64_t> command_seq{0};
+
+static void complete(const std::shared_ptr<command_state> &state, uint8_t status,
+                     const std::string &error, std::vector<uint8_t> data = {}) {
+    std::lock_guard<std::mutex> guard(states_lock);
+    state->done = true;
+    state->status = status;
+    state->error = error;
+    state->data = std::move(data);
+    state->finished = gateway_clock::now();
+    states_changed.notify_all();
+}
+
+/* Last LATENCY_SAMPLES values, microseconds */
+class latency_window {
+public:
+    void add(int64_t value) {
+        if (samples.size() < LATENCY_SAMPLES) {
+            samples.push_back(value);
+        } else {
+            samples[next] = value;
+        }
+        next = (next + 1) % LATENCY_SAMPLES;
+    }
+
+    std::string json() const {
+        std::vector<int64_t> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+        auto at = [&sorted](double q) -> int64_t {
+            return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+        };
+        std::ostringstream out;
+        out << "{\"p50\":" << at(0.5) << ",\"p99\":" << at(0.99)
+            << ",\"max\":" << (sorted.empty() ? 0 : sorted.back()) << "}";
+        return out.str();
+    }
+
+private:
+    std::vector<int64_t> samples;
+    size_t next = 0;
+};
+
+class device_worker {
+public:
+    device_worker(uint32_t host, uint16_t port, std::shared_ptr<EVP_PKEY> pkey)
+        : host(host), port(port), pkey(pkey) {
+        connection.set_verbose(false);
+        // Started last, run() uses everything above
+        thread = std::thread(&device_worker::run, this);
+        thread.detach();
+    }
+
+    void push(queued_command command) {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push(std::move(command));
+        changed.notify_one();
+    }
+
+    std::string metrics_json() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::ostringstream out;
+        out << "{\"queue_depth\":" << queue.size()
+            << ",\"commands\":" << commands
+            << ",\"packets\":" << packets
+            << ",\"coalesced\":" << coalesced
+            << ",\"failures\":" << failures
+            << ",\"reconnects\":" << reconnects
+            << ",\"retries\":" << retries
+            << ",\"sessions\":" << sessions
+            << ",\"latency_us\":" << latency.json()
+            << ",\"queue_wait_us\":" << queue_wait.json() << "}";
+        return out.str();
+    }
+
+private:
+    static bool batchable(uint8_t command) {
+        return command == CMD_PUMP_WORK_VOLUME || command == CMD_PUMP_WORK_TIME;
+    }
+
+    /* Takes the top command and batchable ones following it */
+    std::vector<queued_command> take() {
+        std::vector<queued_command> batch;
+        size_t data_size = 0;
+
+        batch.push_back(queue.top());
+        queue.pop();
+        while (batchable(batch.front().item.command) && !queue.empty() &&
+               batchable(queue.top().item.command) && batch.size() < BATCH_MAX_ITEMS &&
+               data_size + sizeof(batch_item) <= BATCH_MAX_DATA) {
+            batch.push_back(queue.top());
+            queue.pop();
+            data_size += sizeof(batch_item);
+        }
+        return batch;
+    }
+
+    void run() {
+        while (true) {
+            std::vector<queued_command> batch;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (!changed.wait_for(guard, CONNECTION_IDLE_LIMIT, [this] { return !queue.empty(); })) {
+                    connection.disconnect();
+                    continue;
+                }
+                batch = take();
+            }
+            send(batch);
+        }
+    }
+
+    bool ensure_session() {
+        if (session.valid()) {
+            return true;
+        }
+        if (!connection.connected() && !connection.connect(host, port, timeout_ms)) {
+            return false;
+        }
+        if (!open_session(connection, pkey, session, false)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        sessions++;
+        return true;
+    }
+
+    std::vector<uint8_t> build(const std::vector<queued_command> &batch, uint32_t id) {
+        payload data = {};
+        std::vector<uint8_t> body;
+
+        data.id = id;
+        if (batch.size() == 1) {
+            const batch_item &item = batch.front().item;
+            data.command = item.command;
+            data.pin = item.pin;
+            data.volume = item.volume;
+            data.time = item.time;
+            body = batch.front().body;
+        } else {
+            data.command = CMD_BATCH;
+            for (const queued_command &command: batch) {
+                const uint8_t *raw = reinterpret_cast<const uint8_t *>(&command.item);
+                body.insert(body.end(), raw, raw + sizeof(command.item));
+                body.insert(body.end(), command.body.begin(), command.body.end());
+            }
+        }
+        if (ensure_session()) {
+            return build_session_payload(data, body, session);
+        }
+        return build_payload(data, body, pkey, false);
+    }
+
+    device_connection::result transact(const std::vector<uint8_t> &packet, response &header, std::vector<uint8_t> &data) {
+        bool warm = connection.connected();
+        if (!warm && !connection.connect(host, port, timeout_ms)) {
+            return device_connection::result::send_failed;
+        }
+
+        device_connection::result res = connection.transact(packet, header, data);
+        if (warm && (res == device_connection::result::send_failed || res == device_connection::result::closed)) {
+            // Stale kept-alive connection, the packet never reached the device
+            std::lock_guard<std::mutex> guard(lock);
+            reconnects++;
+        } else {
+            return res;
+        }
+
+        if (!connection.connect(host, port, timeout_ms)) {
+            return device_connection::result::send_failed;
+        }
+        return connection.transact(packet, header, data);
+    }
+
+    /* One signed attempt of the packet with command `id` */
+    device_connection::result attempt(const std::vector<queued_command> &batch, uint32_t id,
+                                      response &header, std::vector<uint8_t> &data) {
+        connection.set_timeout(timeout_ms);
+        std::vector<uint8_t> packet = build(batch, id);
+        device_connection::result res = packet.empty() ? device_connection::result::send_failed
+                                                       : transact(packet, header, data);
+        if (res == device_connection::result::ok && header.status == STATUS_DENIED && session.valid()) {
+            // Device lost the session (reboot), denied packets never run
+            session = {};
+            connection.disconnect();
+            packet = build(batch, id);
+            res = packet.empty() ? device_connection::result::send_failed
+                                 : transact(packet, header, data);
+        }
+        return res;
+    }
+
+    void send(std::vector<queued_command> &batch) {
+        gateway_clock::time_point sent = gateway_clock::now();
+        for (queued_command &command: batch) {
+            command.state->sent = sent;
+        }
+
+        response header = {};
+        std::vector<uint8_t> data;
+        device_connection::result res = device_connection::result::send_failed;
+        uint32_t id = make_command_id();
+        for (int i = 0; i < RETRY_ATTEMPTS && res != device_connection::result::ok; i++) {
+            if (i != 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                retries++;
+            }
+            timeout_ms = RETRY_TIMEOUT_MS << i;
+            res = attempt(batch, id, header, data);
+        }
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (res != device_connection::result::ok) {
+                complete(batch[i].state, STATUS_FAILED, "device unreachable");
+            } else if (batch.size() == 1) {
+                complete(batch[i].state, header.status, "", data);
+            } else if (header.status == STATUS_DENIED || i >= data.size()) {
+                complete(batch[i].state, header.status, "batch rejected");
+            } else {
+                complete(batch[i].state, data[i], "");
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        packets++;
+        commands += batch.size();
+        coalesced += batch.size() - 1;
+        if (res != device_connection::result::ok || header.status != STATUS_OK) {
+            failures++;
+        }
+        gateway_clock::time_point now = gateway_clock::now();
+        for (const queued_command &command: batch) {
+            latency.add(std::chrono::duration_cast<std::chrono::microseconds>(now - command.state->queued).count());
+            queue_wait.add(std::chrono::duration_cast<std::chrono::microseconds>(sent - command.state->queued).count());
+        }
+    }
+
+    uint32_t host;
+    uint16_t port;
+    std::shared_ptr<EVP_PKEY> pkey;
+    device_connection connection;
+    device_session session;
+    int timeout_ms = RETRY_TIMEOUT_MS;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::priority_queue<queued_command, std::vector<queued_command>, queue_order> queue;
+
+    uint64_t commands = 0, packets = 0, coalesced = 0, failures = 0, reconnects = 0, retries = 0, sessions = 0;
+    latency_window latency, queue_wait;
+
+    std::thread thread;
+};
+
+static std::shared_ptr<EVP_PKEY> gateway_key;
+
+static std::mutex workers_lock;
+static std::map<std::string, std::unique_ptr<device_worker>> workers;
+
+static device_worker *worker_for(const std::string &device, uint32_t host, uint16_t port) {
+    std::lock_guard<std::mutex> guard(workers_lock);
+    std::unique_ptr<device_worker> &worker = workers[device];
+    if (!worker) {
+        worker = std::make_unique<device_worker>(host, port, gateway_key);
+    }
+    return worker.get();
+}
+
+struct http_request {
+    std::string method;
+    std::string path;
+    std::map<std::string, std::string> params;
+    std::map<std::string, std::string> headers;
+};
+
+static std::string url_decode(const std::string &text) {
+    std::string out;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (text[i] == '%' && i + 2 < text.size()) {
+            out.push_back(static_cast<char>(std::stoi(text.substr(i + 1, 2), nullptr, 16)));
+            i += 2;
+        } else {
+            out.push_back(text[i] == '+' ? ' ' : text[i]);
+        }
+    }
+    return out;
+}
+
+static void parse_params(const std::string &text, std::map<std::string, std::string> &params) {
+    std::istringstream in(text);
+    std::string pair;
+    while (std::getline(in, pair, '&')) {
+        size_t eq = pair.find('=');
+        if (eq != std::string::npos) {
+            params[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+        }
+    }
+}
+
+static bool http_read(int s, http_request &request) {
+    std::string raw;
+    char chunk[1024];
+    size_t end;
+    while ((end = raw.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t received = recv(s, chunk, sizeof(chunk), 0);
+        if (received <= 0 || raw.size() > HTTP_MAX_REQUEST) {
+            return false;
+        }
+        raw.append(chunk, received);
+    }
+
+    std::istringstream lines(raw.substr(0, end));
+    std::string line, target;
+    std::getline(lines, line);
+    std::istringstream(line) >> request.method >> target;
+    while (std::getline(lines, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        value.erase(value.find_last_not_of("\r ") + 1);
+        request.headers[name] = value;
+    }
+
+    size_t query = target.find('?');
+    request.path = target.substr(0, query);
+    if (query != std::string::npos) {
+        parse_params(target.substr(query + 1), request.params);
+    }
+
+    // Form encoded body parameters
+    size_t length = request.headers.count("content-length") ? std::stoul(request.headers["content-length"]) : 0;
+    std::string body = raw.substr(end + 4);
+    while (body.size() < length && body.size() < HTTP_MAX_REQUEST) {
+        ssize_t received = recv(s, chunk, sizeof(chunk), 0);
+        if (received <= 0) {
+            return false;
+        }
+        body.append(chunk, received);
+    }
+    parse_params(body, request.params);
+    return true;
+}
+
+static void http_write(int s, int code, const std::string &body) {
+    const char *reason = code == 200 ? "OK" : code == 202 ? "Accepted" : code == 400 ? "Bad Request"
+                                            : code == 404 ? "Not Found" : "Error";
+    std::ostringstream out;
+    out << "HTTP/1.1 " << code << " " << reason << "\r\n"
+        << "Content-Type: application/json\r\n"
+        << "Content-Length: " << body.size() << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << body;
+    std::string text = out.str();
+    send(s, text.data(), text.size(), MSG_NOSIGNAL);
+}
+
+static std::string error_json(const std::string &message) {
+    return "{\"error\":\"" + message + "\"}";
+}
+
+/* Keys go into JSON and URL paths as they are */
+static bool valid_key(const std::string &key) {
+    return key.size() <= KEY_MAX && std::all_of(key.begin(), key.end(), [](char c) {
+        return std::isalnum((unsigned char) c) || c == '_' || c == '-';
+    });
+}
+
+/* Must be called with states_lock held */
+static std::string state_json(const command_state &state) {
+    auto us = [](gateway_clock::time_point from, gateway_clock::time_point to) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    };
+    std::ostringstream out;
+    out << "{\"key\":\"" << state.key << "\",\"done\":" << (state.done ? "true" : "false");
+    if (state.done) {
+        out << ",\"status\":" << (unsigned) state.status
+            << ",\"error\":\"" << state.error << "\""
+            << ",\"queue_us\":" << us(state.queued, state.sent)
+            << ",\"latency_us\":" << us(state.queued, state.finished)
+            << ",\"data\":\"" << to_hex(state.data) << "\"";
+    }
+    out << "}";
+    return out.str();
+}
+
+static void handle_command(int s, const std::string &device, http_request &request) {
+    std::string host_text = device.substr(0, device.find(':'));
+    uint16_t port = device.find(':') == std::string::npos ? DEVICE_PORT : std::stoul(device.substr(device.find(':') + 1));
+    in_addr host;
+    if (inet_pton(AF_INET, host_text.c_str(), &host) != 1) {
+        http_write(s, 400, error_json("invalid device address"));
+        return;
+    }
+
+    queued_command command = {};
+    command.item.command = std::stoul(request.params["command"], nullptr, 0);
+    command.item.pin = request.params.count("pin") ? std::stoul(request.params["pin"], nullptr, 0) : 0;
+    try {
+        command.item.volume = request.params.count("volume") ? parse_volume(request.params["volume"]) : 0;
+    } catch (const std::exception &e) {
+        http_write(s, 400, error_json("volume must be digits[.digits] in range"));
+        return;
+    }
+    command.item.time = request.params.count("time") ? std::stoul(request.params["time"], nullptr, 0) : 0;
+    command.priority = request.params.count("priority") ? std::stoi(request.params["priority"]) : 0;
+    command.seq = command_seq++;
+
+    std::string key = request.headers.count("idempotency-key") ? request.headers["idempotency-key"] : request.params["key"];
+    if (key.empty()) {
+        key = "gw-" + std::to_string(command.seq);
+    }
+    if (!valid_key(key)) {
+        http_write(s, 400, error_json("idempotency key must be letters, digits, _ and -"));
+        return;
+    }
+
+    bool fresh = false;
+    {
+        std::lock_guard<std::mutex> guard(states_lock);
+        std::shared_ptr<command_state> &state = states[key];
+        if (!state) {
+            fresh = true;
+            state = std::make_shared<command_state>();
+            state->key = key;
+            state->queued = gateway_clock::now();
+            states_order.push_back(key);
+            // Oldest finished ones go, pending ones are kept wherever they are
+            for (auto old = states_order.begin(); states_order.size() > STATES_MAX && old != states_order.end();) {
+                if (states[*old]->done) {
+                    states.erase(*old);
+                    old = states_order.erase(old);
+                } else {
+                    ++old;
+                }
+            }
+        }
+        command.state = state;
+    }
+
+    if (fresh) {
+        worker_for(host_text + ":" + std::to_string(port), host.s_addr, port)->push(command);
+    }
+
+    std::unique_lock<std::mutex> guard(states_lock);
+    if (request.params["wait"] != "0") {
+        states_changed.wait_for(guard, WAIT_TIMEOUT, [&command] { return command.state->done; });
+    }
+    http_write(s, command.state->done ? 200 : 202, state_json(*command.state));
+}
+
+static void handle_metrics(int s) {
+    std::ostringstream out;
+    out << "{\"devices\":{";
+    {
+        std::lock_guard<std::mutex> guard(workers_lock);
+        bool first = true;
+        for (auto &[device, worker]: workers) {
+            out << (first ? "" : ",") << "\"" << device << "\":" << worker->metrics_json();
+            first = false;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(states_lock);
+        out << "},\"tracked_commands\":" << states.size() << "}";
+    }
+    http_write(s, 200, out.str());
+}
+
+static void handle_connection(int s) {
+    http_request request;
+    try {
+        if (!http_read(s, request)) {
+            close(s);
+            return;
+        }
+
+        const std::string devices = "/devices/", commands = "/commands";
+        if (request.method == "POST" && request.path.rfind(devices, 0) == 0 &&
+            request.path.size() > devices.size() + commands.size() &&
+            request.path.compare(request.path.size() - commands.size(), commands.size(), commands) == 0) {
+            handle_command(s, request.path.substr(devices.size(), request.path.size() - devices.size() - commands.size()), request);
+        } else if (request.method == "GET" && request.path.rfind(commands + "/", 0) == 0) {
+            std::lock_guard<std::mutex> guard(states_lock);
+            auto state = states.find(request.path.substr(commands.size() + 1));
+            if (state == states.end()) {
+                http_write(s, 404, error_json("unknown command key"));
+            } else {
+                http_write(s, 200, state_json(*state->second));
+            }
+        } else if (request.method == "GET" && request.path == "/metrics") {
+            handle_metrics(s);
+        } else {
+            http_write(s, 404, error_json("not found"));
+        }
+    } catch (const std::exception &e) {
+        http_write(s, 400, error_json("invalid parameters"));
+    }
+    close(s);
+}
+
+int main(int argc, char *argv[]) {
+    openssl_scope scope_guard;
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <path_to_rsa_key.pem> <listen_port>" << std::endl;
+        return 1;
+    }
+
+    gateway_key = std::shared_ptr<EVP_PKEY>(load_private_key(argv[1]), EVP_PKEY_free);
+    if (!gateway_key) {
+        std::cerr << "Failed to load private key" << std::endl;
+        return 2;
+    }
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(std::stoul(argv[2], nullptr, 0));
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(s, (sockaddr *) &addr, sizeof(addr)) < 0 || listen(s, 64) < 0) {
+        perror("bind");
+        return 3;
+    }
+    std::cout << "Listening on port " << argv[2] << std::endl;
+
+    while (true) {
+        int c = accept(s, nullptr, nullptr);
+        if (c < 0) {
+            perror("accept");
+            continue;
+        }
+        std::thread(handle_connection, c).detach();
+    }
+}
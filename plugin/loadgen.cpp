@@ -0,0 +1,387 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : loadgen.cpp
+ * PURPOSE     : Load generator and soak test tool
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Open-loop load: requests are due on a fixed (or Poisson) schedule no
+ * matter how fast the targets answer, latency is measured from the due
+ * time. A slow target therefore shows up as latency and queueing instead
+ * of silently lowering the offered rate (coordinated omission).
+ *
+ * Default command is CMD_SCHEDULE_GET, it never switches pumps.
+ * --session authenticates with a session key per connection instead
+ * of an RSA signature per packet. */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+using load_clock = std::chrono::steady_clock;
+
+#define DEVICE_PORT 30239
+
+/* Log-linear histogram: 2^HISTOGRAM_SUB_BITS buckets per power of two */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAGNITUDES 40
+
+class latency_histogram {
+public:
+    latency_histogram() : buckets(HISTOGRAM_MAGNITUDES << HISTOGRAM_SUB_BITS) {}
+
+    void record(int64_t us) {
+        uint64_t value = us < 0 ? 0 : us;
+        buckets[bucket(value)]++;
+        count++;
+        max = std::max(max, value);
+    }
+
+    /* Upper bound of the bucket holding quantile `q` */
+    uint64_t percentile(double q) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t) std::ceil(q * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return std::min(upper(i), max);
+            }
+        }
+        return max;
+    }
+
+    uint64_t total() const { return count; }
+    uint64_t maximum() const { return max; }
+
+private:
+    static size_t bucket(uint64_t value) {
+        const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+        if (value < sub) {
+            return value;
+        }
+        int magnitude = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS + 1;
+        size_t index = (magnitude << HISTOGRAM_SUB_BITS) + ((value >> (magnitude - 1)) - sub);
+        return std::min(index, (size_t) (HISTOGRAM_MAGNITUDES << HISTOGRAM_SUB_BITS) - 1);
+    }
+
+    static uint64_t upper(size_t index) {
+        const uint64_t sub = 1 << HISTOGRAM_SUB_BITS;
+        if (index < sub) {
+            return index;
+        }
+        uint64_t magnitude = index >> HISTOGRAM_SUB_BITS;
+        uint64_t offset = index & (sub - 1);
+        return ((sub + offset + 1) << (magnitude - 1)) - 1;
+    }
+
+    std::vector<uint64_t> buckets;
+    uint64_t count = 0;
+    uint64_t max = 0;
+};
+
+struct target {
+    std::string name;
+    uint32_t host;
+    uint16_t port;
+
+    /* Device rejects timestamps older than the last accepted one,
+     * so packets to one target are signed and sent in order */
+    std::mutex order;
+};
+
+struct request {
+    size_t target;
+    load_clock::time_point due;
+};
+
+struct load_options {
+    double rate = 10;
+    int concurrency = 1;
+    int duration = 60;
+    int interval = 10;
+    bool poisson = false;
+    bool session = false;
+    payload command = {};
+};
+
+/* Interval and whole run statistics */
+struct load_stats {
+    latency_histogram latency;
+    std::map<std::string, uint64_t> outcomes;
+};
+
+static std::mutex stats_lock;
+static load_stats interval_stats, total_stats;
+
+static std::mutex queue_lock;
+static std::condition_variable queue_changed;
+static std::deque<request> pending;
+static bool finished = false;
+
+static void record(const std::string &outcome, int64_t latency_us) {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    for (load_stats *stats: {&interval_stats, &total_stats}) {
+        stats->latency.record(latency_us);
+        stats->outcomes[outcome]++;
+    }
+}
+
+static std::string outcome_name(device_connection::result res, uint8_t status) {
+    switch (res) {
+        case device_connection::result::ok:
+            break;
+        case device_connection::result::send_failed:
+            return "send_failed";
+        case device_connection::result::closed:
+            return "closed";
+        case device_connection::result::recv_failed:
+            return "recv_failed";
+    }
+    switch (status) {
+        case STATUS_OK:
+            return "ok";
+        case STATUS_FAILED:
+            return "failed";
+        case STATUS_BUSY:
+            return "busy";
+        case STATUS_DENIED:
+            return "denied";
+    }
+    std::ostringstream out;
+    out << "status_0x" << std::hex << (unsigned) status;
+    return out.str();
+}
+
+static void worker(std::vector<target> &targets, const load_options &options, std::shared_ptr<EVP_PKEY> pkey) {
+    std::vector<device_connection> connections(targets.size());
+    std::vector<device_session> sessions(targets.size());
+    for (device_connection &connection: connections) {
+        connection.set_verbose(false);
+    }
+
+    while (true) {
+        request next;
+        {
+            std::unique_lock<std::mutex> guard(queue_lock);
+            queue_changed.wait(guard, [] { return finished || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            next = pending.front();
+            pending.pop_front();
+        }
+
+        target &to = targets[next.target];
+        device_connection &connection = connections[next.target];
+        device_session &session = sessions[next.target];
+        device_connection::result res = device_connection::result::send_failed;
+        response header = {};
+        std::vector<uint8_t> data;
+        bool connected;
+        {
+            std::lock_guard<std::mutex> guard(to.order);
+            connected = connection.connected() || connection.connect(to.host, to.port);
+            if (connected && options.session && !session.valid()) {
+                connected = open_session(connection, pkey, session, false);
+            }
+            if (connected) {
+                payload command = options.command;
+                std::vector<uint8_t> packet = options.session ? build_session_payload(command, {}, session)
+                                                              : build_payload(command, {}, pkey, false);
+                res = connection.transact(packet, header, data);
+                if (res != device_connection::result::ok || header.status == STATUS_DENIED) {
+                    session = {};
+                }
+            }
+        }
+
+        int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(load_clock::now() - next.due).count();
+        record(connected ? outcome_name(res, header.status) : "connect_failed", latency);
+    }
+}
+
+static void report(const char *name, const load_stats &stats, double seconds, size_t backlog) {
+    std::cout << std::fixed << std::setprecision(1)
+              << name << " t=" << seconds << "s"
+              << " count=" << stats.latency.total()
+              << " p50=" << stats.latency.percentile(0.5) << "us"
+              << " p99=" << stats.latency.percentile(0.99) << "us"
+              << " p999=" << stats.latency.percentile(0.999) << "us"
+              << " max=" << stats.latency.maximum() << "us"
+              << " backlog=" << backlog;
+    for (const auto &[outcome, count]: stats.outcomes) {
+        std::cout << " " << outcome << "=" << count;
+    }
+    std::cout << std::endl;
+}
+
+static bool parse_targets(const std::string &text, std::vector<target> &targets) {
+    std::istringstream in(text);
+    std::string item;
+    std::vector<std::string> names;
+    while (std::getline(in, item, ',')) {
+        names.push_back(item);
+    }
+
+    targets = std::vector<target>(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        size_t colon = names[i].find(':');
+        in_addr host;
+        if (inet_pton(AF_INET, names[i].substr(0, colon).c_str(), &host) != 1) {
+            std::cerr << "Invalid target: " << names[i] << std::endl;
+            return false;
+        }
+        targets[i].name = names[i];
+        targets[i].host = host.s_addr;
+        targets[i].port = colon == std::string::npos ? DEVICE_PORT : std::stoul(names[i].substr(colon + 1));
+    }
+    return !targets.empty();
+}
+
+int main(int argc, char *argv[]) {
+    openssl_scope scope_guard;
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <path_to_rsa_key.pem> <IP[:PORT]>[,<IP[:PORT]>...]" << std::endl
+                  << "    [--rate <per second>] [--concurrency <connections>] [--duration <s>, 0 - forever]" << std::endl
+                  << "    [--interval <report s>] [--poisson] [--session]" << std::endl
+                  << "    [--command <command>] [--pin <pin>] [--volume <volume>] [--time <time>]" << std::endl;
+        return 1;
+    }
+
+    std::vector<target> targets;
+    if (!parse_targets(argv[2], targets)) {
+        return 1;
+    }
+
+    load_options options;
+    options.command.command = CMD_SCHEDULE_GET;
+    for (int i = 3; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--poisson") {
+            options.poisson = true;
+            continue;
+        }
+        if (option == "--session") {
+            options.session = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--rate") {
+            options.rate = std::stod(value);
+        } else if (option == "--concurrency") {
+            options.concurrency = std::stoi(value);
+        } else if (option == "--duration") {
+            options.duration = std::stoi(value);
+        } else if (option == "--interval") {
+            options.interval = std::stoi(value);
+        } else if (option == "--command") {
+            options.command.command = std::stoul(value, nullptr, 0);
+        } else if (option == "--pin") {
+            options.command.pin = std::stoul(value, nullptr, 0);
+        } else if (option == "--volume") {
+            try {
+                options.command.volume = parse_volume(value);
+            } catch (const std::exception &e) {
+                std::cerr << "Invalid volume " << value << ", expected digits[.digits]" << std::endl;
+                return 1;
+            }
+        } else if (option == "--time") {
+            options.command.time = std::stoul(value, nullptr, 0);
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (options.rate <= 0 || options.concurrency <= 0 || options.interval <= 0) {
+        std::cerr << "Rate, concurrency and interval must be positive" << std::endl;
+        return 1;
+    }
+
+    std::shared_ptr<EVP_PKEY> pkey(load_private_key(argv[1]), EVP_PKEY_free);
+    if (!pkey) {
+        std::cerr << "Failed to load private key" << std::endl;
+        return 2;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < options.concurrency; i++) {
+        workers.emplace_back(worker, std::ref(targets), std::cref(options), pkey);
+    }
+
+    std::mt19937_64 random(std::random_device{}());
+    std::exponential_distribution<double> exponential(options.rate);
+    const load_clock::time_point start = load_clock::now();
+    load_clock::time_point due = start;
+    load_clock::time_point next_report = start + std::chrono::seconds(options.interval);
+    size_t next_target = 0;
+
+    while (options.duration == 0 || due < start + std::chrono::seconds(options.duration)) {
+        std::this_thread::sleep_until(std::min(due, next_report));
+
+        load_clock::time_point now = load_clock::now();
+        if (now >= next_report) {
+            std::lock_guard<std::mutex> guard(stats_lock);
+            size_t backlog;
+            {
+                std::lock_guard<std::mutex> queue_guard(queue_lock);
+                backlog = pending.size();
+            }
+            report("interval", interval_stats, std::chrono::duration<double>(now - start).count(), backlog);
+            interval_stats = load_stats();
+            next_report += std::chrono::seconds(options.interval);
+        }
+
+        while (due <= now) {
+            {
+                std::lock_guard<std::mutex> guard(queue_lock);
+                pending.push_back({next_target, due});
+            }
+            queue_changed.notify_one();
+            next_target = (next_target + 1) % targets.size();
+
+            double gap = options.poisson ? exponential(random) : 1.0 / options.rate;
+            due += std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(gap));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queue_lock);
+        finished = true;
+    }
+    queue_changed.notify_all();
+    for (std::thread &thread: workers) {
+        thread.join();
+    }
+
+    report("total", total_stats, std::chrono::duration<double>(load_clock::now() - start).count(), 0);
+    return total_stats.outcomes.size() == 1 && total_stats.outcomes.count("ok") ? 0 : 5;
+}
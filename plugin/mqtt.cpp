@@ -0,0 +1,284 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : mqtt.cpp
+ * PURPOSE     : MQTT client for the broker command channel
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#include "mqtt.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Control packet types, high nibble of the first byte */
+#define MQTT_CONNECT   1
+#define MQTT_CONNACK   2
+#define MQTT_PUBLISH   3
+#define MQTT_PUBACK    4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK    9
+#define MQTT_PINGREQ   12
+#define MQTT_PINGRESP  13
+
+#define MQTT_KEEPALIVE_S 60
+
+/* Messages kept for wait_message */
+#define MESSAGES_MAX 256
+
+static void put_u16(std::vector<uint8_t> &out, uint16_t value) {
+    out.push_back(value >> 8);
+    out.push_back(value & 0xFF);
+}
+
+static void put_string(std::vector<uint8_t> &out, const std::string &text) {
+    put_u16(out, text.size());
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+static uint16_t get_u16(const std::vector<uint8_t> &data, size_t offset) {
+    return data[offset] << 8 | data[offset + 1];
+}
+
+mqtt_connection::~mqtt_connection() {
+    disconnect();
+}
+
+bool mqtt_connection::connect(uint32_t host, uint16_t port, const std::string &client_id, int timeout_ms) {
+    disconnect();
+    this->timeout_ms = timeout_ms;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return false;
+    }
+
+    timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    int flag = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = host;
+    if (::connect(s, (sockaddr *) &addr, sizeof(addr)) < 0) {
+        std::cerr << "MQTT connect" << std::endl;
+        disconnect();
+        return false;
+    }
+
+    std::vector<uint8_t> body;
+    put_string(body, "MQTT");
+    body.push_back(4);    // 3.1.1
+    body.push_back(0x02); // Clean session
+    put_u16(body, MQTT_KEEPALIVE_S);
+    put_string(body, client_id);
+
+    uint8_t type;
+    std::vector<uint8_t> ack;
+    if (!send_packet(MQTT_CONNECT << 4, body) || !receive_packet(type, ack) ||
+        type >> 4 != MQTT_CONNACK || ack.size() != 2) {
+        std::cerr << "No MQTT CONNACK" << std::endl;
+        disconnect();
+        return false;
+    }
+    if (ack[1] != 0) {
+        std::cerr << "MQTT connection refused, code " << (unsigned) ack[1] << std::endl;
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void mqtt_connection::disconnect() {
+    if (s >= 0) {
+        close(s);
+    }
+    s = -1;
+}
+
+bool mqtt_connection::subscribe(const std::string &topic) {
+    uint16_t id = next_id++;
+    std::vector<uint8_t> body;
+    put_u16(body, id);
+    put_string(body, topic);
+    body.push_back(0);
+
+    return send_packet(MQTT_SUBSCRIBE << 4 | 0x02, body) && wait_ack(MQTT_SUBACK, id, timeout_ms);
+}
+
+bool mqtt_connection::publish(const std::string &topic, const std::vector<uint8_t> &data) {
+    uint16_t id = next_id++;
+    std::vector<uint8_t> body;
+    put_string(body, topic);
+    put_u16(body, id);
+    body.insert(body.end(), data.begin(), data.end());
+
+    return send_packet(MQTT_PUBLISH << 4 | 0x02, body) && wait_ack(MQTT_PUBACK, id, timeout_ms);
+}
+
+bool mqtt_connection::send_packet(uint8_t type, const std::vector<uint8_t> &body) {
+    std::vector<uint8_t> packet = {type};
+    size_t length = body.size();
+    do {
+        packet.push_back((length & 0x7F) | (length > 0x7F ? 0x80 : 0));
+        length >>= 7;
+    } while (length != 0);
+    packet.insert(packet.end(), body.begin(), body.end());
+
+    if (s < 0 || send(s, packet.data(), packet.size(), 0) != (ssize_t) packet.size()) {
+        disconnect();
+        return false;
+    }
+    last_sent = std::chrono::steady_clock::now();
+    return true;
+}
+
+bool mqtt_connection::receive_all(uint8_t *buf, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(s, buf, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        buf += received;
+        size -= received;
+    }
+    return true;
+}
+
+bool mqtt_connection::receive_packet(uint8_t &type, std::vector<uint8_t> &body) {
+    size_t length = 0;
+    uint8_t byte = 0;
+
+    if (s < 0 || !receive_all(&type, 1)) {
+        return false;
+    }
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (!receive_all(&byte, 1)) {
+            return false;
+        }
+        length |= (size_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (byte & 0x80) {
+        return false;
+    }
+
+    body.resize(length);
+    return receive_all(body.data(), length);
+}
+
+bool mqtt_connection::handle_publish(uint8_t flags, const std::vector<uint8_t> &body) {
+    uint8_t qos = (flags >> 1) & 0x03;
+    if (body.size() < 2 || body.size() < 2 + (size_t) get_u16(body, 0) + (qos != 0 ? 2 : 0)) {
+        std::cerr << "Invalid MQTT publish" << std::endl;
+        return false;
+    }
+
+    size_t offset = 2 + get_u16(body, 0);
+    mqtt_message message;
+    message.topic.assign(body.begin() + 2, body.begin() + offset);
+    if (qos != 0) {
+        std::vector<uint8_t> ack;
+        put_u16(ack, get_u16(body, offset));
+        offset += 2;
+        if (!send_packet(MQTT_PUBACK << 4, ack)) {
+            return false;
+        }
+    }
+    message.data.assign(body.begin() + offset, body.end());
+
+    // Nobody may be waiting for them, keep the newest
+    if (messages.size() == MESSAGES_MAX) {
+        messages.pop_front();
+    }
+    messages.push_back(std::move(message));
+    return true;
+}
+
+bool mqtt_connection::wait_ack(uint8_t type, uint16_t packet_id, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        pollfd fd = {s, POLLIN, 0};
+        if (s < 0 || left <= 0 || poll(&fd, 1, left) <= 0) {
+            return false;
+        }
+
+        uint8_t received;
+        std::vector<uint8_t> body;
+        if (!receive_packet(received, body)) {
+            disconnect();
+            return false;
+        }
+        if (received >> 4 == MQTT_PUBLISH) {
+            if (!handle_publish(received & 0x0F, body)) {
+                return false;
+            }
+        } else if (received >> 4 == type && body.size() >= 2 && get_u16(body, 0) == packet_id) {
+            // SUBACK return code 0x80 is a refused subscription
+            return type != MQTT_SUBACK || (body.size() == 3 && body[2] != 0x80);
+        }
+    }
+}
+
+bool mqtt_connection::wait_message(mqtt_message &message, int timeout_ms) {
+    const auto ping_period = std::chrono::seconds(MQTT_KEEPALIVE_S / 2);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    while (messages.empty()) {
+        auto now = std::chrono::steady_clock::now();
+        if (s < 0 || now >= deadline) {
+            return false;
+        }
+        // The broker drops a connection silent for 1.5 keepalives
+        if (now - last_sent >= ping_period && !send_packet(MQTT_PINGREQ << 4, {})) {
+            return false;
+        }
+
+        auto until = std::min(deadline, last_sent + ping_period);
+        int left = std::max<int>(0, std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count());
+        pollfd fd = {s, POLLIN, 0};
+        int ready = poll(&fd, 1, left);
+        if (ready < 0) {
+            return false;
+        }
+        if (ready == 0) {
+            continue;
+        }
+
+        uint8_t type;
+        std::vector<uint8_t> body;
+        if (!receive_packet(type, body)) {
+            disconnect();
+            return false;
+        }
+        // PINGRESP and late acks need nothing
+        if (type >> 4 == MQTT_PUBLISH && !handle_publish(type & 0x0F, body)) {
+            return false;
+        }
+    }
+
+    message = std::move(messages.front());
+    messages.pop_front();
+    return true;
+}
@@ -0,0 +1,66 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : mqtt.h
+ * PURPOSE     : MQTT client for the broker command channel
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __MQTT_H_
+#define __MQTT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct mqtt_message {
+    std::string topic;
+    std::vector<uint8_t> data;
+};
+
+/* MQTT 3.1.1 connection with a clean session, as much of it as publishing
+ * commands and reading acks takes. Subscriptions are QoS 0, publishes are
+ * QoS 1 and wait for the broker to take them */
+class mqtt_connection {
+public:
+    mqtt_connection() = default;
+    mqtt_connection(const mqtt_connection &) = delete;
+    mqtt_connection &operator=(const mqtt_connection &) = delete;
+    ~mqtt_connection();
+
+    bool connect(uint32_t host, uint16_t port, const std::string &client_id, int timeout_ms = 5000);
+    void disconnect();
+    bool connected() const { return s >= 0; }
+
+    /* Topic filter, + and # wildcards are up to the broker */
+    bool subscribe(const std::string &topic);
+
+    bool publish(const std::string &topic, const std::vector<uint8_t> &data);
+
+    /* Next message of the subscriptions, false on timeout or connection loss */
+    bool wait_message(mqtt_message &message, int timeout_ms);
+
+private:
+    bool send_packet(uint8_t type, const std::vector<uint8_t> &body);
+    bool receive_packet(uint8_t &type, std::vector<uint8_t> &body);
+    bool receive_all(uint8_t *buf, size_t size);
+    /* Waits for an acknowledge of `packet_id`, messages that come first are kept */
+    bool wait_ack(uint8_t type, uint16_t packet_id, int timeout_ms);
+    bool handle_publish(uint8_t flags, const std::vector<uint8_t> &body);
+
+    int s = -1;
+    uint16_t next_id = 1;
+    int timeout_ms = 5000;
+    std::chrono::steady_clock::time_point last_sent;
+    std::deque<mqtt_message> messages;
+};
+
+#endif /* __MQTT_H_ */
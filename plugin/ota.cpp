@@ -0,0 +1,301 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : ota.cpp
+ * PURPOSE     : Firmware update tool
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* diff  builds an OTA_DELTA patch of a new image against the one the
+ *       device runs, apply is the device side algorithm for checking it.
+ * send  signs CMD_OTA with the size and SHA-256 of the new image, the
+ *       device downloads the image or the patch from `url` itself, e.g.
+ *       from `python3 -m http.server` in the build directory. */
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+
+#include "protocol.h"
+
+/* Matched runs are found on base blocks of this size */
+#define DELTA_BLOCK 32
+
+/* Candidate base offsets checked per block hash */
+#define DELTA_CANDIDATES 8
+
+#define DELTA_HASH_BASE 257ULL
+
+static bool read_file(const std::string &path, std::vector<uint8_t> &data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Can't open " << path << std::endl;
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool write_file(const std::string &path, const std::vector<uint8_t> &data) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!out) {
+        std::cerr << "Can't write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static std::vector<uint8_t> sha256(const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> digest(EVP_MD_size(EVP_sha256()));
+    unsigned int size = 0;
+    if (EVP_Digest(data.data(), data.size(), digest.data(), &size, EVP_sha256(), nullptr) != 1) {
+        return {};
+    }
+    return digest;
+}
+
+static uint64_t block_hash(const uint8_t *data) {
+    uint64_t hash = 0;
+    for (size_t i = 0; i < DELTA_BLOCK; i++) {
+        hash = hash * DELTA_HASH_BASE + data[i];
+    }
+    return hash;
+}
+
+class patch_writer {
+public:
+    patch_writer() {
+        uint32_t magic = OTA_PATCH_MAGIC;
+        append(&magic, sizeof(magic));
+    }
+
+    void copy(uint32_t offset, uint32_t length) {
+        ota_patch_op op = {OTA_OP_COPY, offset, length};
+        append(&op, sizeof(op));
+        copies++;
+    }
+
+    void insert(const uint8_t *data, uint32_t length) {
+        if (length == 0) {
+            return;
+        }
+        ota_patch_op op = {OTA_OP_INSERT, 0, length};
+        append(&op, sizeof(op));
+        append(data, length);
+        inserts++;
+        inserted += length;
+    }
+
+    std::vector<uint8_t> patch;
+    size_t copies = 0, inserts = 0, inserted = 0;
+
+private:
+    void append(const void *data, size_t size) {
+        const uint8_t *raw = static_cast<const uint8_t *>(data);
+        patch.insert(patch.end(), raw, raw + size);
+    }
+};
+
+/* Rolling hash over every offset of `image`, matched against aligned base
+ * blocks, then extended both ways. Unmatched bytes become inserts */
+static patch_writer diff(const std::vector<uint8_t> &base, const std::vector<uint8_t> &image) {
+    std::unordered_map<uint64_t, std::vector<uint32_t>> index;
+    for (size_t offset = 0; offset + DELTA_BLOCK <= base.size(); offset += DELTA_BLOCK) {
+        std::vector<uint32_t> &candidates = index[block_hash(&base[offset])];
+        if (candidates.size() < DELTA_CANDIDATES) {
+            candidates.push_back(offset);
+        }
+    }
+
+    uint64_t top = 1;
+    for (size_t i = 1; i < DELTA_BLOCK; i++) {
+        top *= DELTA_HASH_BASE;
+    }
+
+    patch_writer writer;
+    size_t literal = 0, i = 0;
+    uint64_t hash = image.size() >= DELTA_BLOCK ? block_hash(&image[0]) : 0;
+
+    while (i + DELTA_BLOCK <= image.size()) {
+        size_t best_length = 0, best_base = 0, best_back = 0;
+        auto found = index.find(hash);
+        if (found != index.end()) {
+            for (uint32_t candidate: found->second) {
+                if (memcmp(&base[candidate], &image[i], DELTA_BLOCK) != 0) {
+                    continue;
+                }
+                size_t length = DELTA_BLOCK;
+                while (candidate + length < base.size() && i + length < image.size() &&
+                       base[candidate + length] == image[i + length]) {
+                    length++;
+                }
+                size_t back = 0;
+                while (back < i - literal && back < candidate && base[candidate - back - 1] == image[i - back - 1]) {
+                    back++;
+                }
+                if (length + back > best_length + best_back) {
+                    best_length = length;
+                    best_back = back;
+                    best_base = candidate;
+                }
+            }
+        }
+
+        if (best_length == 0) {
+            if (i + DELTA_BLOCK < image.size()) {
+                hash = (hash - image[i] * top) * DELTA_HASH_BASE + image[i + DELTA_BLOCK];
+            }
+            i++;
+            continue;
+        }
+
+        writer.insert(&image[literal], i - best_back - literal);
+        writer.copy(best_base - best_back, best_length + best_back);
+        i += best_length;
+        literal = i;
+        if (i + DELTA_BLOCK <= image.size()) {
+            hash = block_hash(&image[i]);
+        }
+    }
+    writer.insert(&image[literal], image.size() - literal);
+    return writer;
+}
+
+/* Same algorithm as the device, for checking patches on the host */
+static bool apply(const std::vector<uint8_t> &base, const std::vector<uint8_t> &patch, std::vector<uint8_t> &image) {
+    uint32_t magic;
+    if (patch.size() < sizeof(magic)) {
+        std::cerr << "Patch is truncated" << std::endl;
+        return false;
+    }
+    memcpy(&magic, patch.data(), sizeof(magic));
+    if (magic != OTA_PATCH_MAGIC) {
+        std::cerr << "Invalid patch magic" << std::endl;
+        return false;
+    }
+
+    image.clear();
+    size_t offset = sizeof(magic);
+    while (offset < patch.size()) {
+        ota_patch_op op;
+        if (patch.size() - offset < sizeof(op)) {
+            std::cerr << "Patch is truncated" << std::endl;
+            return false;
+        }
+        memcpy(&op, &patch[offset], sizeof(op));
+        offset += sizeof(op);
+
+        if (op.op == OTA_OP_COPY && op.offset <= base.size() && op.length <= base.size() - op.offset) {
+            image.insert(image.end(), base.begin() + op.offset, base.begin() + op.offset + op.length);
+        } else if (op.op == OTA_OP_INSERT && op.length <= patch.size() - offset) {
+            image.insert(image.end(), patch.begin() + offset, patch.begin() + offset + op.length);
+            offset += op.length;
+        } else {
+            std::cerr << "Invalid patch op " << (unsigned) op.op << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static int send(int argc, char *argv[]) {
+    if (argc < 7) {
+        std::cerr << "send requires <key> <IP> <PORT> <url> <image> [--delta]" << std::endl;
+        return 1;
+    }
+    std::string url = argv[5];
+    std::vector<uint8_t> image;
+    in_addr host;
+    if (inet_pton(AF_INET, argv[3], &host) != 1) {
+        std::cerr << "Invalid IP " << argv[3] << std::endl;
+        return 1;
+    }
+    if (url.empty() || url.size() > OTA_URL_MAX) {
+        std::cerr << "URL must be 1.." << OTA_URL_MAX << " characters" << std::endl;
+        return 1;
+    }
+    if (!read_file(argv[6], image) || image.empty()) {
+        return 1;
+    }
+
+    ota_request request = {};
+    request.mode = argc > 7 && std::string(argv[7]) == "--delta" ? OTA_DELTA : OTA_FULL;
+    request.image_size = image.size();
+    std::vector<uint8_t> digest = sha256(image);
+    memcpy(request.image_sha256, digest.data(), sizeof(request.image_sha256));
+
+    std::vector<uint8_t> body(sizeof(request));
+    memcpy(body.data(), &request, sizeof(request));
+    body.insert(body.end(), url.begin(), url.end());
+
+    std::shared_ptr<EVP_PKEY> pkey(load_private_key(argv[2]), EVP_PKEY_free);
+    if (!pkey) {
+        std::cerr << "Failed to load private key" << std::endl;
+        return 2;
+    }
+
+    payload data = {};
+    data.command = CMD_OTA;
+    std::vector<uint8_t> packet = build_payload(data, body, pkey, false);
+
+    device_connection connection;
+    response header = {};
+    std::vector<uint8_t> reply;
+    if (packet.empty() || !connection.connect(host.s_addr, std::stoul(argv[4], nullptr, 0)) ||
+        connection.transact(packet, header, reply) != device_connection::result::ok) {
+        std::cerr << "TCP send/receive error" << std::endl;
+        return 4;
+    }
+
+    std::cout << "status: " << (unsigned) header.status << std::endl
+              << "image: " << image.size() << " bytes, sha256 " << to_hex(digest) << std::endl;
+    return header.status == STATUS_OK ? 0 : 5;
+}
+
+int main(int argc, char *argv[]) {
+    openssl_scope scope_guard;
+    std::string mode = argc > 1 ? argv[1] : "";
+
+    if (mode == "send") {
+        return send(argc, argv);
+    }
+
+    if ((mode == "diff" || mode == "apply") && argc == 5) {
+        std::vector<uint8_t> base, input, output;
+        if (!read_file(argv[2], base) || !read_file(argv[3], input)) {
+            return 1;
+        }
+
+        if (mode == "apply") {
+            return apply(base, input, output) && write_file(argv[4], output) ? 0 : 1;
+        }
+
+        patch_writer writer = diff(base, input);
+        if (!write_file(argv[4], writer.patch)) {
+            return 1;
+        }
+        std::cout << "patch: " << writer.patch.size() << " bytes for " << input.size() << " bytes image"
+                  << ", copies " << writer.copies << ", inserts " << writer.inserts
+                  << " (" << writer.inserted << " bytes)" << std::endl;
+        return 0;
+    }
+
+    std::cerr << "Usage: " << argv[0] << " diff <running.bin> <new.bin> <patch_out>" << std::endl
+              << "       " << argv[0] << " apply <running.bin> <patch> <image_out>" << std::endl
+              << "       " << argv[0] << " send <path_to_rsa_key.pem> <IP> <PORT> <url> <new.bin> [--delta]" << std::endl;
+    return 1;
+}
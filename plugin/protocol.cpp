@@ -0,0 +1,578 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : protocol.cpp
+ * PURPOSE     : Device protocol helpers
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#include "protocol.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/md5.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+/* Events kept for wait_event */
+#define EVENTS_MAX 64
+
+std::vector<uint8_t> compute_md5(const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> digest(EVP_MD_size(EVP_md5()));
+    std::shared_ptr<EVP_MD_CTX> mdctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!mdctx) {
+        std::cerr << "EVP_MD_CTX_new failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    if (EVP_DigestInit_ex(mdctx.get(), EVP_md5(), nullptr) != 1) {
+        std::cerr << "EVP_DigestInit_ex failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    if (EVP_DigestUpdate(mdctx.get(), data.data(), data.size()) != 1) {
+        std::cerr << "EVP_DigestUpdate failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    unsigned int out_len = 0;
+    if (EVP_DigestFinal_ex(mdctx.get(), digest.data(), &out_len) != 1) {
+        std::cerr << "EVP_DigestFinal_ex failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    digest.resize(out_len);
+    return digest;
+}
+
+EVP_PKEY *load_private_key(const std::string &key_path) {
+    FILE *fp = fopen(key_path.c_str(), "rb");
+    if (!fp) {
+        std::cerr << "Cannot open private key file: " << key_path << "\n";
+        return nullptr;
+    }
+    EVP_PKEY *pkey = PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr);
+    fclose(fp);
+    if (!pkey) {
+        std::cerr << "PEM_read_PrivateKey failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+    }
+    return pkey;
+}
+
+std::vector<uint8_t> sign(std::shared_ptr<EVP_PKEY> pkey, const std::vector<uint8_t> &data) {
+    std::shared_ptr<EVP_PKEY_CTX> ctx(EVP_PKEY_CTX_new(pkey.get(), nullptr), EVP_PKEY_CTX_free);
+    if (!ctx) {
+        std::cerr << "EVP_PKEY_CTX_new failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    if (EVP_PKEY_sign_init(ctx.get()) <= 0) {
+        std::cerr << "EVP_PKEY_sign_init failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    if (EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_md5()) <= 0) {
+        std::cerr << "EVP_PKEY_CTX_set_signature_md failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    size_t siglen = 0;
+    if (EVP_PKEY_sign(ctx.get(), nullptr, &siglen, data.data(), data.size()) <= 0) {
+        std::cerr << "EVP_PKEY_sign (get length) failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    std::vector<uint8_t> signature(siglen);
+    if (EVP_PKEY_sign(ctx.get(), signature.data(), &siglen, data.data(), data.size()) <= 0) {
+        std::cerr << "EVP_PKEY_sign failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << "\n";
+        return {};
+    }
+
+    return signature;
+}
+
+device_connection::~device_connection() {
+    disconnect();
+}
+
+bool device_connection::connect(uint32_t host, uint16_t port, int timeout_ms) {
+    disconnect();
+    this->host = host;
+    this->port = port;
+
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return false;
+    }
+
+    timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    int flag = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    sockaddr_in serv_addr = {};
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    serv_addr.sin_addr.s_addr = host;
+
+    if (::connect(s, (sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        if (verbose) {
+            std::cerr << "connect" << std::endl;
+        }
+        disconnect();
+        return false;
+    }
+    return true;
+}
+
+void device_connection::set_timeout(int timeout_ms) {
+    if (s < 0) {
+        return;
+    }
+    timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+void device_connection::disconnect() {
+    if (s >= 0) {
+        close(s);
+        s = -1;
+    }
+}
+
+bool device_connection::receive_all(uint8_t *buf, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(s, buf, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        buf += received;
+        size -= received;
+    }
+    return true;
+}
+
+device_connection::result device_connection::transact(const std::vector<uint8_t> &packet, response &header, std::vector<uint8_t> &data) {
+    if (s < 0) {
+        return result::send_failed;
+    }
+
+    if (capture) {
+        capture->write(CAPTURE_PACKET, host, port, packet.data(), packet.size());
+    }
+    if (send(s, packet.data(), packet.size(), MSG_NOSIGNAL) != (ssize_t) packet.size()) {
+        if (verbose) {
+            std::cerr << "send" << std::endl;
+        }
+        disconnect();
+        return result::send_failed;
+    }
+
+    // Events of earlier commands may come before the response
+    while (true) {
+        result res = receive_frame(header, data);
+        if (res != result::ok || header.status != STATUS_EVENT) {
+            return res;
+        }
+        queue_event(data);
+    }
+}
+
+device_connection::result device_connection::receive_frame(response &header, std::vector<uint8_t> &data) {
+    ssize_t received = recv(s, &header, sizeof(header), MSG_WAITALL);
+    if (received == 0) {
+        // Closed before the packet was read, device did not run it
+        disconnect();
+        return result::closed;
+    }
+    if (received != sizeof(header)) {
+        if (verbose) {
+            std::cerr << "recv" << std::endl;
+        }
+        disconnect();
+        return result::recv_failed;
+    }
+
+    data.resize(header.size);
+    if (!receive_all(data.data(), data.size())) {
+        if (verbose) {
+            std::cerr << "recv" << std::endl;
+        }
+        disconnect();
+        return result::recv_failed;
+    }
+
+    if (capture) {
+        std::vector<uint8_t> frame(reinterpret_cast<const uint8_t *>(&header), reinterpret_cast<const uint8_t *>(&header) + sizeof(header));
+        frame.insert(frame.end(), data.begin(), data.end());
+        capture->write(header.status == STATUS_EVENT ? CAPTURE_EVENT : CAPTURE_RESPONSE, host, port, frame.data(), frame.size());
+    }
+    return result::ok;
+}
+
+void device_connection::queue_event(const std::vector<uint8_t> &data) {
+    // Nobody may be waiting for them, keep the newest
+    if (events.size() == EVENTS_MAX) {
+        events.pop_front();
+    }
+
+    pump_event event;
+    if (data.size() != sizeof(event)) {
+        if (verbose) {
+            std::cerr << "Invalid event size " << data.size() << std::endl;
+        }
+        return;
+    }
+    memcpy(&event, data.data(), sizeof(event));
+    events.push_back(event);
+}
+
+bool device_connection::wait_event(pump_event &event, int timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (events.empty()) {
+        int left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        pollfd fd = {s, POLLIN, 0};
+        if (s < 0 || left <= 0 || poll(&fd, 1, left) <= 0) {
+            return false;
+        }
+
+        response header;
+        std::vector<uint8_t> data;
+        if (receive_frame(header, data) != result::ok) {
+            return false;
+        }
+        if (header.status == STATUS_EVENT) {
+            queue_event(data);
+        } else if (verbose) {
+            std::cerr << "Unexpected response, status " << (unsigned) header.status << std::endl;
+        }
+    }
+    event = events.front();
+    events.pop_front();
+    return true;
+}
+
+static std::vector<uint8_t> decrypt(std::shared_ptr<EVP_PKEY> pkey, const uint8_t *data, size_t size) {
+    std::shared_ptr<EVP_PKEY_CTX> ctx(EVP_PKEY_CTX_new(pkey.get(), nullptr), EVP_PKEY_CTX_free);
+    if (!ctx || EVP_PKEY_decrypt_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0) {
+        std::cerr << "EVP_PKEY_decrypt_init failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << std::endl;
+        return {};
+    }
+
+    size_t out_len = 0;
+    if (EVP_PKEY_decrypt(ctx.get(), nullptr, &out_len, data, size) <= 0) {
+        std::cerr << "EVP_PKEY_decrypt (get length) failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << std::endl;
+        return {};
+    }
+    std::vector<uint8_t> out(out_len);
+    if (EVP_PKEY_decrypt(ctx.get(), out.data(), &out_len, data, size) <= 0) {
+        std::cerr << "EVP_PKEY_decrypt failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << std::endl;
+        return {};
+    }
+    out.resize(out_len);
+    return out;
+}
+
+bool open_session(device_connection &connection, std::shared_ptr<EVP_PKEY> pkey, device_session &session, bool verbose) {
+    payload data = {};
+    data.command = CMD_SESSION_OPEN;
+    std::vector<uint8_t> packet = build_payload(data, {}, pkey, false);
+    response header = {};
+    std::vector<uint8_t> reply;
+
+    session = {};
+    if (packet.empty() || connection.transact(packet, header, reply) != device_connection::result::ok) {
+        return false;
+    }
+    if (header.status != STATUS_OK || reply.size() <= sizeof(session_open)) {
+        if (verbose) {
+            std::cerr << "Session open rejected, status 0x" << std::hex << (unsigned) header.status << std::dec << std::endl;
+        }
+        return false;
+    }
+
+    session_open opened;
+    memcpy(&opened, reply.data(), sizeof(opened));
+    std::vector<uint8_t> key = decrypt(pkey, reply.data() + sizeof(opened), reply.size() - sizeof(opened));
+    if (key.size() != SESSION_KEY_SIZE) {
+        std::cerr << "Invalid session key" << std::endl;
+        return false;
+    }
+
+    // Renew a bit early, the device counts lifetime from its own receive time
+    std::chrono::seconds lifetime(opened.lifetime > 30 ? opened.lifetime - 30 : 0);
+    session.id = opened.session;
+    session.key = key;
+    session.expires = std::chrono::steady_clock::now() + lifetime;
+    if (verbose) {
+        std::cout << "session: 0x" << std::hex << session.id << std::dec << " for " << lifetime.count() << "s" << std::endl;
+    }
+    return true;
+}
+
+std::string to_hex(const std::vector<uint8_t> &data) {
+    static const char hex_chars[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(data.size() * 2);
+    for (uint8_t b: data) {
+        out.push_back(hex_chars[b >> 4]);
+        out.push_back(hex_chars[b & 0xF]);
+    }
+    return out;
+}
+
+std::vector<uint8_t> build_packet(const payload &data, const std::vector<uint8_t> &body) {
+    std::vector<uint8_t> res;
+    res.resize(sizeof(payload));
+    memcpy(res.data(), static_cast<const void *>(&data), sizeof(payload));
+    res.insert(res.end(), body.begin(), body.end());
+    return res;
+}
+
+uint32_t make_command_id() {
+    thread_local std::mt19937 generator{std::random_device{}()};
+    return std::uniform_int_distribution<uint32_t>(1, UINT32_MAX)(generator);
+}
+
+std::vector<uint8_t> build_payload(payload &data, const std::vector<uint8_t> &body, std::shared_ptr<EVP_PKEY> pkey, bool verbose) {
+    data.version = PAYLOAD_VERSION;
+    data.auth = AUTH_RSA;
+    data.size = body.size();
+    data.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::vector<uint8_t> packet = build_packet(data, body);
+    if (packet.empty()) {
+        std::cerr << "Failed to build packet" << std::endl;
+        return {};
+    }
+
+    if (verbose) {
+        std::cout << "packet:" << std::endl
+                  << to_hex(packet) << std::endl;
+    }
+
+    auto md5 = compute_md5(packet);
+    if (verbose) {
+        std::cout << "md5:" << to_hex(md5) << std::endl;
+    }
+
+    std::vector<uint8_t> signature = sign(pkey, md5);
+    if (signature.empty()) {
+        std::cerr << "payload sign error" << std::endl;
+        return {};
+    }
+
+    packet.insert(packet.end(), signature.begin(), signature.end());
+    if (verbose) {
+        std::cout << "signature :" << to_hex(signature) << std::endl;
+        std::cout << "payload:" << std::endl
+                  << to_hex(packet) << std::endl;
+    }
+    return packet;
+}
+
+using merkle_hash = std::vector<uint8_t>;
+
+static merkle_hash merkle_digest(uint8_t prefix, const uint8_t *a, size_t a_size, const uint8_t *b, size_t b_size) {
+    merkle_hash hash(MERKLE_HASH_SIZE);
+    std::shared_ptr<EVP_MD_CTX> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1 ||
+        EVP_DigestUpdate(ctx.get(), &prefix, 1) != 1 || EVP_DigestUpdate(ctx.get(), a, a_size) != 1 ||
+        EVP_DigestUpdate(ctx.get(), b, b_size) != 1 || EVP_DigestFinal_ex(ctx.get(), hash.data(), nullptr) != 1) {
+        std::cerr << "SHA-256 failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << std::endl;
+        return {};
+    }
+    return hash;
+}
+
+/* Proof hashes of a leaf, a node without a sibling moves up unchanged */
+static size_t merkle_depth(size_t index, size_t count) {
+    size_t depth = 0;
+    for (; count > 1; count = (count + 1) / 2, index /= 2) {
+        depth += (index ^ 1) < count;
+    }
+    return depth;
+}
+
+std::vector<std::vector<uint8_t>> build_merkle_payloads(std::vector<payload> &data, const std::vector<std::vector<uint8_t>> &bodies,
+                                                        const std::vector<uint32_t> &devices, std::shared_ptr<EVP_PKEY> pkey) {
+    uint64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::vector<std::vector<uint8_t>> packets(data.size());
+    std::vector<std::vector<merkle_hash>> levels(1);
+
+    if (data.empty() || data.size() != bodies.size() || data.size() != devices.size()) {
+        return {};
+    }
+
+    // Depth is in the hashed header, known before the tree is built
+    for (size_t i = 0; i < data.size(); i++) {
+        size_t depth = merkle_depth(i, data.size());
+        if (depth > MERKLE_MAX_DEPTH) {
+            std::cerr << "Too many packets for one Merkle root" << std::endl;
+            return {};
+        }
+        data[i].version = PAYLOAD_VERSION;
+        data[i].auth = AUTH_MERKLE | depth;
+        data[i].size = bodies[i].size();
+        data[i].timestamp = timestamp;
+
+        packets[i] = build_packet(data[i], bodies[i]);
+        // The device address binds the leaf to its target
+        levels[0].push_back(merkle_digest(0x00, reinterpret_cast<const uint8_t *>(&devices[i]), sizeof(devices[i]),
+                                          packets[i].data(), packets[i].size()));
+        if (levels[0].back().empty()) {
+            return {};
+        }
+    }
+
+    while (levels.back().size() > 1) {
+        const std::vector<merkle_hash> &below = levels.back();
+        std::vector<merkle_hash> level;
+        for (size_t i = 0; i < below.size(); i += 2) {
+            if (i + 1 == below.size()) {
+                level.push_back(below[i]);
+                continue;
+            }
+            level.push_back(merkle_digest(0x01, below[i].data(), below[i].size(), below[i + 1].data(), below[i + 1].size()));
+            if (level.back().empty()) {
+                return {};
+            }
+        }
+        levels.push_back(level);
+    }
+
+    std::vector<uint8_t> signature = sign(pkey, compute_md5(levels.back().front()));
+    if (signature.empty()) {
+        std::cerr << "Merkle root sign error" << std::endl;
+        return {};
+    }
+
+    for (size_t i = 0; i < packets.size(); i++) {
+        merkle_tag tag = {};
+        std::vector<uint8_t> proof;
+        size_t index = i, step = 0;
+        for (size_t level = 0; level + 1 < levels.size(); level++, index /= 2) {
+            size_t sibling = index ^ 1;
+            if (sibling >= levels[level].size()) {
+                continue;
+            }
+            tag.path |= (uint32_t) (index & 1) << step++;
+            proof.insert(proof.end(), levels[level][sibling].begin(), levels[level][sibling].end());
+        }
+
+        const uint8_t *raw = reinterpret_cast<const uint8_t *>(&tag);
+        packets[i].insert(packets[i].end(), raw, raw + sizeof(tag));
+        packets[i].insert(packets[i].end(), proof.begin(), proof.end());
+        packets[i].insert(packets[i].end(), signature.begin(), signature.end());
+    }
+    return packets;
+}
+
+std::vector<uint8_t> build_session_payload(payload &data, const std::vector<uint8_t> &body, device_session &session) {
+    data.version = PAYLOAD_VERSION;
+    data.auth = AUTH_SESSION;
+    data.size = body.size();
+    data.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    std::vector<uint8_t> packet = build_packet(data, body);
+    session_tag tag = {};
+    tag.session = session.id;
+    tag.counter = ++session.counter;
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&tag);
+    packet.insert(packet.end(), raw, raw + offsetof(session_tag, mac));
+
+    uint8_t mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len = 0;
+    if (HMAC(EVP_sha256(), session.key.data(), session.key.size(), packet.data(), packet.size(), mac, &mac_len) == nullptr ||
+        mac_len < SESSION_MAC_SIZE) {
+        std::cerr << "HMAC failed: "
+                  << ERR_error_string(ERR_get_error(), nullptr) << std::endl;
+        return {};
+    }
+    packet.insert(packet.end(), mac, mac + SESSION_MAC_SIZE);
+    return packet;
+}
+
+/* Parses decimal volume into 1/VOLUME_SCALE fixed-point units */
+uint32_t parse_volume(const std::string &text) {
+    auto digits = [](const std::string &part) {
+        return !part.empty() && std::all_of(part.begin(), part.end(), [](char c) { return c >= '0' && c <= '9'; });
+    };
+
+    // digits[.digits], no sign or spaces
+    size_t dot = text.find('.');
+    std::string whole = text.substr(0, dot);
+    std::string fraction = dot == std::string::npos ? "" : text.substr(dot + 1);
+    if (!digits(whole) || (dot != std::string::npos && !digits(fraction))) {
+        throw std::invalid_argument("volume: " + text);
+    }
+
+    uint64_t value = 0;
+    for (char c: whole) {
+        value = value * 10 + (c - '0');
+        if (value > UINT32_MAX / VOLUME_SCALE) {
+            throw std::out_of_range("volume: " + text);
+        }
+    }
+    value *= VOLUME_SCALE;
+    // Digits past the resolution are dropped
+    uint64_t scale = VOLUME_SCALE;
+    for (size_t i = 0; i < fraction.size() && scale > 1; i++) {
+        scale /= 10;
+        value += (fraction[i] - '0') * scale;
+    }
+    if (value > UINT32_MAX) {
+        throw std::out_of_range("volume: " + text);
+    }
+    return static_cast<uint32_t>(value);
+}
+
+std::string format_volume(uint32_t volume) {
+    std::ostringstream out;
+    out << volume / VOLUME_SCALE << "." << std::setfill('0') << std::setw(3) << volume % VOLUME_SCALE;
+    return out.str();
+}
@@ -0,0 +1,128 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : protocol.h
+ * PURPOSE     : Device protocol helpers
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __PROTOCOL_H_
+#define __PROTOCOL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "../payload.h"
+#include "capture.h"
+
+std::vector<uint8_t> compute_md5(const std::vector<uint8_t> &data);
+
+EVP_PKEY *load_private_key(const std::string &key_path);
+
+std::vector<uint8_t> sign(std::shared_ptr<EVP_PKEY> pkey, const std::vector<uint8_t> &data);
+
+std::string to_hex(const std::vector<uint8_t> &data);
+
+std::vector<uint8_t> build_packet(const payload &data, const std::vector<uint8_t> &body);
+
+/* Random command id, never 0 */
+uint32_t make_command_id();
+
+/* Stamps, serializes and signs `data` with its command data */
+std::vector<uint8_t> build_payload(payload &data, const std::vector<uint8_t> &body, std::shared_ptr<EVP_PKEY> pkey, bool verbose = true);
+
+/* Stamps every `data` with one timestamp and authenticates them all with
+ * one RSA signature of a Merkle root, see AUTH_MERKLE. `devices` are the
+ * target addresses in network order, each leaf only verifies on its own.
+ * Packets are in the order of `data`, empty on failure */
+std::vector<std::vector<uint8_t>> build_merkle_payloads(std::vector<payload> &data, const std::vector<std::vector<uint8_t>> &bodies,
+                                                        const std::vector<uint32_t> &devices, std::shared_ptr<EVP_PKEY> pkey);
+
+/* Symmetric session opened with one signed CMD_SESSION_OPEN */
+struct device_session {
+    uint32_t id = 0;
+    uint32_t counter = 0;
+    std::vector<uint8_t> key;
+    std::chrono::steady_clock::time_point expires;
+
+    bool valid() const { return !key.empty() && std::chrono::steady_clock::now() < expires; }
+};
+
+/* Stamps, serializes and authenticates `data` with the session key */
+std::vector<uint8_t> build_session_payload(payload &data, const std::vector<uint8_t> &body, device_session &session);
+
+/* Parses decimal volume, digits[.digits], into 1/VOLUME_SCALE fixed-point
+ * units. Throws std::invalid_argument or std::out_of_range */
+uint32_t parse_volume(const std::string &text);
+
+std::string format_volume(uint32_t volume);
+
+/* Kept-alive TCP connection to a device */
+class device_connection {
+public:
+    enum class result {
+        ok,
+        send_failed,
+        closed, /* Device closed connection without reading the packet */
+        recv_failed
+    };
+
+    device_connection() = default;
+    device_connection(const device_connection &) = delete;
+    device_connection &operator=(const device_connection &) = delete;
+    ~device_connection();
+
+    bool connect(uint32_t host, uint16_t port, int timeout_ms = 5000);
+    void disconnect();
+    bool connected() const { return s >= 0; }
+    void set_verbose(bool value) { verbose = value; }
+
+    /* Send and receive timeout of the open connection */
+    void set_timeout(int timeout_ms);
+
+    /* Records sent packets and received frames, nullptr stops it */
+    void set_capture(std::shared_ptr<capture_writer> value) { capture = value; }
+
+    /* Sends one signed packet and reads its response, events that come
+     * first are kept for wait_event */
+    result transact(const std::vector<uint8_t> &packet, response &header, std::vector<uint8_t> &data);
+
+    /* Next pushed completion event, false on timeout or connection loss */
+    bool wait_event(pump_event &event, int timeout_ms);
+
+private:
+    bool receive_all(uint8_t *buf, size_t size);
+    result receive_frame(response &header, std::vector<uint8_t> &data);
+    void queue_event(const std::vector<uint8_t> &data);
+
+    int s = -1;
+    uint32_t host = 0;
+    uint16_t port = 0;
+    bool verbose = true;
+    std::deque<pump_event> events;
+    std::shared_ptr<capture_writer> capture;
+};
+
+/* Opens a session over `connection`, the device keeps it for its lifetime */
+bool open_session(device_connection &connection, std::shared_ptr<EVP_PKEY> pkey, device_session &session, bool verbose = true);
+
+class openssl_scope {
+public:
+    openssl_scope() { OPENSSL_init(); }
+    ~openssl_scope() { OPENSSL_cleanup(); }
+};
+
+#endif /* __PROTOCOL_H_ */
@@ -0,0 +1,304 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : replay.cpp
+ * PURPOSE     : Capture replay tool
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Re-drives a capture made with the client's --capture. Packets go out in
+ * captured order at captured pacing divided by --speed, every response is
+ * compared by status with the captured one.
+ *
+ * Devices drop packets older than their freshness window, so old captures
+ * replay with --resign: each packet gets a fresh timestamp and a signature
+ * of the test key, session packets become signed ones. Command IDs are
+ * remapped the same way for the whole run, so captured retries stay
+ * retries and a second run is not answered from the repeat cache. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "protocol.h"
+
+using replay_clock = std::chrono::steady_clock;
+
+#define DEVICE_PORT 30239
+
+struct replay_options {
+    bool target_set = false;
+    uint32_t host = 0;
+    uint16_t port = 0;
+    double speed = 1;
+    std::shared_ptr<EVP_PKEY> pkey; /* Re-signing key, nullptr sends packets as captured */
+};
+
+struct replay_stats {
+    size_t packets = 0;
+    size_t matched = 0;
+    size_t mismatched = 0;
+    size_t unanswered = 0; /* No captured response to compare with */
+    size_t failed = 0;
+    size_t events = 0;
+    size_t captured_events = 0;
+    int64_t latency_min_us = INT64_MAX;
+    int64_t latency_max_us = 0;
+    int64_t latency_sum_us = 0;
+    int64_t late_max_us = 0; /* Worst send time behind the schedule */
+};
+
+static std::string format_target(uint32_t host, uint16_t port) {
+    char name[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &host, name, sizeof(name));
+    return std::string(name) + ":" + std::to_string(port);
+}
+
+static bool parse_target(const std::string &text, uint32_t &host, uint16_t &port) {
+    size_t colon = text.find(':');
+    in_addr address;
+    if (inet_pton(AF_INET, text.substr(0, colon).c_str(), &address) != 1) {
+        std::cerr << "Invalid target: " << text << std::endl;
+        return false;
+    }
+    host = address.s_addr;
+    port = colon == std::string::npos ? DEVICE_PORT : std::stoul(text.substr(colon + 1));
+    return true;
+}
+
+static void list_capture(const std::vector<capture_entry> &entries) {
+    uint64_t start = entries.empty() ? 0 : entries.front().record.time_us;
+    static const char *kinds[] = {"finished", "aborted", "gpio error"};
+
+    for (const capture_entry &entry: entries) {
+        const capture_record &record = entry.record;
+        std::cout << "+" << std::fixed << std::setprecision(6) << (record.time_us - start) / 1e6 << "s "
+                  << format_target(record.host, record.port) << " ";
+
+        payload data;
+        response header;
+        pump_event event;
+        if (record.kind == CAPTURE_PACKET && entry.data.size() >= sizeof(data)) {
+            memcpy(&data, entry.data.data(), sizeof(data));
+            std::cout << "packet command " << (unsigned) data.command << " pin " << data.pin
+                      << " id 0x" << std::hex << data.id << std::dec
+                      << (data.auth == AUTH_SESSION ? " session" : " signed");
+        } else if (record.kind == CAPTURE_RESPONSE && entry.data.size() >= sizeof(header)) {
+            memcpy(&header, entry.data.data(), sizeof(header));
+            std::cout << "response status " << (unsigned) header.status;
+        } else if (record.kind == CAPTURE_EVENT && entry.data.size() == sizeof(header) + sizeof(event)) {
+            memcpy(&event, entry.data.data() + sizeof(header), sizeof(event));
+            std::cout << "event id 0x" << std::hex << event.id << std::dec << " pin " << (unsigned) event.pin << " "
+                      << (event.kind < std::size(kinds) ? kinds[event.kind] : "unknown") << " after " << event.elapsed << "ms";
+        } else {
+            std::cout << "record kind " << (unsigned) record.kind;
+        }
+        std::cout << ", " << record.size << " bytes" << std::endl;
+    }
+}
+
+/* Index of the captured response of every packet, -1 if none came */
+static std::vector<ssize_t> match_responses(const std::vector<capture_entry> &entries) {
+    std::vector<ssize_t> matches(entries.size(), -1);
+    std::map<std::pair<uint32_t, uint16_t>, std::deque<size_t>> waiting;
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const capture_record &record = entries[i].record;
+        std::deque<size_t> &queue = waiting[{record.host, record.port}];
+        if (record.kind == CAPTURE_PACKET) {
+            queue.push_back(i);
+        } else if (record.kind == CAPTURE_RESPONSE && !queue.empty()) {
+            matches[queue.front()] = i;
+            queue.pop_front();
+        }
+    }
+    return matches;
+}
+
+/* Fresh timestamp, mapped ID and test key signature for a captured packet */
+static std::vector<uint8_t> resign(const std::vector<uint8_t> &packet, std::shared_ptr<EVP_PKEY> pkey,
+                                   std::map<uint32_t, uint32_t> &ids) {
+    payload data;
+    if (packet.size() < sizeof(data)) {
+        return {};
+    }
+    memcpy(&data, packet.data(), sizeof(data));
+    if (packet.size() - sizeof(data) < data.size) {
+        return {};
+    }
+
+    std::vector<uint8_t> body(packet.begin() + sizeof(data), packet.begin() + sizeof(data) + data.size);
+    if (data.id != 0) {
+        auto found = ids.find(data.id);
+        data.id = found != ids.end() ? found->second : (ids[data.id] = make_command_id());
+    }
+    return build_payload(data, body, pkey, false);
+}
+
+static void replay(const std::vector<capture_entry> &entries, const replay_options &options, replay_stats &stats) {
+    std::vector<ssize_t> matches = match_responses(entries);
+    std::map<std::pair<uint32_t, uint16_t>, std::unique_ptr<device_connection>> connections;
+    std::map<uint32_t, uint32_t> ids;
+
+    auto first = std::find_if(entries.begin(), entries.end(), [](const capture_entry &entry) {
+        return entry.record.kind == CAPTURE_PACKET;
+    });
+    if (first == entries.end()) {
+        return;
+    }
+    const uint64_t captured_start = first->record.time_us;
+    const replay_clock::time_point start = replay_clock::now();
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const capture_record &record = entries[i].record;
+        if (record.kind == CAPTURE_EVENT) {
+            stats.captured_events++;
+        }
+        if (record.kind != CAPTURE_PACKET) {
+            continue;
+        }
+        stats.packets++;
+
+        std::vector<uint8_t> packet = options.pkey ? resign(entries[i].data, options.pkey, ids) : entries[i].data;
+        if (packet.empty()) {
+            std::cerr << "Record " << i << " is not a valid packet" << std::endl;
+            stats.failed++;
+            continue;
+        }
+
+        uint32_t host = options.target_set ? options.host : record.host;
+        uint16_t port = options.target_set ? options.port : record.port;
+        std::unique_ptr<device_connection> &connection = connections[{host, port}];
+        if (!connection) {
+            connection = std::make_unique<device_connection>();
+            connection->set_verbose(false);
+        }
+
+        auto offset = std::chrono::duration<double, std::micro>((record.time_us - captured_start) / options.speed);
+        replay_clock::time_point due = start + std::chrono::duration_cast<replay_clock::duration>(offset);
+        std::this_thread::sleep_until(due);
+
+        replay_clock::time_point sent = replay_clock::now();
+        stats.late_max_us = std::max<int64_t>(stats.late_max_us, std::chrono::duration_cast<std::chrono::microseconds>(sent - due).count());
+
+        response header;
+        std::vector<uint8_t> data;
+        if ((!connection->connected() && !connection->connect(host, port)) ||
+            connection->transact(packet, header, data) != device_connection::result::ok) {
+            std::cerr << "Record " << i << ": no response from " << format_target(host, port) << std::endl;
+            stats.failed++;
+            continue;
+        }
+
+        int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(replay_clock::now() - sent).count();
+        stats.latency_min_us = std::min(stats.latency_min_us, latency);
+        stats.latency_max_us = std::max(stats.latency_max_us, latency);
+        stats.latency_sum_us += latency;
+
+        response expected;
+        if (matches[i] < 0 || entries[matches[i]].data.size() < sizeof(expected)) {
+            stats.unanswered++;
+            continue;
+        }
+        memcpy(&expected, entries[matches[i]].data.data(), sizeof(expected));
+        if (expected.status == header.status) {
+            stats.matched++;
+        } else {
+            payload sent_data;
+            memcpy(&sent_data, packet.data(), sizeof(sent_data));
+            std::cerr << "Record " << i << ": command " << (unsigned) sent_data.command << " status "
+                      << (unsigned) header.status << ", captured " << (unsigned) expected.status << std::endl;
+            stats.mismatched++;
+        }
+    }
+
+    // Events that already came, later ones are not waited for
+    for (auto &item: connections) {
+        pump_event event;
+        while (item.second->wait_event(event, 0)) {
+            stats.events++;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    openssl_scope scope_guard;
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <capture> [--list]" << std::endl
+                  << "    [--target <IP[:PORT]>] [--speed <times faster>] [--resign <path_to_test_key.pem>]" << std::endl;
+        return 1;
+    }
+
+    std::vector<capture_entry> entries;
+    if (!capture_read(argv[1], entries)) {
+        return 2;
+    }
+
+    replay_options options;
+    for (int i = 2; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--list") {
+            list_capture(entries);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--target") {
+            if (!parse_target(value, options.host, options.port)) {
+                return 1;
+            }
+            options.target_set = true;
+        } else if (option == "--speed") {
+            options.speed = std::stod(value);
+        } else if (option == "--resign") {
+            options.pkey.reset(load_private_key(value), EVP_PKEY_free);
+            if (!options.pkey) {
+                std::cerr << "Failed to load private key" << std::endl;
+                return 2;
+            }
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (options.speed <= 0) {
+        std::cerr << "Speed must be positive" << std::endl;
+        return 1;
+    }
+
+    replay_stats stats;
+    replay_clock::time_point start = replay_clock::now();
+    replay(entries, options, stats);
+    double elapsed = std::chrono::duration<double>(replay_clock::now() - start).count();
+
+    size_t answered = stats.packets - stats.failed;
+    std::cout << "packets " << stats.packets << ", matched " << stats.matched << ", mismatched " << stats.mismatched
+              << ", not captured " << stats.unanswered << ", failed " << stats.failed << std::endl
+              << "events " << stats.events << ", captured " << stats.captured_events << std::endl
+              << std::fixed << std::setprecision(3) << "elapsed " << elapsed << "s, latest send "
+              << stats.late_max_us / 1000.0 << "ms behind" << std::endl;
+    if (answered != 0) {
+        std::cout << "latency min " << stats.latency_min_us / 1000.0 << "ms, avg "
+                  << stats.latency_sum_us / 1000.0 / answered << "ms, max " << stats.latency_max_us / 1000.0 << "ms" << std::endl;
+    }
+    return stats.failed == 0 && stats.mismatched == 0 ? 0 : 5;
+}
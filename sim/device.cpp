@@ -0,0 +1,215 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : device.cpp
+ * PURPOSE     : Simulated board, NVS, journal, sensors and clock
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Stands in for the firmware modules under the pump code. The board is
+ * the BOARD_SIM profile of the real pump_driver.c, it records every
+ * output write with its virtual time. NVS is kept in memory for one run,
+ * the journal keeps every record and channels have no flow sensors.
+ * Heap tracking needs the SDK allocator, it is left out. */
+
+#include "device.h"
+
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+
+#include "esp_timer.h"
+
+extern "C" {
+#include "board.h"
+#include "flow.h"
+#include "heap.h"
+#include "journal.h"
+#include "sntp.h"
+#include "storage.h"
+}
+
+static sim_outputs outputs;
+static std::vector<sim_dose> doses;
+static std::map<std::string, std::vector<uint8_t>> nvs;
+static uint64_t unix_start_us = 0;
+
+/* Adds the time since the last write to the totals */
+static void sim_outputs_account(int64_t now) {
+    size_t on = __builtin_popcount(outputs.state);
+    int64_t passed = now - outputs.changed_us;
+
+    if (on != 0) {
+        outputs.busy_us += passed;
+    }
+    if (on > 1) {
+        outputs.overlap_us += passed;
+    }
+    outputs.changed_us = now;
+}
+
+static bool sim_board_init(void) {
+    return true;
+}
+
+static bool sim_board_flush(pump_mask_t state, pump_mask_t changed, uint32_t *skew_cycles) {
+    int64_t now = esp_timer_get_time();
+    pump_mask_t updated = (outputs.state & ~changed) | (state & changed);
+
+    sim_outputs_account(now);
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        sim_channel &channel = outputs.channels[pin];
+        bool was_on = outputs.state & PUMP_MASK(pin), on = updated & PUMP_MASK(pin);
+
+        if (!was_on && on) {
+            channel.since_us = now;
+            channel.starts++;
+        } else if (was_on && !on) {
+            channel.on_us += now - channel.since_us;
+        }
+    }
+
+    outputs.state = updated;
+    outputs.writes++;
+    outputs.peak = std::max<size_t>(outputs.peak, __builtin_popcount(updated));
+    *skew_cycles = 0;
+    return true;
+}
+
+extern "C" const struct pump_board pump_board_sim = {
+        "sim",
+        PUMP_DRIVER_CHANNELS_MAX,
+        sim_board_init,
+        sim_board_flush,
+};
+
+const sim_outputs &sim_device_outputs() {
+    int64_t now = esp_timer_get_time();
+
+    sim_outputs_account(now);
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        if (outputs.state & PUMP_MASK(pin)) {
+            outputs.channels[pin].on_us += now - outputs.channels[pin].since_us;
+            outputs.channels[pin].since_us = now;
+        }
+    }
+    return outputs;
+}
+
+const std::vector<sim_dose> &sim_device_doses() {
+    return doses;
+}
+
+void sim_device_set_unix_start(uint64_t time_us) {
+    unix_start_us = time_us;
+}
+
+void heap_track_task(TaskHandle_t task) {
+}
+
+void heap_track_start(void) {
+}
+
+uint32_t heap_track_count(void) {
+    return 0;
+}
+
+void heap_track_log(void) {
+}
+
+void storage_init() {
+}
+
+bool storage_write(const char *key, const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    nvs[key].assign(bytes, bytes + size);
+    return true;
+}
+
+bool storage_read(const char *key, void *out_data, size_t *inout_size) {
+    auto found = nvs.find(key);
+    if (found == nvs.end()) {
+        return false;
+    }
+    if (*inout_size < found->second.size()) {
+        *inout_size = found->second.size();
+        return false;
+    }
+
+    *inout_size = found->second.size();
+    memcpy(out_data, found->second.data(), found->second.size());
+    return true;
+}
+
+bool journal_init(void) {
+    return true;
+}
+
+void journal_add(uint8_t pin, uint32_t time, uint32_t requested, uint32_t actual, enum dose_result result) {
+    doses.push_back({pin, requested, actual, (uint8_t) result});
+}
+
+size_t journal_query(const struct history_request *request, uint8_t *reply, size_t size) {
+    return 0;
+}
+
+bool flow_init(void) {
+    return true;
+}
+
+bool flow_set(int channel, const struct flow_config *config, size_t size) {
+    return false;
+}
+
+uint32_t flow_pulses(int channel, uint32_t volume) {
+    return 0;
+}
+
+void flow_arm(int channel, uint32_t pulses) {
+}
+
+void flow_watch(int channel, TaskHandle_t task) {
+}
+
+uint32_t flow_count(int channel) {
+    return 0;
+}
+
+uint32_t flow_volume(int channel) {
+    return 0;
+}
+
+void flow_disarm(int channel) {
+}
+
+void sntp_run(void) {
+}
+
+bool sntp_restore(void) {
+    return true;
+}
+
+bool sntp_time_valid(void) {
+    return true;
+}
+
+uint64_t sntp_now(void) {
+    return unix_start_us + esp_timer_get_time();
+}
+
+/* Firmware reads the wall clock with time(), this one takes the place
+ * of the C library's in the simulator */
+extern "C" time_t time(time_t *out) {
+    time_t now = (time_t) (sntp_now() / 1000000);
+    if (out != NULL) {
+        *out = now;
+    }
+    return now;
+}
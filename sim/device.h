@@ -0,0 +1,58 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : device.h
+ * PURPOSE     : Simulated board, NVS, journal, sensors and clock
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_DEVICE_H_
+#define __SIM_DEVICE_H_
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include "pump_driver.h"
+}
+
+struct sim_channel {
+    int64_t on_us = 0;     /* Total time on */
+    int64_t since_us = 0;  /* Switch on time while on */
+    size_t starts = 0;
+};
+
+/* Outputs of the simulated board over the run */
+struct sim_outputs {
+    pump_mask_t state = 0;
+    int64_t changed_us = 0; /* Time of the last write */
+    size_t writes = 0;
+    size_t peak = 0;        /* Most channels on at once */
+    int64_t busy_us = 0;    /* Time with any channel on */
+    int64_t overlap_us = 0; /* Time with two or more channels on */
+    sim_channel channels[PUMP_DRIVER_CHANNELS_MAX];
+};
+
+/* One journal_add call */
+struct sim_dose {
+    uint8_t pin;
+    uint32_t requested;
+    uint32_t actual;
+    uint8_t result; /* enum dose_result */
+};
+
+/* Outputs with time up to now counted */
+const sim_outputs &sim_device_outputs();
+
+const std::vector<sim_dose> &sim_device_doses();
+
+/* Unix time of virtual time 0 */
+void sim_device_set_unix_start(uint64_t time_us);
+
+#endif /* __SIM_DEVICE_H_ */
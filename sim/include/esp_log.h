@@ -0,0 +1,37 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : esp_log.h
+ * PURPOSE     : Simulated ESP logging
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_ESP_LOG_H_
+#define __SIM_ESP_LOG_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Printed with the virtual time when `level` is enabled, one of "EWIDV" */
+void sim_log(char level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#define ESP_LOGE(TAG, FORMAT, ...) sim_log('E', TAG, FORMAT, ##__VA_ARGS__)
+#define ESP_LOGW(TAG, FORMAT, ...) sim_log('W', TAG, FORMAT, ##__VA_ARGS__)
+#define ESP_LOGI(TAG, FORMAT, ...) sim_log('I', TAG, FORMAT, ##__VA_ARGS__)
+#define ESP_LOGD(TAG, FORMAT, ...) sim_log('D', TAG, FORMAT, ##__VA_ARGS__)
+#define ESP_LOGV(TAG, FORMAT, ...) sim_log('V', TAG, FORMAT, ##__VA_ARGS__)
+
+#endif /* __SIM_ESP_LOG_H_ */
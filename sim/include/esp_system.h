@@ -0,0 +1,29 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : esp_system.h
+ * PURPOSE     : Simulated ESP system calls
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_ESP_SYSTEM_H_
+#define __SIM_ESP_SYSTEM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Ends the simulation, a restart is always a firmware failure */
+void esp_restart(void) __attribute__((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SIM_ESP_SYSTEM_H_ */
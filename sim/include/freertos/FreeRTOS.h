@@ -0,0 +1,39 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : FreeRTOS.h
+ * PURPOSE     : Simulated FreeRTOS types
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_FREERTOS_H_
+#define __SIM_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  0
+#define pdPASS  1
+
+#define portMAX_DELAY      ((TickType_t) 0xFFFFFFFF)
+#define portTICK_PERIOD_MS 10
+#define pdMS_TO_TICKS(MS)  ((TickType_t) (MS) / portTICK_PERIOD_MS)
+
+#define tskIDLE_PRIORITY 0
+
+/* One simulated task runs at a time, nothing can come in between */
+#define portENTER_CRITICAL()
+#define portEXIT_CRITICAL()
+
+#endif /* __SIM_FREERTOS_H_ */
@@ -0,0 +1,31 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : ets_sys.h
+ * PURPOSE     : Simulated ROM functions
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_ETS_SYS_H_
+#define __SIM_ETS_SYS_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* MHz */
+uint32_t ets_get_cpu_frequency(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SIM_ETS_SYS_H_ */
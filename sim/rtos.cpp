@@ -0,0 +1,312 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : rtos.cpp
+ * PURPOSE     : Virtual clock and simulated CPU
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Every firmware task is a host thread, but only the one holding the
+ * simulated CPU runs. It gives the CPU away only where FreeRTOS would
+ * block it: a delay, a notify wait or a taken mutex. When no task is
+ * ready the clock jumps straight to the nearest wake up, so idle time
+ * costs nothing and a day passes in seconds.
+ *
+ * Code runs in zero virtual time and timeouts end on tick boundaries
+ * like on the device, timing error left in the results is the one of
+ * the firmware logic and its tick. Tasks are switched in a fixed order,
+ * so a run with the same input gives the same results. A task spinning
+ * on the clock would never let it move, the simulated code must block. */
+
+#include "rtos.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "rom/ets_sys.h"
+
+#define SIM_TICK_US (portTICK_PERIOD_MS * 1000LL)
+
+struct sim_mutex;
+
+struct sim_task {
+    std::string name;
+    std::condition_variable turn;
+    int64_t wake_us = SIM_FOREVER;
+    uint32_t notified = 0;
+    bool waits_notify = false;
+    sim_mutex *waits_mutex = nullptr;
+};
+
+struct sim_mutex {
+    sim_task *owner = nullptr;
+};
+
+/* Guards everything below, held by a thread only while it switches tasks */
+static std::mutex lock;
+
+static sim_task *running = nullptr;
+static std::deque<sim_task *> ready;
+static std::vector<sim_task *> blocked; /* In the order they blocked */
+static int64_t now_us = SIM_BOOT_US;
+static size_t tasks_count = 0;
+static size_t tasks_peak = 0;
+static std::string log_levels = "E";
+
+static thread_local sim_task *self = nullptr;
+
+/* Gives the CPU to the next ready task, the clock moves on if none is.
+ * The caller is already queued or blocked, or is gone */
+static void sim_next() {
+    if (ready.empty()) {
+        int64_t next = SIM_FOREVER;
+        for (const sim_task *task: blocked) {
+            next = std::min(next, task->wake_us);
+        }
+        if (next == SIM_FOREVER) {
+            fprintf(stderr, "Every task waits forever at %.6fs\n", now_us / 1e6);
+            std::_Exit(4);
+        }
+        now_us = std::max(now_us, next);
+
+        auto due = std::stable_partition(blocked.begin(), blocked.end(), [](const sim_task *task) {
+            return task->wake_us > now_us;
+        });
+        ready.insert(ready.end(), due, blocked.end());
+        blocked.erase(due, blocked.end());
+    }
+
+    running = ready.front();
+    ready.pop_front();
+    running->turn.notify_one();
+}
+
+static void sim_wait_turn(std::unique_lock<std::mutex> &guard) {
+    sim_task *task = self;
+    task->turn.wait(guard, [task] { return running == task; });
+}
+
+/* Blocks the running task until `wake_us` or an earlier sim_wake */
+static void sim_block(std::unique_lock<std::mutex> &guard, int64_t wake_us) {
+    self->wake_us = wake_us;
+    blocked.push_back(self);
+    sim_next();
+    sim_wait_turn(guard);
+
+    self->wake_us = SIM_FOREVER;
+    self->waits_notify = false;
+    self->waits_mutex = nullptr;
+}
+
+static void sim_wake(sim_task *task) {
+    auto found = std::find(blocked.begin(), blocked.end(), task);
+    if (found != blocked.end()) {
+        blocked.erase(found);
+        ready.push_back(task);
+    }
+}
+
+/* Tick interrupts end waits, the first one comes before a full tick */
+static int64_t sim_deadline(TickType_t ticks) {
+    if (ticks == portMAX_DELAY) {
+        return SIM_FOREVER;
+    }
+    return (now_us / SIM_TICK_US + (int64_t) ticks) * SIM_TICK_US;
+}
+
+void sim_rtos_attach(const char *name) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    self = new sim_task;
+    self->name = name;
+    running = self;
+    tasks_count++;
+    tasks_peak = std::max(tasks_peak, tasks_count);
+}
+
+int64_t sim_now_us() {
+    return now_us;
+}
+
+void sim_sleep_until(int64_t time_us) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (time_us > now_us) {
+        sim_block(guard, time_us);
+    }
+}
+
+size_t sim_tasks_count() {
+    return tasks_count;
+}
+
+size_t sim_tasks_peak() {
+    return tasks_peak;
+}
+
+void sim_log_levels(const char *levels) {
+    log_levels = levels;
+}
+
+void sim_log(char level, const char *tag, const char *format, ...) {
+    if (log_levels.find(level) == std::string::npos) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%12.6f %c (%s) ", now_us / 1e6, level, tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+int64_t esp_timer_get_time(void) {
+    return now_us;
+}
+
+void esp_restart(void) {
+    fprintf(stderr, "Device restarted at %.6fs\n", now_us / 1e6);
+    std::_Exit(4);
+}
+
+uint32_t ets_get_cpu_frequency(void) {
+    return 80;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                       void *parameters, UBaseType_t priority, TaskHandle_t *handle) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    sim_task *task = new sim_task;
+    task->name = name;
+    ready.push_back(task);
+    tasks_count++;
+    tasks_peak = std::max(tasks_peak, tasks_count);
+
+    std::thread([task, function, parameters] {
+        std::unique_lock<std::mutex> guard(lock);
+        self = task;
+        sim_wait_turn(guard);
+        guard.unlock();
+
+        function(parameters);
+
+        guard.lock();
+        tasks_count--;
+        sim_next();
+        delete task;
+    }).detach();
+
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task != NULL && task != self) {
+        fprintf(stderr, "Deleting other tasks is not simulated\n");
+        std::_Exit(4);
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (ticks != 0) {
+        sim_block(guard, sim_deadline(ticks));
+        return;
+    }
+
+    ready.push_back(self);
+    sim_next();
+    sim_wait_turn(guard);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return self;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (now_us / SIM_TICK_US);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (self->notified == 0 && ticks != 0) {
+        self->waits_notify = true;
+        sim_block(guard, sim_deadline(ticks));
+    }
+
+    uint32_t value = self->notified;
+    self->notified = clear || value == 0 ? 0 : value - 1;
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    std::lock_guard<std::mutex> guard(lock);
+    task->notified++;
+    if (task->waits_notify) {
+        sim_wake(task);
+    }
+    return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return new sim_mutex;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t mutex) {
+    delete mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t ticks) {
+    std::unique_lock<std::mutex> guard(lock);
+    int64_t deadline = sim_deadline(ticks);
+
+    while (mutex->owner != nullptr) {
+        if (now_us >= deadline) {
+            return pdFALSE;
+        }
+        self->waits_mutex = mutex;
+        sim_block(guard, deadline);
+    }
+    mutex->owner = self;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex) {
+    std::lock_guard<std::mutex> guard(lock);
+    mutex->owner = nullptr;
+
+    std::vector<sim_task *> waiting;
+    for (sim_task *task: blocked) {
+        if (task->waits_mutex == mutex) {
+            waiting.push_back(task);
+        }
+    }
+    for (sim_task *task: waiting) {
+        sim_wake(task);
+    }
+    return pdTRUE;
+}
@@ -0,0 +1,43 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : rtos.h
+ * PURPOSE     : Virtual clock and simulated CPU
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+#ifndef __SIM_RTOS_H_
+#define __SIM_RTOS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#define SIM_FOREVER INT64_MAX
+
+/* esp_timer time the simulation starts at, a device is some time up
+ * before its first command */
+#define SIM_BOOT_US 1000000LL
+
+/* Makes the calling thread the running task, once before anything else */
+void sim_rtos_attach(const char *name);
+
+/* Virtual microseconds since boot */
+int64_t sim_now_us();
+
+/* Blocks the calling task until virtual time `time_us` */
+void sim_sleep_until(int64_t time_us);
+
+/* Tasks alive now and at most */
+size_t sim_tasks_count();
+size_t sim_tasks_peak();
+
+/* Levels printed by sim_log, a subset of "EWIDV" */
+void sim_log_levels(const char *levels);
+
+#endif /* __SIM_RTOS_H_ */
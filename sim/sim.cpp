@@ -0,0 +1,473 @@
+/*************************************************************
+ * Copyright (C) 2025
+ *    Konstantin Mitish
+ *************************************************************/
+
+/* FILE NAME   : sim.cpp
+ * PURPOSE     : Pump scheduling simulator
+ * PROGRAMMER  : KM6.
+ * LAST UPDATE : 19.10.2026.
+ *
+ * No part of this file may be changed without agreement of
+ * Konstantin Mitish
+ */
+
+/* Runs the firmware pump, power queue and schedule code on the virtual
+ * clock of rtos.cpp. Commands come from a capture made with the client's
+ * --capture, from random doses or both, and are executed at their
+ * captured time or execute_at like the server would. Retries of a command
+ * are dropped like the repeat cache drops them.
+ *
+ * Queue waits come from pump events, so they cover commanded doses only,
+ * scheduled doses do not ask for events.
+ *
+ * --scenario runs a built-in command sequence instead and checks its
+ * outcome, the exit code tells whether it held. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+#include "device.h"
+#include "rtos.h"
+
+extern "C" {
+#include "flow.h"
+#include "journal.h"
+#include "power.h"
+#include "pump.h"
+#include "schedule.h"
+}
+
+using sim_clock = std::chrono::steady_clock;
+
+/* Longest run past the end for doses still on */
+#define SIM_DRAIN_MAX_US (60 * 60 * 1000000LL)
+
+#define SIM_REPLY_SIZE 512
+
+/* Random doses get IDs from here, away from captured ones */
+#define SIM_SYNTHETIC_ID 0x80000000
+
+/* Scenario timings may be off by a tick or two */
+#define SIM_SCENARIO_SLACK_MS 30
+
+struct sim_command {
+    int64_t at_us; /* Virtual time */
+    payload packet;
+    std::vector<uint8_t> body;
+};
+
+struct sim_options {
+    std::string capture;
+    std::string scenario;
+    double per_hour = 0; /* Random doses, 0 for none */
+    double hours = 0;    /* Run length, 0 runs to the last command */
+    size_t channels = 8; /* Random doses go to channels below this */
+    uint32_t dose_min_ms = 5000;
+    uint32_t dose_max_ms = 60000;
+    uint32_t seed = 1;
+    uint16_t budget_ma = 0; /* Power config is set only with a budget */
+    uint16_t pump_ma = 250;
+};
+
+struct sim_stats {
+    size_t commands = 0;
+    size_t repeats = 0;  /* Retries dropped */
+    size_t rejected = 0;
+    size_t ignored = 0;  /* Not pump commands */
+    std::vector<uint32_t> waits;
+    size_t events[EVENT_GPIO_ERROR + 1] = {0};
+    std::vector<pump_event> received;
+};
+
+static sim_stats stats;
+
+static void sim_listener(const struct pump_origin *origin, const struct pump_event *event) {
+    stats.waits.push_back(event->waited);
+    stats.received.push_back(*event);
+    if (event->kind <= EVENT_GPIO_ERROR) {
+        stats.events[event->kind]++;
+    }
+}
+
+static bool load_capture(const std::string &path, std::vector<sim_command> &commands, uint64_t &unix_start_us) {
+    std::vector<capture_entry> entries;
+    if (!capture_read(path, entries)) {
+        return false;
+    }
+
+    std::set<uint32_t> ids;
+    bool first = true;
+    for (const capture_entry &entry: entries) {
+        sim_command command;
+        if (entry.record.kind != CAPTURE_PACKET || entry.data.size() < sizeof(command.packet)) {
+            continue;
+        }
+        memcpy(&command.packet, entry.data.data(), sizeof(command.packet));
+        if (entry.data.size() - sizeof(command.packet) < command.packet.size) {
+            continue;
+        }
+
+        // The first packet comes one boot time after the start
+        if (first) {
+            unix_start_us = entry.record.time_us - SIM_BOOT_US;
+            first = false;
+        }
+        if (command.packet.id != 0 && !ids.insert(command.packet.id).second) {
+            stats.repeats++;
+            continue;
+        }
+
+        uint64_t at = command.packet.execute_at != 0 ? command.packet.execute_at : entry.record.time_us;
+        command.at_us = std::max<int64_t>(at - unix_start_us, SIM_BOOT_US);
+        command.body.assign(entry.data.begin() + sizeof(command.packet),
+                            entry.data.begin() + sizeof(command.packet) + command.packet.size);
+        commands.push_back(command);
+    }
+    return true;
+}
+
+/* Timed doses on random channels, Poisson arrivals */
+static void make_synthetic(const sim_options &options, int64_t end_us, std::vector<sim_command> &commands) {
+    std::mt19937 random(options.seed);
+    std::exponential_distribution<double> gap(options.per_hour / 3600e6);
+    std::uniform_int_distribution<uint32_t> pin(0, options.channels - 1);
+    std::uniform_int_distribution<uint32_t> time(options.dose_min_ms, options.dose_max_ms);
+    uint32_t id = SIM_SYNTHETIC_ID;
+
+    for (double at = SIM_BOOT_US + gap(random); at < end_us; at += gap(random)) {
+        sim_command command = {};
+        command.at_us = (int64_t) at;
+        command.packet.version = PAYLOAD_VERSION;
+        command.packet.id = id++;
+        command.packet.command = CMD_PUMP_WORK_TIME;
+        command.packet.pin = pin(random);
+        command.packet.time = time(random);
+        commands.push_back(command);
+    }
+}
+
+static sim_command scenario_dose(double at_s, uint32_t id, uint32_t pin, uint32_t time_ms) {
+    sim_command command = {};
+    command.at_us = SIM_BOOT_US + (int64_t) (at_s * 1e6);
+    command.packet.version = PAYLOAD_VERSION;
+    command.packet.id = id;
+    command.packet.command = CMD_PUMP_WORK_TIME;
+    command.packet.pin = pin;
+    command.packet.time = time_ms;
+    return command;
+}
+
+static sim_command scenario_group(double at_s, uint32_t id, const std::vector<group_step> &steps) {
+    sim_command command = scenario_dose(at_s, id, 0, 0);
+    command.packet.command = CMD_PUMP_WORK_GROUP;
+    command.packet.size = steps.size() * sizeof(group_step);
+    command.body.resize(command.packet.size);
+    memcpy(command.body.data(), steps.data(), command.packet.size);
+    return command;
+}
+
+/* Doses for channels that are on or queued. Each waits behind the earlier
+ * one, the channel is never switched by two doses at once */
+static void make_same_channel(std::vector<sim_command> &commands) {
+    group_step first = {}, second = {};
+    first.command = second.command = CMD_PUMP_WORK_TIME;
+    first.pin = 0;
+    second.pin = 1;
+    first.time = second.time = 2000;
+
+    commands.push_back(scenario_dose(1, 1, 0, 10000));       // 1..11s
+    commands.push_back(scenario_dose(3, 2, 0, 5000));        // 11..16s behind 1
+    commands.push_back(scenario_group(4, 3, {first, second})); // 16..18s behind 2
+    commands.push_back(scenario_dose(5, 4, 1, 1000));        // 18..19s behind 3, pin 1 is free
+}
+
+static bool check_same_channel() {
+    const sim_outputs &outputs = sim_device_outputs();
+    const std::vector<sim_dose> &doses = sim_device_doses();
+    // Command, its wait in milliseconds
+    const std::vector<std::pair<uint32_t, uint32_t>> waits = {{1, 0}, {2, 8000}, {3, 12000}, {3, 12000}, {4, 13000}};
+    bool ok = true;
+
+    auto expect = [&ok](bool condition, const std::string &what) {
+        if (!condition) {
+            std::cout << "FAILED: " << what << std::endl;
+            ok = false;
+        }
+    };
+    auto near = [](int64_t value, int64_t expected) {
+        return std::llabs(value - expected) <= SIM_SCENARIO_SLACK_MS;
+    };
+
+    expect(stats.rejected == 0, "every dose accepted");
+    expect(doses.size() == waits.size(), "one journal record per channel of a dose");
+    for (const sim_dose &dose: doses) {
+        expect(dose.result == DOSE_DONE && near(dose.actual, dose.requested),
+               "pin " + std::to_string(dose.pin) + " ran " + std::to_string(dose.actual) + "ms of " +
+               std::to_string(dose.requested) + "ms");
+    }
+    expect(stats.received.size() == waits.size(), "one event per channel of a dose");
+    for (size_t i = 0; i < std::min(stats.received.size(), waits.size()); i++) {
+        const pump_event &event = stats.received[i];
+        expect(event.id == waits[i].first && event.kind == EVENT_FINISHED && near(event.waited, waits[i].second),
+               "command " + std::to_string(event.id) + " waited " + std::to_string(event.waited) + "ms");
+    }
+    expect(outputs.channels[0].starts == 3 && near(outputs.channels[0].on_us / 1000, 17000), "pin 0 on three times for 17s");
+    expect(outputs.channels[1].starts == 2 && near(outputs.channels[1].on_us / 1000, 3000), "pin 1 on twice for 3s");
+    expect(outputs.peak == 2, "at most the group runs at once");
+    return ok;
+}
+
+/* Pump commands the way the server runs them */
+static void sim_execute(const payload &packet, const uint8_t *body) {
+    struct pump_origin origin = {1, packet.id};
+    uint8_t reply[SIM_REPLY_SIZE];
+    size_t reply_size = 0;
+    bool ok;
+
+    switch (packet.command) {
+        case CMD_PUMP_WORK_VOLUME:
+            ok = pump_work_volume(packet.pin, packet.volume, &origin);
+            break;
+        case CMD_PUMP_WORK_TIME:
+            ok = pump_work_time(packet.pin, packet.time, &origin);
+            break;
+        case CMD_PUMP_WORK_GROUP:
+            ok = packet.size % sizeof(struct group_step) == 0 &&
+                 pump_work_group((const struct group_step *) body, packet.size / sizeof(struct group_step), NULL, &origin);
+            break;
+        case CMD_PUMP_STOP:
+            ok = pump_stop(packet.pin, packet.time, reply, sizeof(reply), &reply_size);
+            break;
+        case CMD_PUMP_CALLIBRATE:
+            ok = packet.size % sizeof(struct calibration_point) == 0 &&
+                 pump_callibrate(packet.pin, (const struct calibration_point *) body,
+                                 packet.size / sizeof(struct calibration_point));
+            break;
+        case CMD_POWER_SET:
+            ok = pump_set_power((const struct power_config *) body, packet.size);
+            break;
+        case CMD_SCHEDULE_SET:
+            ok = schedule_set(body, packet.size);
+            break;
+        case CMD_BATCH:
+            for (size_t offset = 0; offset + sizeof(struct batch_item) <= packet.size;) {
+                struct batch_item item;
+                memcpy(&item, body + offset, sizeof(item));
+                offset += sizeof(item);
+                if (packet.size - offset < item.size) {
+                    break;
+                }
+
+                payload step = packet;
+                step.command = item.command;
+                step.pin = item.pin;
+                step.volume = item.volume;
+                step.time = item.time;
+                step.size = item.size;
+                sim_execute(step, body + offset);
+                offset += item.size;
+            }
+            return;
+        default:
+            stats.ignored++;
+            return;
+    }
+
+    if (!ok) {
+        stats.rejected++;
+    }
+}
+
+template<typename T>
+static T sim_percentile(std::vector<T> values, double share) {
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t) (share * values.size()))];
+}
+
+static void report(int64_t duration_us, double wall_s) {
+    const sim_outputs &outputs = sim_device_outputs();
+    const std::vector<sim_dose> &doses = sim_device_doses();
+
+    std::cout << std::fixed << std::setprecision(3) << "simulated " << duration_us / 3600e6 << "h in " << wall_s
+              << "s, " << std::setprecision(0) << duration_us / 1e6 / std::max(wall_s, 1e-6) << " times real time"
+              << std::endl
+              << "commands " << stats.commands << ", rejected " << stats.rejected << ", not pump commands "
+              << stats.ignored << ", retries dropped " << stats.repeats << std::endl;
+
+    std::vector<int64_t> errors;
+    size_t failed = 0;
+    for (const sim_dose &dose: doses) {
+        if (dose.result != DOSE_DONE) {
+            failed++;
+        } else if (dose.requested != 0) {
+            errors.push_back((int64_t) dose.actual - dose.requested);
+        }
+    }
+    std::cout << "doses " << doses.size() << ", done " << doses.size() - failed << ", failed or stopped " << failed
+              << std::endl;
+    if (!errors.empty()) {
+        std::vector<int64_t> absolute(errors.size());
+        int64_t sum = 0;
+        for (size_t i = 0; i < errors.size(); i++) {
+            sum += errors[i];
+            absolute[i] = std::llabs(errors[i]);
+        }
+        std::cout << std::setprecision(2) << "timing error avg " << (double) sum / errors.size() << "ms, p99 "
+                  << sim_percentile(absolute, 0.99) << "ms, max " << sim_percentile(absolute, 1) << "ms" << std::endl;
+    }
+
+    if (!stats.waits.empty()) {
+        size_t queued = std::count_if(stats.waits.begin(), stats.waits.end(), [](uint32_t wait) { return wait != 0; });
+        uint64_t sum = 0;
+        for (uint32_t wait: stats.waits) {
+            sum += wait;
+        }
+        std::cout << "queue waits " << queued << " of " << stats.waits.size() << " events, avg "
+                  << (double) sum / stats.waits.size() << "ms, p95 " << sim_percentile(stats.waits, 0.95)
+                  << "ms, max " << sim_percentile(stats.waits, 1) << "ms" << std::endl
+                  << "events finished " << stats.events[EVENT_FINISHED] << ", aborted " << stats.events[EVENT_ABORTED]
+                  << ", gpio error " << stats.events[EVENT_GPIO_ERROR] << std::endl;
+    }
+
+    double span = std::max<int64_t>(duration_us, 1);
+    std::cout << std::setprecision(1) << "overlap peak " << outputs.peak << " channels, two or more on "
+              << outputs.overlap_us * 100 / span << "%, any on " << outputs.busy_us * 100 / span << "%" << std::endl
+              << "output writes " << outputs.writes << ", tasks at most " << sim_tasks_peak() << std::endl
+              << "channel  starts      on time  utilization" << std::endl;
+    for (size_t pin = 0; pin < PUMP_DRIVER_CHANNELS_MAX; pin++) {
+        const sim_channel &channel = outputs.channels[pin];
+        if (channel.starts == 0) {
+            continue;
+        }
+        std::cout << std::setw(7) << pin << std::setw(8) << channel.starts << std::setw(12) << std::setprecision(1)
+                  << channel.on_us / 1e6 << "s" << std::setw(12) << channel.on_us * 100 / span << "%" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " [--capture <file>] [--synthetic <doses per hour>] [--hours <run length>]" << std::endl
+                  << "    [--scenario same-channel]" << std::endl
+                  << "    [--channels <N>] [--dose-ms <min>:<max>] [--seed <N>]" << std::endl
+                  << "    [--budget <mA>] [--pump-ma <mA>] [--log <levels of EWIDV>]" << std::endl;
+        return 1;
+    }
+
+    sim_options options;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << std::endl;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (option == "--capture") {
+            options.capture = value;
+        } else if (option == "--scenario") {
+            options.scenario = value;
+        } else if (option == "--synthetic") {
+            options.per_hour = std::stod(value);
+        } else if (option == "--hours") {
+            options.hours = std::stod(value);
+        } else if (option == "--channels") {
+            options.channels = std::stoul(value);
+        } else if (option == "--dose-ms") {
+            size_t colon = value.find(':');
+            options.dose_min_ms = std::stoul(value.substr(0, colon));
+            options.dose_max_ms = colon == std::string::npos ? options.dose_min_ms : std::stoul(value.substr(colon + 1));
+        } else if (option == "--seed") {
+            options.seed = std::stoul(value);
+        } else if (option == "--budget") {
+            options.budget_ma = std::stoul(value);
+        } else if (option == "--pump-ma") {
+            options.pump_ma = std::stoul(value);
+        } else if (option == "--log") {
+            sim_log_levels(value.c_str());
+        } else {
+            std::cerr << "Unknown option " << option << std::endl;
+            return 1;
+        }
+    }
+    if (options.channels == 0 || options.channels > PUMP_DRIVER_CHANNELS_MAX || options.dose_min_ms > options.dose_max_ms ||
+        options.per_hour < 0 || options.hours < 0) {
+        std::cerr << "Invalid options" << std::endl;
+        return 1;
+    }
+    if (options.per_hour != 0 && options.hours == 0) {
+        options.hours = 24;
+    }
+
+    // Without a capture the day starts at midnight UTC, schedules fire as set
+    std::vector<sim_command> commands;
+    uint64_t unix_start_us = (uint64_t) std::chrono::duration_cast<std::chrono::hours>(
+            std::chrono::system_clock::now().time_since_epoch()).count() / 24 * 24 * 3600000000ULL;
+    if (!options.capture.empty() && !load_capture(options.capture, commands, unix_start_us)) {
+        return 2;
+    }
+
+    int64_t end_us = SIM_BOOT_US + (int64_t) (options.hours * 3600e6);
+    if (options.per_hour != 0) {
+        make_synthetic(options, end_us, commands);
+    }
+    if (options.scenario == "same-channel") {
+        make_same_channel(commands);
+    } else if (!options.scenario.empty()) {
+        std::cerr << "Unknown scenario " << options.scenario << std::endl;
+        return 1;
+    }
+    std::stable_sort(commands.begin(), commands.end(), [](const sim_command &a, const sim_command &b) {
+        return a.at_us < b.at_us;
+    });
+    if (options.hours == 0 && !commands.empty()) {
+        end_us = commands.back().at_us;
+    }
+
+    sim_rtos_attach("Server task");
+    sim_device_set_unix_start(unix_start_us);
+    if (!pump_init() || !power_init() || !flow_init() || !journal_init() || !schedule_init()) {
+        std::cerr << "Firmware init failed" << std::endl;
+        return 3;
+    }
+    pump_set_listener(sim_listener);
+
+    if (options.budget_ma != 0) {
+        struct power_config config = {};
+        config.budget_ma = options.budget_ma;
+        config.channels_count = POWER_MAX_CHANNELS;
+        std::fill(std::begin(config.current_ma), std::end(config.current_ma), options.pump_ma);
+        if (!pump_set_power(&config, sizeof(config))) {
+            return 3;
+        }
+    }
+
+    sim_clock::time_point started = sim_clock::now();
+    for (const sim_command &command: commands) {
+        sim_sleep_until(command.at_us);
+        stats.commands++;
+        sim_execute(command.packet, command.body.data());
+    }
+    sim_sleep_until(end_us);
+    while (sim_device_outputs().state != 0 && sim_now_us() < end_us + SIM_DRAIN_MAX_US) {
+        sim_sleep_until(sim_now_us() + 1000000);
+    }
+
+    report(sim_now_us() - SIM_BOOT_US, std::chrono::duration<double>(sim_clock::now() - started).count());
+    bool held = options.scenario.empty() || check_same_channel();
+    if (!options.scenario.empty()) {
+        std::cout << "scenario " << options.scenario << (held ? " held" : " failed") << std::endl;
+    }
+
+    // Firmware tasks never end, the process goes with them
+    std::cout.flush();
+    std::_Exit(held ? 0 : 4);
+}